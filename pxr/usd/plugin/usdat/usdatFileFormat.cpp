@@ -33,38 +33,228 @@
 
 #include "pxr/usd/usdat/usdatFileFormat.h"
 
-#include <boost/xpressive/xpressive.hpp>
-
+#include <cfloat>
+#include <cstring>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
-#include <cstdio>
+#include <vector>
 
-using namespace boost;
-using namespace xpressive;
+PXR_NAMESPACE_USING_DIRECTIVE
 
 namespace
 {
-    struct pa_replace
+    // A ${keyword} occurrence in the template text.
+    struct _Template
+    {
+        size_t offset;      // Offset of the '$'
+        size_t length;      // Length of the whole ${keyword} token
+        std::string keyword;
+    };
+
+    typedef std::vector<_Template> _TemplateList;
+
+    // Template text and the location of its ${keyword} tokens. The text is
+    // either a read-only mapping of the file or a borrowed string.
+    struct _TemplateIndex
+    {
+        ArchConstFileMapping mapping;
+        const char* data;
+        size_t size;
+        double mtime;
+        _TemplateList templates;
+
+        _TemplateIndex() : data(nullptr), size(0), mtime(0.0) {}
+    };
+
+    typedef std::shared_ptr<const _TemplateIndex> _TemplateIndexPtr;
+
+    inline bool
+    _IsWordChar(char c)
+    {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+               (c >= '0' && c <= '9') || c == '_';
+    }
+
+    // Find all ${keyword} tokens in one linear scan, matching the
+    // "${" >> +_w >> "}" pattern that was previously used.
+    void
+    _FindTemplates(const char* data, size_t size, _TemplateList* templates)
+    {
+        const char* const end = data + size;
+        const char* p = data;
+        while (p < end) {
+            p = static_cast<const char*>(std::memchr(p, '$', end - p));
+            if (!p) {
+                break;
+            }
+            if (p + 1 >= end || p[1] != '{') {
+                ++p;
+                continue;
+            }
+            const char* k = p + 2;
+            const char* kend = k;
+            while (kend < end && _IsWordChar(*kend)) {
+                ++kend;
+            }
+            if (kend == k || kend >= end || *kend != '}') {
+                ++p;
+                continue;
+            }
+            _Template t;
+            t.offset = p - data;
+            t.length = (kend + 1) - p;
+            t.keyword.assign(k, kend - k);
+            templates->push_back(t);
+            p = kend + 1;
+        }
+    }
+
+    // Copy the text into 'out' replacing each template whose keyword is in
+    // 'args'. Templates without a matching argument are left intact. The
+    // output size is computed first so this is a single allocation and copy.
+    void
+    _ExpandTemplates(const char* data, size_t size,
+                     const _TemplateList& templates,
+                     const SdfFileFormat::FileFormatArguments& args,
+                     std::string* out)
+    {
+        std::vector<const std::string*> values(templates.size(), nullptr);
+        size_t outSize = size;
+        for (size_t i = 0; i < templates.size(); ++i) {
+            const auto it = args.find(templates[i].keyword);
+            if (it != args.end()) {
+                values[i] = &it->second;
+                outSize = outSize - templates[i].length + it->second.size();
+            }
+        }
+
+        out->clear();
+        out->reserve(outSize);
+        size_t pos = 0;
+        for (size_t i = 0; i < templates.size(); ++i) {
+            if (!values[i]) {
+                continue;
+            }
+            out->append(data + pos, templates[i].offset - pos);
+            out->append(*values[i]);
+            pos = templates[i].offset + templates[i].length;
+        }
+        out->append(data + pos, size - pos);
+    }
+
+    // Template indices keyed by resolved path and modification time, so an
+    // edited template is re-indexed rather than served stale. The size is
+    // checked as well in case the mtime resolution misses an edit. Entries
+    // hold a mapping of the file rather than a copy, and the least recently
+    // used ones are dropped once the cache holds more than _maxEntries files
+    // or _maxBytes of mapped text. Readers keep their entry alive through
+    // the shared pointer until they're done with it.
+    class _TemplateIndexCache
     {
-        typedef std::map<std::string, std::string> stringmap;
-        stringmap lut;
-
-        template<typename Out>
-        Out operator()(smatch const &var, Out out) const {
-            stringmap::const_iterator lutIter = lut.find(var[1]);
-            if(lutIter != lut.end()) {
-                std::copy(lutIter->second.begin(), lutIter->second.end(), out);
+    public:
+        static _TemplateIndexCache& GetInstance()
+        {
+            static _TemplateIndexCache cache;
+            return cache;
+        }
+
+        _TemplateIndexPtr Get(const std::string& resolvedPath)
+        {
+            double mtime = 0.0;
+            if (!ArchGetModificationTime(resolvedPath.c_str(), &mtime)) {
+                return _TemplateIndexPtr();
             }
-            else {
-                // leave variables in tact if no match
-                std::string orig = "${";
-                orig += var[1];
-                orig += "}";
-                std::copy(orig.begin(), orig.end(), out);
+            const int64_t fileSize = ArchGetFileLength(resolvedPath.c_str());
+            if (fileSize < 0) {
+                return _TemplateIndexPtr();
             }
+            const _Key key(resolvedPath, mtime);
 
-            return out;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                const auto it = _entries.find(key);
+                if (it != _entries.end() &&
+                    it->second.index->size == size_t(fileSize)) {
+                    // Move to the front of the LRU list:
+                    _lru.splice(_lru.begin(), _lru, it->second.lruIt);
+                    return it->second.index;
+                }
+            }
+
+            // Build outside the lock so unrelated files don't wait on this
+            // one. If another thread builds the same index the last one wins,
+            // which is harmless since they're identical.
+            std::shared_ptr<_TemplateIndex> index(new _TemplateIndex);
+            index->mtime = mtime;
+            if (fileSize > 0) {
+                index->mapping = ArchMapFileReadOnly(resolvedPath);
+                if (!index->mapping) {
+                    return _TemplateIndexPtr();
+                }
+                index->data = index->mapping.get();
+                index->size = ArchGetFileMappingLength(index->mapping);
+                _FindTemplates(index->data, index->size, &index->templates);
+            }
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            // Replace any entry for the same file, including ones for
+            // older modification times:
+            _Erase(_entries.lower_bound(_Key(resolvedPath, -DBL_MAX)),
+                   resolvedPath);
+            _lru.push_front(key);
+            _Entry& entry = _entries[key];
+            entry.index = index;
+            entry.lruIt = _lru.begin();
+            _bytes += index->size;
+            _Trim();
+            return index;
         }
 
+    private:
+        typedef std::pair<std::string, double> _Key;
+
+        struct _Entry
+        {
+            _TemplateIndexPtr index;
+            std::list<_Key>::iterator lruIt;
+        };
+
+        typedef std::map<_Key, _Entry> _EntryMap;
+
+        static const size_t _maxEntries = 64;
+        static const size_t _maxBytes = size_t(256) * 1024 * 1024;
+
+        // Erase the consecutive entries for 'path' starting at 'it'.
+        // Mutex must be held.
+        void _Erase(_EntryMap::iterator it, const std::string& path)
+        {
+            while (it != _entries.end() && it->first.first == path) {
+                _bytes -= it->second.index->size;
+                _lru.erase(it->second.lruIt);
+                it = _entries.erase(it);
+            }
+        }
+
+        // Drop least recently used entries until within the limits, always
+        // keeping the most recent one. Mutex must be held.
+        void _Trim()
+        {
+            while (_lru.size() > 1 &&
+                   (_lru.size() > _maxEntries || _bytes > _maxBytes)) {
+                const auto it = _entries.find(_lru.back());
+                _bytes -= it->second.index->size;
+                _entries.erase(it);
+                _lru.pop_back();
+            }
+        }
+
+        std::mutex _mutex;
+        _EntryMap _entries;
+        std::list<_Key> _lru;   // Most recently used first
+        size_t _bytes = 0;      // Mapped bytes of all entries
     };
 }
 
@@ -112,20 +302,23 @@ UsdUsdatFileFormat::Read(
 {
     TRACE_FUNCTION();
 
-    std::FILE* fp = ArchOpenFile(resolvedPath.c_str(), "rb");
-    if (!fp) {
+    const _TemplateIndexPtr index =
+        _TemplateIndexCache::GetInstance().Get(resolvedPath);
+    if (!index) {
         return false;
     }
 
-    // Read file into a string
     std::string fileText;
-    std::fseek(fp, 0, SEEK_END);
-    fileText.resize(std::ftell(fp));
-    std::rewind(fp);
-    std::fread(&fileText[0], 1, fileText.size(), fp);
-    std::fclose(fp);
+    if (index->templates.empty()) {
+        // Nothing to substitute
+        fileText.assign(index->data, index->size);
+    }
+    else {
+        _ExpandTemplates(index->data, index->size, index->templates,
+                         layer->GetFileFormatArguments(), &fileText);
+    }
 
-    return ReadFromString(layer, fileText);
+    return SdfTextFileFormat::ReadFromString(layer, fileText);
 }
 
 bool
@@ -133,11 +326,17 @@ UsdUsdatFileFormat::ReadFromString(
     SdfLayer* layer,
     const std::string& str) const
 {
-    pa_replace formatter;
-    formatter.lut = layer->GetFileFormatArguments();
+    TRACE_FUNCTION();
+
+    _TemplateList templates;
+    _FindTemplates(str.data(), str.size(), &templates);
+    if (templates.empty()) {
+        return SdfTextFileFormat::ReadFromString(layer, str);
+    }
 
-    sregex templateRegex = "${" >> (s1 = +_w) >> "}";
-    const std::string replaced = regex_replace(str, templateRegex, formatter);
+    std::string replaced;
+    _ExpandTemplates(str.data(), str.size(), templates,
+                     layer->GetFileFormatArguments(), &replaced);
 
     return SdfTextFileFormat::ReadFromString(layer, replaced);
 }
@@ -95,6 +95,8 @@ static std::string   file_archive_context_id("scene:file:archive:context:id"  );
 static std::string file_archive_context_hash("scene:file:archive:context:hash"); // scene archive file context hash
 static std::string     file_archive_variance("scene:file:archive:variance"    ); // get the topology variance for the archive
 static std::string        file_archive_debug("scene:file:archive:debug"       ); // enable archive handling debugging
+static std::string file_archive_cache_max_count("scene:file:archive:cache:max_count"); // max cached archives, 0 is unlimited (int)
+static std::string    file_archive_cache_max_mb("scene:file:archive:cache:max_mb"   ); // cached archives memory budget in MB, 0 is unlimited (int)
 
 static std::string    node_filter_patterns("scene:node:filter:patterns" ); // scene node filter pattern list
 static std::string        node_filter_hash("scene:node:filter:hash"     ); // scene node filter id hash
@@ -34,16 +34,9 @@
 
 #include <DDImage/Hash.h>
 
-//TODO: add cleanup code so we can delete old GeoSceneFileArchiveContext that
-//      haven't been used for a while since there's no practical way to
-//      know if Nuke still needs these based on ctor/dtor behavior of the
-//      GeoReader class - ie. we can't use simple reference counting.
-// Uncomment this to try out cleanup code:
-//#define TRY_CONTEXT_CLEANUP
-
-#ifdef TRY_CONTEXT_CLEANUP
-#  include <sys/time.h>
-#endif
+#include <atomic>
+#include <iostream>
+#include <sys/time.h>
 
 
 namespace Fsr {
@@ -57,6 +50,13 @@ namespace Fsr {
 
     This is *not* normally used for SceneLoader since scene objects are
     infrequently loaded in the main thread.
+
+    Contexts are kept in a static cache so they survive the GeoReader being
+    destroyed and re-allocated by the parent ReadGeo. Readers retain() the
+    context they're using, and when the cache exceeds its count or memory
+    limits the least-recently-used unretained contexts are deleted. A reader
+    re-allocated shortly after its context was released will normally still
+    find it as only the oldest ones are evicted.
 */
 class FSR_EXPORT GeoSceneFileArchiveContext
 {
@@ -81,12 +81,24 @@ class FSR_EXPORT GeoSceneFileArchiveContext
 
 
   public:
-#ifdef TRY_CONTEXT_CLEANUP
     struct   timeval creation_time;         //!< When context was created
-    struct   timeval last_access_time;      //!< When context was last accessed
-#endif
+    std::atomic<uint64_t> last_access_usecs; //!< When context was last accessed, in microseconds since the epoch
 
     uint32_t global_topology_variance;      //!< Union of all object TopologyVariances
+    uint32_t references;                    //!< Number of readers retaining this context, guarded by the cache lock
+
+
+    /*! Archive context cache counters. */
+    struct CacheStats
+    {
+        uint64_t hits;          //!< findArchiveContext() calls that found a context
+        uint64_t misses;        //!< findArchiveContext() calls that didn't
+        uint64_t evictions;     //!< Contexts deleted to stay within the limits
+        size_t   count;         //!< Currently cached contexts
+        size_t   bytes;         //!< Approximate resident bytes of cached contexts
+
+        CacheStats() : hits(0), misses(0), evictions(0), count(0), bytes(0) {}
+    };
 
 
   public:
@@ -97,22 +109,57 @@ class FSR_EXPORT GeoSceneFileArchiveContext
     virtual ~GeoSceneFileArchiveContext() {}
 
 
-    //! Find a archive context with a matching hash value.
+    /*! Approximate resident size in bytes, used to enforce the cache memory limit.
+        Subclasses holding additional data should add its size to the base class'.
+    */
+    virtual size_t estimatedBytes() const;
+
+
+    /*! Find a archive context with a matching hash value. Updates its access time.
+        The context can be evicted as soon as this returns, use
+        findAndRetainArchiveContext() to hold onto it.
+    */
     static GeoSceneFileArchiveContext* findArchiveContext(uint64_t hash);
 
+    /*! Find a archive context with a matching hash value and retain() it
+        under the same lock so it can't be evicted in between. The caller
+        must release() it.
+    */
+    static GeoSceneFileArchiveContext* findAndRetainArchiveContext(uint64_t hash);
+
 
-    //! This does not check if there's an existing context with the same hash!
+    /*! This does not check if there's an existing context with the same hash!
+        The context is added retained, the caller must release() it.
+        Evicts unretained contexts if the cache is over its limits.
+    */
     static void addArchiveContext(GeoSceneFileArchiveContext* context,
                                   uint64_t                    hash);
 
 
-#ifdef TRY_CONTEXT_CLEANUP
-    //!
+    //! Keep the context from being evicted while a reader is using it.
+    void retain();
+
+    //! Release a retain() call, the context can then be evicted.
+    void release();
+
+
+    //! Set the cache limits, evicting contexts if they're now exceeded. 0 means no limit.
+    static void setCacheLimits(size_t max_count,
+                               size_t max_bytes);
+
+    //! Get the current cache counters.
+    static CacheStats getCacheStats();
+
+    //! Print the cache counters to a stream.
+    static void printCacheStats(const char*   prefix,
+                                std::ostream& o);
+
+
+    //! Thread-safe, doesn't need the cache lock.
     void updateAccessTime();
 
     //!
-    double getTimeSinceLastAccess();
-#endif
+    double getTimeSinceLastAccess() const;
 
 
 
@@ -33,12 +33,12 @@
 #include <DDImage/Enumeration_KnobI.h>
 #include <DDImage/SceneView_KnobI.h>
 
+#include <algorithm> // for std::sort
 #include <mutex> // for std::mutex
 
 
 //#define TRY_PRIMITIVE_PICKING 1
 //#define TRY_LIMITING_SCENEGRAPH_UPDATES 1
-//#define TRY_CONTEXT_CLEANUP 1
 
 
 using namespace DD::Image;
@@ -80,18 +80,122 @@ typedef std::unordered_map<uint64_t, GeoSceneFileArchiveContext*> GeoSceneFileAr
 static GeoSceneFileArchiveContextMap m_archive_context_map;
 static std::mutex                    m_archive_lock;
 
+// Cache limits and counters, guarded by m_archive_lock:
+static size_t   m_archive_max_count = 64;
+static size_t   m_archive_max_bytes = size_t(4096)*1024*1024;
+static uint64_t m_archive_hits      = 0;
+static uint64_t m_archive_misses    = 0;
+static uint64_t m_archive_evictions = 0;
+
+
+//! Approximate heap size of a set of strings.
+static size_t
+stringSetBytes(const std::set<std::string>& strings)
+{
+    size_t bytes = 0;
+    for (std::set<std::string>::const_iterator it=strings.begin(); it != strings.end(); ++it)
+        bytes += sizeof(std::string) + it->capacity() + 32/*node overhead*/;
+    return bytes;
+}
+
+
+//! Current time in microseconds since the epoch.
+static uint64_t
+nowUsecs()
+{
+    struct timeval t;
+    gettimeofday(&t, NULL/*timezone*/);
+    return uint64_t(t.tv_sec)*1000000ull + uint64_t(t.tv_usec);
+}
+
+
+/*! An eviction candidate with its access time copied, as the time can be
+    updated by other threads while the candidates are being sorted.
+*/
+struct ArchiveEvictCandidate
+{
+    uint64_t                    access_usecs;
+    uint64_t                    hash;
+    GeoSceneFileArchiveContext* context;
+
+    bool operator < (const ArchiveEvictCandidate& b) const { return (access_usecs < b.access_usecs); }
+};
+
+
+/*! Delete the least-recently-used unretained contexts until the cache is
+    within its limits. 'keep' is never evicted. m_archive_lock must be held.
+*/
+static void
+evictArchiveContextsLocked(const GeoSceneFileArchiveContext* keep)
+{
+    size_t bytes = 0;
+    std::vector<ArchiveEvictCandidate> candidates;
+    for (GeoSceneFileArchiveContextMap::const_iterator it=m_archive_context_map.begin();
+         it != m_archive_context_map.end(); ++it)
+    {
+        bytes += it->second->estimatedBytes();
+        if (it->second != keep && it->second->references == 0)
+        {
+            ArchiveEvictCandidate candidate;
+            candidate.access_usecs = it->second->last_access_usecs.load(std::memory_order_relaxed);
+            candidate.hash         = it->first;
+            candidate.context      = it->second;
+            candidates.push_back(candidate);
+        }
+    }
+
+    size_t count = m_archive_context_map.size();
+    const bool over_count = (m_archive_max_count > 0 && count > m_archive_max_count);
+    const bool over_bytes = (m_archive_max_bytes > 0 && bytes > m_archive_max_bytes);
+    if (!over_count && !over_bytes)
+        return;
+
+    std::sort(candidates.begin(), candidates.end()); // oldest access first
+    for (size_t i=0; i < candidates.size(); ++i)
+    {
+        if ((m_archive_max_count == 0 || count <= m_archive_max_count) &&
+            (m_archive_max_bytes == 0 || bytes <= m_archive_max_bytes))
+            break;
+
+        GeoSceneFileArchiveContext* context = candidates[i].context;
+        bytes -= std::min(bytes, context->estimatedBytes());
+        --count;
+        m_archive_context_map.erase(candidates[i].hash);
+        delete context;
+        ++m_archive_evictions;
+    }
+}
+
 
 /*!
 */
 GeoSceneFileArchiveContext::GeoSceneFileArchiveContext() :
     cache_data(NULL),
-    global_topology_variance(Fsr::Node::ConstantTopology)
+    global_topology_variance(Fsr::Node::ConstantTopology),
+    references(0)
 {
-#ifdef TRY_CONTEXT_CLEANUP
     // Initialize times:
     gettimeofday(&creation_time, NULL/*timezone*/);
-    last_access_time = creation_time;
-#endif
+    last_access_usecs = uint64_t(creation_time.tv_sec)*1000000ull + uint64_t(creation_time.tv_usec);
+}
+
+
+/*! Counts the strings which make up most of a context.
+*/
+/*virtual*/ size_t
+GeoSceneFileArchiveContext::estimatedBytes() const
+{
+    size_t bytes = sizeof(*this);
+    bytes += scene_file.capacity() + scene_context_name.capacity() + archive_context_id.capacity();
+    for (size_t i=0; i < node_filter_patterns.size(); ++i)
+        bytes += sizeof(NodeFilterPattern) + node_filter_patterns[i].name_expr.capacity() +
+                                             node_filter_patterns[i].type_expr.capacity();
+    for (size_t i=0; i < populate_path_masks.size(); ++i)
+        bytes += sizeof(std::string) + populate_path_masks[i].capacity();
+    bytes += stringSetBytes(selected_node_paths.objects);
+    bytes += stringSetBytes(selected_node_paths.materials);
+    bytes += stringSetBytes(selected_node_paths.lights);
+    return bytes;
 }
 
 
@@ -102,7 +206,33 @@ GeoSceneFileArchiveContext::findArchiveContext(uint64_t hash)
 {
     std::lock_guard<std::mutex> guard(m_archive_lock);
     const GeoSceneFileArchiveContextMap::const_iterator it = m_archive_context_map.find(hash);
-    return (it != m_archive_context_map.end()) ? it->second : NULL;
+    if (it == m_archive_context_map.end())
+    {
+        ++m_archive_misses;
+        return NULL;
+    }
+    ++m_archive_hits;
+    it->second->updateAccessTime();
+    return it->second;
+}
+
+
+/*!
+*/
+/*static*/ GeoSceneFileArchiveContext*
+GeoSceneFileArchiveContext::findAndRetainArchiveContext(uint64_t hash)
+{
+    std::lock_guard<std::mutex> guard(m_archive_lock);
+    const GeoSceneFileArchiveContextMap::const_iterator it = m_archive_context_map.find(hash);
+    if (it == m_archive_context_map.end())
+    {
+        ++m_archive_misses;
+        return NULL;
+    }
+    ++m_archive_hits;
+    ++it->second->references;
+    it->second->updateAccessTime();
+    return it->second;
 }
 
 
@@ -117,32 +247,104 @@ GeoSceneFileArchiveContext::addArchiveContext(GeoSceneFileArchiveContext* contex
     std::lock_guard<std::mutex> guard(m_archive_lock); // lock while we update values
     assert(context);
     m_archive_context_map[hash] = context;
+    ++context->references;
+    context->updateAccessTime();
+    evictArchiveContextsLocked(context/*keep*/);
+}
+
+
+/*!
+*/
+void
+GeoSceneFileArchiveContext::retain()
+{
+    std::lock_guard<std::mutex> guard(m_archive_lock);
+    ++references;
+    updateAccessTime();
+}
+
+
+/*!
+*/
+void
+GeoSceneFileArchiveContext::release()
+{
+    std::lock_guard<std::mutex> guard(m_archive_lock);
+    assert(references > 0);
+    --references;
+    // Released contexts are the most recent eviction candidates:
+    updateAccessTime();
+}
+
+
+/*!
+*/
+/*static*/ void
+GeoSceneFileArchiveContext::setCacheLimits(size_t max_count,
+                                           size_t max_bytes)
+{
+    std::lock_guard<std::mutex> guard(m_archive_lock);
+    if (max_count == m_archive_max_count && max_bytes == m_archive_max_bytes)
+        return;
+    m_archive_max_count = max_count;
+    m_archive_max_bytes = max_bytes;
+    evictArchiveContextsLocked(NULL/*keep*/);
+}
+
+
+/*!
+*/
+/*static*/ GeoSceneFileArchiveContext::CacheStats
+GeoSceneFileArchiveContext::getCacheStats()
+{
+    std::lock_guard<std::mutex> guard(m_archive_lock);
+    CacheStats stats;
+    stats.hits      = m_archive_hits;
+    stats.misses    = m_archive_misses;
+    stats.evictions = m_archive_evictions;
+    stats.count     = m_archive_context_map.size();
+    for (GeoSceneFileArchiveContextMap::const_iterator it=m_archive_context_map.begin();
+         it != m_archive_context_map.end(); ++it)
+        stats.bytes += it->second->estimatedBytes();
+    return stats;
+}
+
+
+/*!
+*/
+/*static*/ void
+GeoSceneFileArchiveContext::printCacheStats(const char*   prefix,
+                                            std::ostream& o)
+{
+    const CacheStats stats = getCacheStats();
+    o << prefix << "archive context cache:";
+    o << " hits=" << stats.hits << " misses=" << stats.misses;
+    o << " evictions=" << stats.evictions;
+    o << " contexts=" << stats.count;
+    o << " resident=" << double(stats.bytes)/1024.0 << "KB";
+    o << std::endl;
 }
 
 
-#ifdef TRY_CONTEXT_CLEANUP
 /*!
 */
 void
 GeoSceneFileArchiveContext::updateAccessTime()
 {
-    gettimeofday(&last_access_time, NULL/*timezone*/);
+    last_access_usecs.store(nowUsecs(), std::memory_order_relaxed);
 }
 
 
 /*!
 */
 double
-GeoSceneFileArchiveContext::getTimeSinceLastAccess()
+GeoSceneFileArchiveContext::getTimeSinceLastAccess() const
 {
-    struct timeval time_now;
-    gettimeofday(&time_now, NULL/*timezone*/);
-    const double tStart = double(last_access_time.tv_sec) + (double(last_access_time.tv_usec)/1000000.0);
-    const double tEnd   = double(time_now.tv_sec        ) + (double(time_now.tv_usec        )/1000000.0);
+    const uint64_t tStart = last_access_usecs.load(std::memory_order_relaxed);
+    const uint64_t tEnd   = nowUsecs();
     //std::cout << "   seconds since last access=" << (tEnd - tStart) << std::endl;
-    return (tEnd - tStart);
+    return (tEnd > tStart) ? double(tEnd - tStart)*1.0e-6 : 0.0;
 }
-#endif
 
 
 //-------------------------------------------------------------------------
@@ -361,6 +563,9 @@ GeoSceneGraphReaderFormat::GeoSceneGraphReaderFormat(DD::Image::ReadGeo* geo) :
     k_scenegraph_max_depth = 5;
     //
     k_debug_archive        = false;
+    //
+    k_archive_cache_max_count = 64;
+    k_archive_cache_max_mb    = 4096;
 }
 
 
@@ -380,6 +585,16 @@ GeoSceneGraphReaderFormat::knobs(DD::Image::Knob_Callback f)
     Bool_knob(f, &k_debug_archive, "debug_archive", "debug scene file loading");
         SetFlags(f, Knob::STARTLINE);
         Tooltip(f, "Prints scene file archive loading info to the console.");
+    Int_knob(f, &k_archive_cache_max_count, "archive_cache_count", "archive cache limit");
+        SetFlags(f, Knob::STARTLINE | Knob::NO_ANIMATION | Knob::NO_RERENDER);
+        Tooltip(f, "Maximum number of scene file archives kept open in the session-wide "
+                   "cache. When exceeded the least-recently-used archives no longer in use "
+                   "by any reader are closed. 0 is unlimited.");
+    Int_knob(f, &k_archive_cache_max_mb, "archive_cache_size", "size (MB)");
+        ClearFlags(f, Knob::STARTLINE);
+        SetFlags(f, Knob::NO_ANIMATION | Knob::NO_RERENDER);
+        Tooltip(f, "Approximate memory budget in megabytes for the session-wide scene "
+                   "file archive cache. 0 is unlimited.");
 
     Divider(f);
     addImportOptionsKnobs(f);
@@ -579,7 +794,8 @@ GeoSceneGraphReaderFormat::append(DD::Image::Hash& hash)
 /*!
 */
 GeoSceneGraphReader::GeoSceneGraphReader(ReadGeo* geo, int fd) :
-    Fsr::FuserGeoReader(geo, fd)
+    Fsr::FuserGeoReader(geo, fd),
+    m_retained_archive_ctx(NULL)
 {
 #if 0
     const GeoSceneGraphReaderFormat* options = dynamic_cast<GeoSceneGraphReaderFormat*>(geo->handler());
@@ -620,6 +836,10 @@ GeoSceneGraphReader::~GeoSceneGraphReader()
     std::cout << "         GeoSceneGraphReader::dtor(" << this << ")" << std::endl;
     std::cout << "......................................................................................" << std::endl;
 #endif
+    // The context stays cached until it's evicted, so a re-allocated
+    // reader can pick it back up:
+    if (m_retained_archive_ctx)
+        m_retained_archive_ctx->release();
 }
 
 
@@ -1327,13 +1547,17 @@ GeoSceneGraphReader::_getReaderUIHash(DD::Image::Hash& hash)
 /*! A GeoSceneGraphReader subclass can implement this to return an
     archive context from customized storage.
 
-    Base class returns a GeoSceneFileArchiveContext from the default
-    static archive map.
+    The returned context must be retain()ed, the reader releases it when
+    it switches contexts or is destroyed.
+
+    Base class finds and retains a GeoSceneFileArchiveContext from the
+    default static archive map under a single lock, so it can't be evicted
+    before the reader holds onto it.
 */
 /*virtual*/ GeoSceneFileArchiveContext*
 GeoSceneGraphReader::findArchiveContext(uint64_t hash)
 {
-    return GeoSceneFileArchiveContext::findArchiveContext(hash);
+    return GeoSceneFileArchiveContext::findAndRetainArchiveContext(hash);
 }
 
 
@@ -1359,9 +1583,10 @@ GeoSceneGraphReader::createArchiveContext(uint64_t hash)
 /*! Add an archive context to a storage cache.
 
     A GeoSceneGraphReader subclass can implement this method to manage the
-    storage itself.
+    storage itself. The context must be left retain()ed like the ones
+    returned by findArchiveContext().
 
-    Base class adds it to the default static archive context map.
+    Base class adds it retained to the default static archive context map.
 */
 /*virtual*/ void
 GeoSceneGraphReader::addArchiveContext(GeoSceneFileArchiveContext* context,
@@ -1382,6 +1607,10 @@ GeoSceneGraphReader::acquireSceneFileArchiveContext()
     const char* surface_mask = (options)?options->k_surface_mask:"";
     //std::cout << ", surface_mask='" << surface_mask << "'";
 
+    if (options)
+        GeoSceneFileArchiveContext::setCacheLimits(size_t(std::max(0, options->k_archive_cache_max_count)),
+                                                   size_t(std::max(0, options->k_archive_cache_max_mb))*1024*1024);
+
     // Get the file hash but don't change the m_file_hash state:
     DD::Image::Hash archive_hash = getFileHash();
 
@@ -1476,8 +1705,9 @@ GeoSceneGraphReader::acquireSceneFileArchiveContext()
 
     // Does a context matching this archive hash already exist?
     // Note that the resulting archive context can be different than the one
-    // just retrieved via sceneFileArchiveContext():
-    // TODO: wrap this all in a lock? Don't think we need to since _validate() is normally unthreaded
+    // just retrieved via sceneFileArchiveContext().
+    // Found or added contexts are returned retained so another reader can't
+    // evict them out from under us:
     GeoSceneFileArchiveContext* archive_ctx = findArchiveContext(archive_hash.value());
     if (archive_ctx)
     {
@@ -1485,12 +1715,10 @@ GeoSceneGraphReader::acquireSceneFileArchiveContext()
     }
     else
     {
-        // No match, create and add the new context.
+        // No match, create, fill in and add the new context. It's not
+        // visible to other readers until it's added:
         archive_ctx = createArchiveContext(archive_hash.value());
         assert(archive_ctx); // shouldn't happen!
-        addArchiveContext(archive_ctx, archive_hash.value());
-        //std::cout << ", created NEW archive context=" << archive_ctx;
-
         {
             /* GeoSceneFileArchiveContext:
                 std::string                 scene_file;             //!< File path to scene
@@ -1553,11 +1781,18 @@ GeoSceneGraphReader::acquireSceneFileArchiveContext()
             //
             archive_ctx->global_topology_variance = Fsr::Node::ConstantTopology;
         }
+        addArchiveContext(archive_ctx, archive_hash.value());
+        //std::cout << ", created NEW archive context=" << archive_ctx;
+        if (options && options->k_debug_archive)
+            GeoSceneFileArchiveContext::printCacheStats("  ", std::cout);
     }
     assert(archive_ctx);
-#ifdef TRY_CONTEXT_CLEANUP
-    archive_ctx->updateAccessTime();
-#endif
+
+    // Keep the context from being evicted while this reader's using it,
+    // dropping the extra retain if it's the one we already hold:
+    if (m_retained_archive_ctx)
+        m_retained_archive_ctx->release();
+    m_retained_archive_ctx = archive_ctx;
     //std::cout << "    archive_context_hash=" << std::hex << archive_ctx->archive_context_hash.value() << std::dec;
     //std::cout << std::endl;
 
@@ -1692,12 +1927,18 @@ GeoSceneGraphReader::_appendNodeContextArgs(ArgSet& node_args)
     Fsr::GeoSceneFileArchiveContext* archive_ctx = sceneFileArchiveContext();
     assert(archive_ctx); // shouldn't happen!
 
-#ifdef TRY_CONTEXT_CLEANUP
     archive_ctx->updateAccessTime();
-#endif
 
     node_args.setString(Arg::Scene::file, filePathForReader());
 
+    // Pass the cache limits on so the IO plugin can bound its own archive caches:
+    const GeoSceneGraphReaderFormat* options = dynamic_cast<GeoSceneGraphReaderFormat*>(geo->handler());
+    if (options)
+    {
+        node_args.setInt(Arg::Scene::file_archive_cache_max_count, options->k_archive_cache_max_count);
+        node_args.setInt(Arg::Scene::file_archive_cache_max_mb,    options->k_archive_cache_max_mb   );
+    }
+
     node_args.setHash(Arg::Scene::node_filter_hash,    archive_ctx->node_filter_hash.value()   );
     node_args.setHash(Arg::Scene::node_selection_hash, archive_ctx->selected_node_paths_hash.value());
 
@@ -1735,9 +1976,7 @@ GeoSceneGraphReader::_openSceneFile()
     const bool debug         = (options)?options->k_debug:false;
     const bool debug_archive = (options)?options->k_debug_archive:false;
 
-#ifdef TRY_CONTEXT_CLEANUP
     archive_ctx->updateAccessTime();
-#endif
 
     if (0)
     {
@@ -51,6 +51,8 @@ class FSR_EXPORT GeoSceneGraphReaderFormat : public FuserGeoReaderFormat
     int         k_scenegraph_max_depth;     //!< Maximum node subdirs to reduce load times on large scenes
 
     bool        k_debug_archive;            //!< Show archive loading info
+    int         k_archive_cache_max_count;  //!< Max archives in the session-wide cache, 0 is unlimited
+    int         k_archive_cache_max_mb;     //!< Archive cache memory budget in MB, 0 is unlimited
 
 
   public:
@@ -98,6 +100,7 @@ class FSR_EXPORT GeoSceneGraphReader : public FuserGeoReader
   protected:
     DD::Image::Hash        m_reader_ui_hash;        //!< If this changes update scene graph
     DD::Image::Hash        m_scenegraph_ui_hash;    //!< Separate from reader ui hash as scenegraph can update randomly
+    GeoSceneFileArchiveContext* m_retained_archive_ctx; //!< Context retained by this reader to prevent eviction
 
     //std::vector<NodeRef>   m_objects;               //!<
     //std::set<unsigned>     m_enabled_objects;       //!<
@@ -106,10 +109,11 @@ class FSR_EXPORT GeoSceneGraphReader : public FuserGeoReader
 
   protected:
     /*! A GeoSceneGraphReader subclass can implement this to return an
-        archive context from customized storage.
+        archive context from customized storage. The returned context must
+        be retain()ed, the reader releases it when it's done with it.
 
-        Base class returns a GeoSceneFileArchiveContext from the default
-        static archive context map.
+        Base class finds and retains a GeoSceneFileArchiveContext from the
+        default static archive context map.
     */
     virtual GeoSceneFileArchiveContext* findArchiveContext(uint64_t hash);
 
@@ -172,9 +176,9 @@ class FSR_EXPORT GeoSceneGraphReader : public FuserGeoReader
     /*! Add an archive context to a storage cache.
 
         A GeoSceneGraphReader subclass can implement this method to manage the
-        storage itself.
+        storage itself. The context must be left retain()ed.
 
-        Base class adds it to the default static archive context map.
+        Base class adds it retained to the default static archive context map.
     */
     virtual void addArchiveContext(GeoSceneFileArchiveContext* context,
                                    uint64_t                    hash);
@@ -35,6 +35,18 @@
 #include <Fuser/Box3.h>
 #include <Fuser/AttributeTypes.h> // for Vec3fList
 
+#include <DDImage/Thread.h>
+
+#include <atomic>
+#include <cfloat> // for FLT_EPSILON
+#include <cmath>
+#include <limits>
+#include <algorithm> // for std::sort
+
+#if defined(__SSE__)
+#  include <xmmintrin.h>
+#endif
+
 namespace zpr {
 
 // zpr::Bvh enumerations used for SurfaceIntersection::object_type:
@@ -44,6 +56,36 @@ static const uint32_t ZprBvh = 11;
 // Uncomment to get a bunch of debug prints during Bvh node build
 //#define DEBUG_BVH_BUILD 1
 
+// Uncomment to print build time and tree quality stats after each Bvh build.
+// Handy for comparing the split methods on the same obj_refs:
+//#define DEBUG_BVH_BUILD_TIME 1
+
+
+/*! Bvh split methods.
+*/
+enum BvhBuildMethod
+{
+    BVH_BUILD_MIDPOINT,     //!< Legacy - split at centroid mean of longest axis
+    BVH_BUILD_BINNED_SAH    //!< Binned surface-area-heuristic split (default)
+};
+
+
+//! Number of centroid bins per axis used by the BVH_BUILD_BINNED_SAH splitter.
+static const uint32_t BVH_SAH_NUM_BINS = 16;
+
+//! Subtrees with fewer obj_refs than this are always built by a single thread.
+static const uint32_t BVH_MIN_PARALLEL_ITEMS = 4096;
+
+/*! Reserve up to 'wanted' helper threads for a parallel Bvh build, returning
+    how many were granted (possibly 0.) All builds share one pool of
+    Thread::numCPUs-1 helpers so builds running at the same time, like
+    several objects expanding in different render threads, can't multiply
+    the thread count. Give them back with releaseBvhBuildThreads().
+*/
+ZPR_EXPORT uint32_t reserveBvhBuildThreads(uint32_t wanted);
+//! Return helper threads granted by reserveBvhBuildThreads().
+ZPR_EXPORT void     releaseBvhBuildThreads(uint32_t count);
+
 //! Used in Bvh and other places that return a const Fsr::Box3<T>&
 extern FSR_EXPORT Fsr::Box3f empty_box3f;
 extern FSR_EXPORT Fsr::Box3d empty_box3d;
@@ -100,6 +142,55 @@ typedef std::vector<BvhNode> BvhNodeList;
 //---------------------------------------------------------------------------------
 
 
+/*! Collapsed 4-wide node built from the binary BvhNodeList by
+    Bvh::buildWideNodes(). The four child bboxes are stored SoA so a ray
+    can be slab-tested against all of them at once.
+
+    Leaf children point back at the leaf BvhNode in the binary list so
+    the item ranges are only stored in one place.
+*/
+struct ZPR_EXPORT BvhNode4
+{
+    float    bbox_min[3][4];    //!< Child bbox mins, [axis][child]
+    float    bbox_max[3][4];    //!< Child bbox maxs, [axis][child]
+    uint32_t child[4];          //!< Interior child - index of BvhNode4, leaf child - index of binary BvhNode
+    uint8_t  is_leaf[4];        //!< Non-zero if child is a leaf
+    uint32_t num_children;      //!< Children are packed into the first num_children slots
+
+    //!
+    bool     isLeaf(uint32_t i)   const { return (is_leaf[i] != 0); }
+    //!
+    uint32_t getChild(uint32_t i) const { return child[i]; }
+};
+
+typedef std::vector<BvhNode4> BvhNode4List;
+
+
+/*! Single-precision ray offset into bbox-local space, used by the
+    4-wide node and triangle tests.
+*/
+struct ZPR_EXPORT BvhRay4
+{
+    float org[3];       //!< Ray origin minus the bbox origin
+    float dir[3];       //!< Ray direction
+    float inv_dir[3];   //!< Reciprocal of dir, clamped to finite values
+    float tmin, tmax;   //!< Ray's mindist/maxdist
+
+    //!
+    void set(const Fsr::RayContext& Rtx,
+             const Fsr::Vec3d&      bbox_origin);
+};
+
+
+//! Slab-test a ray against all the children of a BvhNode4. Returns a bitmask of hit children and their entry distances.
+inline uint32_t intersectBvhNode4(const BvhNode4& node,
+                                  const BvhRay4&  ray,
+                                  float           tnear[4]);
+
+
+//---------------------------------------------------------------------------------
+
+
 /*!
 */
 template <class T>
@@ -108,23 +199,79 @@ class ZPR_EXPORT Bvh : public Traceable
   protected:
     /*! Temp node used during Bvh construction.
         These are converted to BvhNodes in _flatten() method.
+
+        BuilderNodes live in a single preallocated arena rather than
+        being allocated one by one. A subtree covering N obj_refs never
+        needs more than 2N-1 nodes, so each subtree owns a fixed slice
+        of the arena and its children are placed at fixed offsets inside
+        that slice. This lets subtrees be built concurrently without any
+        locking. Child links are arena indices, and since the root is
+        always at index 0 a child index of 0 means 'none'.
     */
     struct BuilderNode
     {
         Fsr::Box3f  bbox;       //!< AABB bbox of node
-        BuilderNode *A, *B;     //!< Child nodes
+        uint32_t    A, B;       //!< Arena indices of child nodes, 0 if none
         uint32_t    start, end; //!< Range of data chunks this node contains inside bbox
         uint8_t     split_axis; //!< Node split direction (0=x, 1=y, 2=z)
         uint8_t     depth;      //!< Depth level
-        uint8_t     pad[30];    //!< Ensure 128 byte total size for mem alignment (is this really necessary?)
 
         //!
-        bool     isLeaf()   const { return (A==NULL && B==NULL); }
+        bool     isLeaf()   const { return (A==0 && B==0); }
         //!
         uint32_t numItems() const { return (end - start); }
 
-        BuilderNode() : A(NULL), B(NULL) {}
-        ~BuilderNode() { delete A; delete B; }
+        BuilderNode() : A(0), B(0), start(0), end(0), split_axis(0), depth(0) {}
+    };
+
+    /*! A subtree deferred to the parallel build pass.
+    */
+    struct BuildTask
+    {
+        uint32_t node_index;    //!< Arena index of the subtree root
+        uint32_t start, end;    //!< Range of obj_refs in the subtree
+        uint32_t depth;         //!< Depth of the subtree root
+
+        BuildTask(uint32_t _node_index,
+                  uint32_t _start,
+                  uint32_t _end,
+                  uint32_t _depth) : node_index(_node_index), start(_start), end(_end), depth(_depth) {}
+
+        //! Used by the sort routine - larger subtrees go first.
+        bool operator < (const BuildTask& b) const { return ((end - start) > (b.end - b.start)); }
+    };
+
+    /*! Shared state for one build() call.
+        This is shared between threads!!
+    */
+    struct BuildContext
+    {
+        Bvh<T>*                     bvh;
+        std::vector<BvhObjRef<T> >* obj_refs;
+        Fsr::Vec3fList*             obj_centers;    //!< Kept in sync with obj_refs
+        BuilderNode*                arena;          //!< Preallocated BuilderNodes
+        BvhBuildMethod              method;         //!< Split method
+        uint32_t                    task_min_items; //!< Subtrees smaller than this get deferred to a BuildTask
+        //
+        std::vector<BuildTask>      tasks;          //!< Subtrees left for the parallel pass
+        std::atomic<uint32_t>       next_task;      //!< Next BuildTask to process
+        std::atomic<uint32_t>       num_nodes;      //!< Total nodes built, across all threads
+        std::atomic<uint32_t>       max_depth;      //!< Deepest leaf, across all threads
+
+        //!
+        BuildContext() : next_task(0), num_nodes(0), max_depth(0) {}
+
+        //! Atomically raise max_depth to at least 'depth'.
+        void updateMaxDepth(uint32_t depth)
+        {
+            uint32_t current = max_depth;
+            while (depth > current && !max_depth.compare_exchange_weak(current, depth)) {}
+        }
+
+        //! DD::Image::Thread spawn callback function to iterate through the task list.
+        static void thread_proc_cb(unsigned thread_index,
+                                   unsigned num_threads,
+                                   void*    p);
     };
 
 
@@ -132,6 +279,7 @@ class ZPR_EXPORT Bvh : public Traceable
     std::string    m_name;          //!< Identifier string, usually for debugging
     std::vector<T> m_item_list;     //!< List of all data items in Bvh
     BvhNodeList    m_node_list;     //!< List of flattened BvhNodes
+    BvhNode4List   m_wide_node_list;//!< Optional 4-wide collapse of m_node_list, see buildWideNodes()
     uint32_t       m_max_objects;   //!< Max number of objects in a leaf node
     uint32_t       m_max_depth;     //!< Depth of lowest leaf in Bvh
     Fsr::Vec3d     m_bbox_origin;   //!< Global offset for bboxes used during intersection tests
@@ -159,6 +307,12 @@ class ZPR_EXPORT Bvh : public Traceable
     const BvhNodeList& nodeList()          const { return m_node_list; }
     const BvhNode&     getNode(uint32_t i) const { return m_node_list[i]; }
 
+    //! 4-wide node access. These are only available after buildWideNodes().
+    bool                hasWideNodes()          const { return (m_wide_node_list.size() > 0); }
+    uint32_t            numWideNodes()          const { return (uint32_t)m_wide_node_list.size(); }
+    const BvhNode4List& wideNodeList()          const { return m_wide_node_list; }
+    const BvhNode4&     getWideNode(uint32_t i) const { return m_wide_node_list[i]; }
+
     //! Items access.
     uint32_t              numItems()          const { return (uint32_t)m_item_list.size(); }
     const std::vector<T>& itemList()          const { return m_item_list; }
@@ -175,17 +329,36 @@ class ZPR_EXPORT Bvh : public Traceable
     //! Empty the Bvh and make ready for a new build.
     void clear();
 
-    /*! Recursively build the hierarchy.
+    /*! Build the hierarchy.
+        Large inputs have their subtrees built in parallel using at most
+        'max_threads' threads including the calling one, 0 means
+        Thread::numCPUs. Extra threads are limited to what's left in the
+        shared pool, see reserveBvhBuildThreads().
         Note - this will reorder the 'obj_refs' array contents so
         any indices into it are only valid after build() is complete.
     */
     void build(std::vector<BvhObjRef<T> >& obj_refs,
-               uint32_t                    max_objects_per_leaf=1);
+               uint32_t                    max_objects_per_leaf=1,
+               BvhBuildMethod              method=BVH_BUILD_BINNED_SAH,
+               uint32_t                    max_threads=0);
 
 
-    //!
+    /*! Collapse the binary node list into 4-wide nodes for SIMD traversal.
+        Call after build(). The binary list is kept as the leaf store and
+        as the fallback when wide traversal is disabled.
+    */
+    void buildWideNodes();
+
+
+    /*! Get all the leaf nodes the ray passes through. If 'use_wide_nodes'
+        is true and buildWideNodes() has been called the 4-wide nodes are
+        traversed, otherwise the binary nodes.
+        If 'nodes_visited' is not NULL the number of nodes tested is added to it.
+    */
     bool getIntersectedLeafs(Fsr::RayContext&             Rtx,
-                             std::vector<const BvhNode*>& node_list) const;
+                             std::vector<const BvhNode*>& node_list,
+                             bool                         use_wide_nodes=true,
+                             uint64_t*                    nodes_visited=NULL) const;
 
 
     //--------------------------------------------------------------------------------- 
@@ -219,25 +392,55 @@ class ZPR_EXPORT Bvh : public Traceable
 
 
   protected:
-    /*! Recursively build the hierarchy.
+    /*! Recursively build the subtree rooted at arena node 'node_index'.
+        Returns the number of nodes built.
+        If 'ctx.task_min_items' is non-zero child subtrees smaller than
+        that are not built but appended to 'ctx.tasks' instead.
         Note - this will reorder the 'obj_refs' and 'obj_centers' array
         contents so indices into them are only valid after _build() is
         complete.
     */
-    void _build(BuilderNode*                bvh_node,
-                std::vector<BvhObjRef<T> >& obj_refs,
-                Fsr::Vec3fList&             obj_centers,
-                uint32_t                    start,
-                uint32_t                    end,
-                uint32_t&                   nNodes,
-                uint32_t&                   max_depth);
+    uint32_t _build(BuildContext& ctx,
+                    uint32_t      node_index,
+                    uint32_t      start,
+                    uint32_t      end,
+                    uint32_t      depth,
+                    uint32_t&     max_depth);
+
+    /*! Partition the obj_refs range [start, end) in two and return the
+        split index. Returns the chosen axis in 'split_axis'.
+    */
+    uint32_t _splitMidpoint(BuildContext&     ctx,
+                            const Fsr::Box3f& bbox,
+                            uint32_t          start,
+                            uint32_t          end,
+                            uint8_t&          split_axis);
+    uint32_t _splitBinnedSAH(BuildContext& ctx,
+                             uint32_t      start,
+                             uint32_t      end,
+                             uint8_t&      split_axis);
 
     /*! Must preallocate an array of BvhNodes to the total number of nodes
         returned by the _build() method.
     */
-    uint32_t _flatten(const BuilderNode* bvh_node,
+    uint32_t _flatten(const BuilderNode* arena,
+                      uint32_t           node_index,
                       uint32_t&          offset);
 
+    /*! Recursively collapse binary interior node 'node_index' and its
+        descendants into BvhNode4s, returning the index of the new BvhNode4.
+    */
+    uint32_t _collapse(uint32_t node_index);
+
+
+    //! Half the surface area of a bbox, which is all the SAH cost needs.
+    static float halfArea(const Fsr::Box3f& bbox)
+    {
+        if (bbox.isEmpty())
+            return 0.0f;
+        const Fsr::Vec3f d(bbox.max - bbox.min);
+        return (d.x*d.y + d.y*d.z + d.z*d.x);
+    }
 
 };
 
@@ -250,6 +453,104 @@ class ZPR_EXPORT Bvh : public Traceable
 /*---------------------------------------------------------------------*/
 
 
+//!
+inline void
+BvhRay4::set(const Fsr::RayContext& Rtx,
+             const Fsr::Vec3d&      bbox_origin)
+{
+    const float max_inv = std::numeric_limits<float>::max();
+    for (int axis=0; axis < 3; ++axis)
+    {
+        org[axis] = float(Rtx.origin[axis] - bbox_origin[axis]);
+        dir[axis] = float(Rtx.dir()[axis]);
+        // Keep the reciprocal finite so a zero-width slab gives 0 rather than NaN:
+        const double inv = Rtx.invDir()[axis];
+        if (inv >= double(max_inv))
+            inv_dir[axis] = max_inv;
+        else if (inv <= -double(max_inv))
+            inv_dir[axis] = -max_inv;
+        else
+            inv_dir[axis] = float(inv);
+    }
+    // Round the range outward so the float interval contains the double one:
+    tmin = float(Rtx.mindist);
+    if (double(tmin) > Rtx.mindist)
+        tmin = std::nextafter(tmin, -max_inv);
+    tmax = (Rtx.maxdist < double(max_inv)) ? float(Rtx.maxdist) : max_inv;
+    if (double(tmax) < Rtx.maxdist && tmax < max_inv)
+        tmax = std::nextafter(tmax, max_inv);
+}
+
+
+/*! Slab-test a ray against all the children of a BvhNode4. Returns a
+    bitmask of hit children and their entry distances.
+
+    Each slab interval is widened on both ends by an absolute bound on the
+    single-precision error, so this can pass a few rays the double-precision
+    Fsr::intersectAABB() would reject, but not the other way around. With
+    u = FLT_EPSILON/2, i = |inv_dir| and m = |org| + |bbox| for the axis,
+    the slab distance (b - o)*i picks up at most u*i*m error from each of:
+    rounding the origin to float in BvhRay4::set(), the subtraction, rounding
+    inv_dir to float, the multiply (as |t| <= i*m) and subtracting or adding
+    the pad itself. That's 5u*i*m plus higher-order terms, covered by the
+    8u*i*m pad. The ray's tmin/tmax are rounded outward in BvhRay4::set().
+    This doesn't hold for near-zero direction components whose reciprocal
+    was clamped to FLT_MAX, where both tests report distances far beyond
+    any scene bounds anyway.
+*/
+inline uint32_t
+intersectBvhNode4(const BvhNode4& node,
+                  const BvhRay4&  ray,
+                  float           tnear[4])
+{
+    const float    max_pad       = std::numeric_limits<float>::max();
+    const uint32_t children_mask = (1u << node.num_children) - 1;
+#if defined(__SSE__)
+    const __m128 sign_bit = _mm_set1_ps(-0.0f);
+    __m128 t_near = _mm_set1_ps(ray.tmin);
+    __m128 t_far  = _mm_set1_ps(ray.tmax);
+    for (int axis=0; axis < 3; ++axis)
+    {
+        const __m128 org     = _mm_set1_ps(ray.org[axis]);
+        const __m128 inv_dir = _mm_set1_ps(ray.inv_dir[axis]);
+        const __m128 bmin    = _mm_loadu_ps(node.bbox_min[axis]);
+        const __m128 bmax    = _mm_loadu_ps(node.bbox_max[axis]);
+        const __m128 t0 = _mm_mul_ps(_mm_sub_ps(bmin, org), inv_dir);
+        const __m128 t1 = _mm_mul_ps(_mm_sub_ps(bmax, org), inv_dir);
+        // Error bound, clamped so an overflowing pad can't make inf - inf:
+        const __m128 mag = _mm_add_ps(_mm_max_ps(_mm_andnot_ps(sign_bit, bmin), _mm_andnot_ps(sign_bit, bmax)),
+                                      _mm_set1_ps(fabsf(ray.org[axis])));
+        const __m128 pad = _mm_min_ps(_mm_mul_ps(mag, _mm_set1_ps(4.0f*FLT_EPSILON*fabsf(ray.inv_dir[axis]))),
+                                      _mm_set1_ps(max_pad));
+        t_near = _mm_max_ps(t_near, _mm_sub_ps(_mm_min_ps(t0, t1), pad));
+        t_far  = _mm_min_ps(t_far,  _mm_add_ps(_mm_max_ps(t0, t1), pad));
+    }
+    _mm_storeu_ps(tnear, t_near);
+    return ((uint32_t)_mm_movemask_ps(_mm_cmple_ps(t_near, t_far)) & children_mask);
+#else
+    uint32_t hit_mask = 0;
+    for (uint32_t i=0; i < 4; ++i)
+    {
+        float t_near = ray.tmin;
+        float t_far  = ray.tmax;
+        for (int axis=0; axis < 3; ++axis)
+        {
+            const float t0 = (node.bbox_min[axis][i] - ray.org[axis])*ray.inv_dir[axis];
+            const float t1 = (node.bbox_max[axis][i] - ray.org[axis])*ray.inv_dir[axis];
+            const float mag = std::max(fabsf(node.bbox_min[axis][i]), fabsf(node.bbox_max[axis][i])) + fabsf(ray.org[axis]);
+            const float pad = std::min(mag*(4.0f*FLT_EPSILON*fabsf(ray.inv_dir[axis])), max_pad);
+            t_near = std::max(t_near, std::min(t0, t1) - pad);
+            t_far  = std::min(t_far,  std::max(t0, t1) + pad);
+        }
+        tnear[i] = t_near;
+        if (t_near <= t_far)
+            hit_mask |= (1u << i);
+    }
+    return (hit_mask & children_mask);
+#endif
+}
+
+
 //!
 template <class T>
 Bvh<T>::Bvh() :
@@ -271,6 +572,7 @@ Bvh<T>::clear()
     m_name.clear();
     m_item_list   = std::vector<T>(); // releases allocation
     m_node_list   = BvhNodeList();    // releases allocation
+    m_wide_node_list = BvhNode4List();// releases allocation
     m_max_objects = 1;
     m_max_depth   = 0;
     m_bbox_origin.set(0,0,0);
@@ -278,14 +580,17 @@ Bvh<T>::clear()
 
 
 
-/*! Recursively build the hierarchy.
+/*! Build the hierarchy.
+    Large inputs have their subtrees built in parallel.
     Note - this will reorder the 'obj_refs' array contents so
     any indices into it are only valid after build() is complete.
 */
 template <class T>
 inline void
 Bvh<T>::build(std::vector<BvhObjRef<T> >& obj_refs,
-              uint32_t                    max_objects_per_leaf)
+              uint32_t                    max_objects_per_leaf,
+              BvhBuildMethod              method,
+              uint32_t                    max_threads)
 {
 #ifdef DEBUG_BVH_BUILD
     std::cout << "-------------------------------------------------" << std::endl;
@@ -308,25 +613,82 @@ Bvh<T>::build(std::vector<BvhObjRef<T> >& obj_refs,
     }
     else
     {
+#ifdef DEBUG_BVH_BUILD_TIME
+        struct timeval time_start;
+        gettimeofday(&time_start, 0);
+#endif
+
         // ObjRef centers list is kept in sync with
         // ObjRef list:
         Fsr::Vec3fList obj_centers(nObjRefs);
         for (uint32_t i=0; i < nObjRefs; ++i)
             obj_centers[i] = obj_refs[i].bbox.getCenter();
 
+        // A binary tree over N items never has more than 2N-1 nodes:
+        std::vector<BuilderNode> arena(2*nObjRefs - 1);
+
+        BuildContext ctx;
+        ctx.bvh            = this;
+        ctx.obj_refs       = &obj_refs;
+        ctx.obj_centers    = &obj_centers;
+        ctx.arena          = arena.data();
+        ctx.method         = method;
+        ctx.task_min_items = 0;
+
+        // Only bother with threads if there's enough work to split up and
+        // there's helpers left in the shared pool. Build the top of the tree
+        // on this thread until the remaining subtrees are small enough to
+        // hand out as tasks:
+        uint32_t num_threads = DD::Image::Thread::numCPUs;
+        if (max_threads > 0 && max_threads < num_threads)
+            num_threads = max_threads;
+        if (nObjRefs < 2*BVH_MIN_PARALLEL_ITEMS)
+            num_threads = 1;
+        const uint32_t num_helpers = (num_threads > 1) ? reserveBvhBuildThreads(num_threads-1) : 0;
+        num_threads = 1 + num_helpers;
+        if (num_threads > 1)
+            ctx.task_min_items = std::max(BVH_MIN_PARALLEL_ITEMS, nObjRefs / (num_threads*4));
+
 #ifdef DEBUG_BVH_BUILD
         std::cout << "  builder nodes list:" << std::endl;
 #endif
-        uint32_t nNodes = 0;
-        m_max_depth = 0;
-        BuilderNode* root_node = new BuilderNode();
-        this->_build(root_node,
-                     obj_refs,
-                     obj_centers,
-                     0/*start*/,
-                     nObjRefs/*end*/,
-                     nNodes,
-                     m_max_depth);
+        uint32_t max_depth = 0;
+        ctx.num_nodes = this->_build(ctx,
+                                     0/*node_index*/,
+                                     0/*start*/,
+                                     nObjRefs/*end*/,
+                                     0/*depth*/,
+                                     max_depth);
+        ctx.max_depth = max_depth;
+
+        // Build the deferred subtrees, largest first:
+        const uint32_t nTasks = (uint32_t)ctx.tasks.size();
+        if (nTasks > 0)
+        {
+            std::sort(ctx.tasks.begin(), ctx.tasks.end());
+            ctx.task_min_items = 0; // tasks build their entire subtree
+
+            if (nTasks < num_threads)
+                num_threads = nTasks;
+            if (num_threads <= 1)
+            {
+                // Pass 0 for num_threads so task loop knows it's not multi-threaded:
+                BuildContext::thread_proc_cb(0/*thread_index*/, 0/*num_threads*/, &ctx); // just do one
+            }
+            else
+            {
+                // Spawn multiple threads (minus one for this thread to execute,) then wait for them to finish:
+                DD::Image::Thread::spawn(BuildContext::thread_proc_cb, num_threads-1, &ctx);
+                // This thread handles the last one:
+                BuildContext::thread_proc_cb(num_threads-1/*thread_index*/, num_threads/*num_threads*/, &ctx);
+                //
+                DD::Image::Thread::wait(&ctx);
+            }
+        }
+        releaseBvhBuildThreads(num_helpers);
+
+        const uint32_t nNodes = ctx.num_nodes;
+        m_max_depth = ctx.max_depth;
 
         if (nNodes > 0)
         {
@@ -342,12 +704,34 @@ Bvh<T>::build(std::vector<BvhObjRef<T> >& obj_refs,
 
             m_node_list.resize(nNodes);
             uint32_t offset = 0;
-            this->_flatten(root_node, offset);
+            this->_flatten(arena.data(), 0/*node_index*/, offset);
 #if DEBUG
             assert(offset == m_node_list.size());
 #endif
         }
-        delete root_node;
+
+#ifdef DEBUG_BVH_BUILD_TIME
+        struct timeval time_end;
+        gettimeofday(&time_end, 0);
+        const double build_secs = double(time_end.tv_sec  - time_start.tv_sec) +
+                                  double(time_end.tv_usec - time_start.tv_usec)/1000000.0;
+        // SAH cost of the whole tree relative to the root bbox, lower is better:
+        double sah_cost = 0.0;
+        const float root_area = halfArea(this->bbox());
+        if (root_area > 0.0f)
+        {
+            for (uint32_t i=0; i < nNodes; ++i)
+            {
+                const BvhNode& node = m_node_list[i];
+                sah_cost += double(halfArea(node.bbox) / root_area)*double((node.isLeaf()) ? node.numItems() : 1);
+            }
+        }
+        std::cout << "Bvh::build(" << this << ") '" << m_name << "'";
+        std::cout << " method=" << ((method == BVH_BUILD_MIDPOINT) ? "midpoint" : "binned-sah");
+        std::cout << ", numItems=" << nObjRefs << ", nNodes=" << nNodes;
+        std::cout << ", nTasks=" << nTasks << ", max_depth=" << m_max_depth;
+        std::cout << ", sah_cost=" << sah_cost << ", build_time=" << build_secs << "s" << std::endl;
+#endif
 
 #ifdef DEBUG_BVH_BUILD
         std::cout << "  numItems=" << numItems() << "  " << this->bbox();
@@ -362,83 +746,167 @@ Bvh<T>::build(std::vector<BvhObjRef<T> >& obj_refs,
 }
 
 
+/*! DD::Image::Thread spawn callback function to iterate through the task list.
+*/
+template <class T>
+/*static*/
+inline void
+Bvh<T>::BuildContext::thread_proc_cb(unsigned thread_index,
+                                     unsigned num_threads,
+                                     void*    p)
+{
+    BuildContext* ctx = reinterpret_cast<BuildContext*>(p);
+    assert(ctx && ctx->bvh);
+
+    // Keep counts local until the end so threads don't fight over the atomics:
+    uint32_t nNodes    = 0;
+    uint32_t max_depth = 0;
+    while (1)
+    {
+        const uint32_t i = ctx->next_task++; // get task to process and atomic increment
+        if (i >= (uint32_t)ctx->tasks.size())
+            break;
+
+        const BuildTask& task = ctx->tasks[i];
+        nNodes += ctx->bvh->_build(*ctx,
+                                   task.node_index,
+                                   task.start,
+                                   task.end,
+                                   task.depth,
+                                   max_depth);
+    }
+    ctx->num_nodes += nNodes;
+    ctx->updateMaxDepth(max_depth);
+}
+
 
-/*! Recursively build the hierarchy.
+/*! Recursively build the subtree rooted at arena node 'node_index'.
+    If 'ctx.task_min_items' is non-zero child subtrees smaller than
+    that are not built but appended to 'ctx.tasks' instead.
     Note - this will reorder the 'obj_refs' and 'obj_centers' array
     contents so indices into them are only valid after _build() is
     complete.
 */
 template <class T>
-inline void
-Bvh<T>::_build(BuilderNode*                bvh_node,
-               std::vector<BvhObjRef<T> >& obj_refs,
-               Fsr::Vec3fList&             obj_centers,
-               uint32_t                    start,
-               uint32_t                    end,
-               uint32_t&                   nNodes,
-               uint32_t&                   max_depth)
+inline uint32_t
+Bvh<T>::_build(BuildContext& ctx,
+               uint32_t      node_index,
+               uint32_t      start,
+               uint32_t      end,
+               uint32_t      depth,
+               uint32_t&     max_depth)
 {
+    const std::vector<BvhObjRef<T> >& obj_refs = *ctx.obj_refs;
 #if DEBUG
-    assert(bvh_node);
-    assert(obj_refs.size() == obj_centers.size());
+    assert(obj_refs.size() == ctx.obj_centers->size());
+    assert(end > start); // shouldn't happen!
 #endif
-    ++nNodes;
 
-    bvh_node->start = start;
-    bvh_node->end   = end;
-    const int32_t nObjects = (end - start);
-    if (nObjects <= 0)
-        assert(nObjects > 0); // shouldn't happen!
+    BuilderNode& bvh_node = ctx.arena[node_index];
+    bvh_node.start = start;
+    bvh_node.end   = end;
+    bvh_node.A     = 0;
+    bvh_node.B     = 0;
+    bvh_node.depth = (uint8_t)std::min(depth, (uint32_t)255);
+    if (depth > max_depth)
+        max_depth = depth;
 
-    // Concatenate all the object bboxes and obj_centers:
-    Fsr::Box3f bbox   = obj_refs[start].bbox;
-    Fsr::Vec3f weight = obj_centers[start];
+    const uint32_t nObjects = (end - start);
+
+    // Concatenate all the object bboxes:
+    Fsr::Box3f bbox = obj_refs[start].bbox;
     for (uint32_t i=(start+1); i < end; ++i)
-    {
         bbox.expand(obj_refs[i].bbox, false/*test_empty*/);
-        weight += obj_centers[i];
-    }
-    bvh_node->bbox  = bbox;
-    bvh_node->depth = std::min((uint8_t)max_depth, (uint8_t)255);
+    bvh_node.bbox = bbox;
 #ifdef DEBUG_BVH_BUILD
-    std::cout << "    " << max_depth << ":" << nNodes << " " << nObjects << bbox;
+    std::cout << "    " << depth << ":" << node_index << " " << nObjects << bbox;
 #endif
 
-    if (nObjects <= (int32_t)m_max_objects)
+    if (nObjects <= m_max_objects)
     {
-        bvh_node->A = bvh_node->B = NULL; // mark node as leaf
 #ifdef DEBUG_BVH_BUILD
         std::cout << " LEAF" << std::endl;
 #endif
-        return;
+        return 1; // leaf
     }
 
-    // Ok, more than two objects require us to clump them in groupings
-    // that fall on each side of a split point, which is the center
-    // of the whole bbox.  Other split points can be calculated but
-    // that's what we're doing for the moment:
-    weight /= float(nObjects);
+    // Ok, more than max_objects require us to clump them in groupings
+    // that fall on each side of a split point:
+    uint8_t split_axis = 0;
+    uint32_t mid;
+    if (ctx.method == BVH_BUILD_MIDPOINT)
+        mid = _splitMidpoint(ctx, bbox, start, end, split_axis);
+    else
+        mid = _splitBinnedSAH(ctx, start, end, split_axis);
+    bvh_node.split_axis = split_axis;
+
+    // If all the objects end up on one side then split the list down the middle:
+    if (mid <= start || mid >= end)
+        mid = (start + end)/2;
+
 #ifdef DEBUG_BVH_BUILD
-    std::cout << " wt=" << weight;
+    std::cout << "      split_axis=" << (int)split_axis << " split list: ";
+    for (uint32_t i=start; i < mid; ++i)
+        std::cout << " " << i;
+    std::cout << " ||";
+    for (uint32_t i=mid; i < end; ++i)
+        std::cout << " " << i;
+    std::cout << std::endl;
 #endif
 
+    // Child A takes the arena slot right after this node and child B
+    // starts after A's (2*nA - 1) sized slice:
+    const uint32_t nA = (mid - start);
+    bvh_node.A = node_index + 1;
+    bvh_node.B = node_index + 2*nA;
+
+    uint32_t nNodes = 1;
+    if (ctx.task_min_items > 0 && nA < ctx.task_min_items)
+        ctx.tasks.push_back(BuildTask(bvh_node.A, start, mid, depth+1));
+    else
+        nNodes += _build(ctx, bvh_node.A, start, mid, depth+1, max_depth);
+
+    if (ctx.task_min_items > 0 && (end - mid) < ctx.task_min_items)
+        ctx.tasks.push_back(BuildTask(bvh_node.B, mid, end, depth+1));
+    else
+        nNodes += _build(ctx, bvh_node.B, mid, end, depth+1, max_depth);
+
+    return nNodes;
+}
+
+
+/*! Legacy splitter. Splits at the mean of the obj_centers along the
+    largest dimension of the node bbox.
+*/
+template <class T>
+inline uint32_t
+Bvh<T>::_splitMidpoint(BuildContext&     ctx,
+                       const Fsr::Box3f& bbox,
+                       uint32_t          start,
+                       uint32_t          end,
+                       uint8_t&          split_axis)
+{
+    std::vector<BvhObjRef<T> >& obj_refs    = *ctx.obj_refs;
+    Fsr::Vec3fList&             obj_centers = *ctx.obj_centers;
+
+    Fsr::Vec3f weight = obj_centers[start];
+    for (uint32_t i=(start+1); i < end; ++i)
+        weight += obj_centers[i];
+    weight /= float(end - start);
+
     // Find the largest dimension, X, Y, or Z, then find the dividing point
     // to split the range of objects in two.  If an object's bbox intersects a
     // side then it gets moved to that side.  We choose the largest side
     // to balance out the splitting:
-    const Fsr::Vec3f size(bvh_node->bbox.max - bvh_node->bbox.min);
+    const Fsr::Vec3f size(bbox.max - bbox.min);
 
-    uint8_t split_axis = 0;
+    split_axis = 0;
     if (size[1] > size[0])
         split_axis = 1; // Y-split
     if (size[2] > size[split_axis])
         split_axis = 2; // Z-split
 
-    // TODO: enhance split point logic.  For now we just use the midpoint:
-    const float split_point = weight[split_axis];//(m_bbox.min[m_split_axis] + m_bbox.max[m_split_axis]) / 2.0f;
-#ifdef DEBUG_BVH_BUILD
-    std::cout << "  split_axis=" << (int)split_axis << " dist=" << split_point << std::endl;
-#endif
+    const float split_point = weight[split_axis];
 
     // Re-order the object range into two new ranges, one for each side of the hierarchy:
     uint32_t mid = start;
@@ -451,36 +919,118 @@ Bvh<T>::_build(BuilderNode*                bvh_node,
             ++mid;
         }
     }
-    bvh_node->split_axis = split_axis;
+    return mid;
+}
 
-    // If all the objects end up on one side then split the list down the middle:
-    if (mid == start || mid == end)
-        mid = (start + end)/2;
 
-#ifdef DEBUG_BVH_BUILD
-    std::cout << "      split list: ";
-    for (uint32_t i=start; i < mid; ++i)
-        std::cout << " " << i;
-    std::cout << " ||";
-    for (uint32_t i=mid; i < end; ++i)
-        std::cout << " " << i;
-    std::cout << std::endl;
-#endif
+/*! Bins the obj_centers into BVH_SAH_NUM_BINS slots along each axis
+    and picks the bin boundary with the lowest surface-area-heuristic
+    cost: area(A)*count(A) + area(B)*count(B).
+*/
+template <class T>
+inline uint32_t
+Bvh<T>::_splitBinnedSAH(BuildContext& ctx,
+                        uint32_t      start,
+                        uint32_t      end,
+                        uint8_t&      split_axis)
+{
+    std::vector<BvhObjRef<T> >& obj_refs    = *ctx.obj_refs;
+    Fsr::Vec3fList&             obj_centers = *ctx.obj_centers;
 
-    ++max_depth;
-    uint32_t depthA = max_depth;
-    uint32_t depthB = max_depth;
-    if (start < mid)
+    // The bins span the bbox of the centers, not of the objects:
+    Fsr::Box3f center_bbox;
+    for (uint32_t i=start; i < end; ++i)
+        center_bbox.expand(obj_centers[i], false/*test_empty*/);
+    const Fsr::Vec3f extent(center_bbox.max - center_bbox.min);
+
+    split_axis = 0;
+    if (extent[1] > extent[0])
+        split_axis = 1;
+    if (extent[2] > extent[split_axis])
+        split_axis = 2;
+    if (extent[split_axis] <= 0.0f)
+        return (start + end)/2; // all centers coincide, no plane can separate them
+
+    Fsr::Vec3f bin_scale;
+    for (int axis=0; axis < 3; ++axis)
+        bin_scale[axis] = (extent[axis] > 0.0f) ? float(BVH_SAH_NUM_BINS)/extent[axis] : 0.0f;
+
+    // Bin all three axes in one pass over the objects:
+    Fsr::Box3f bin_bbox[3][BVH_SAH_NUM_BINS];
+    uint32_t   bin_count[3][BVH_SAH_NUM_BINS];
+    memset(bin_count, 0, sizeof(bin_count));
+    for (uint32_t i=start; i < end; ++i)
     {
-        bvh_node->A = new BuilderNode();
-        _build(bvh_node->A, obj_refs, obj_centers, start, mid, nNodes, depthA);
+        const Fsr::Vec3f& center = obj_centers[i];
+        const Fsr::Box3f& bbox   = obj_refs[i].bbox;
+        for (int axis=0; axis < 3; ++axis)
+        {
+            const uint32_t bin = std::min(uint32_t((center[axis] - center_bbox.min[axis])*bin_scale[axis]),
+                                          BVH_SAH_NUM_BINS-1);
+            ++bin_count[axis][bin];
+            bin_bbox[axis][bin].expand(bbox, false/*test_empty*/);
+        }
+    }
+
+    float    best_cost = std::numeric_limits<float>::infinity();
+    int      best_axis = -1;
+    uint32_t best_bin  = 0;
+    for (int axis=0; axis < 3; ++axis)
+    {
+        if (extent[axis] <= 0.0f)
+            continue; // centers are flat in this axis, everything is in bin 0
+
+        // Sweep right-to-left to get the B side area & count of each plane:
+        float      B_area[BVH_SAH_NUM_BINS-1];
+        uint32_t   B_count[BVH_SAH_NUM_BINS-1];
+        Fsr::Box3f sweep_bbox;
+        uint32_t   sweep_count = 0;
+        for (uint32_t bin=BVH_SAH_NUM_BINS-1; bin > 0; --bin)
+        {
+            sweep_bbox.expand(bin_bbox[axis][bin], false/*test_empty*/);
+            sweep_count += bin_count[axis][bin];
+            B_area[bin-1]  = halfArea(sweep_bbox);
+            B_count[bin-1] = sweep_count;
+        }
+
+        // Sweep left-to-right evaluating the cost of each plane:
+        sweep_bbox.setToEmptyState();
+        sweep_count = 0;
+        for (uint32_t bin=0; bin < BVH_SAH_NUM_BINS-1; ++bin)
+        {
+            sweep_bbox.expand(bin_bbox[axis][bin], false/*test_empty*/);
+            sweep_count += bin_count[axis][bin];
+            if (sweep_count == 0 || B_count[bin] == 0)
+                continue; // plane doesn't split anything
+
+            const float cost = halfArea(sweep_bbox)*float(sweep_count) + B_area[bin]*float(B_count[bin]);
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin  = bin;
+            }
+        }
     }
-    if (mid < end)
+
+    if (best_axis < 0)
+        return (start + end)/2;
+    split_axis = (uint8_t)best_axis;
+
+    // Re-order the object range so bins <= best_bin are on the A side:
+    uint32_t mid = start;
+    for (uint32_t i=start; i < end; ++i)
     {
-        bvh_node->B = new BuilderNode();
-        _build(bvh_node->B, obj_refs, obj_centers, mid,   end, nNodes, depthB);
+        const uint32_t bin = std::min(uint32_t((obj_centers[i][best_axis] - center_bbox.min[best_axis])*bin_scale[best_axis]),
+                                      BVH_SAH_NUM_BINS-1);
+        if (bin <= best_bin)
+        {
+            std::swap(obj_refs[i],    obj_refs[mid]   );
+            std::swap(obj_centers[i], obj_centers[mid]);
+            ++mid;
+        }
     }
-    max_depth = std::max(depthA, depthB);
+    return mid;
 }
 
 
@@ -489,37 +1039,40 @@ Bvh<T>::_build(BuilderNode*                bvh_node,
 */
 template <class T>
 inline uint32_t
-Bvh<T>::_flatten(const BuilderNode* bvh_node,
+Bvh<T>::_flatten(const BuilderNode* arena,
+                 uint32_t           node_index,
                  uint32_t&          offset)
 {
-    const uint32_t node_index = offset++;
+    const BuilderNode& bvh_node = arena[node_index];
+
+    const uint32_t flat_index = offset++;
 #if DEBUG
-    assert(node_index < m_node_list.size());
+    assert(flat_index < m_node_list.size());
 #endif
-    BvhNode& flat_node = m_node_list[node_index];
+    BvhNode& flat_node = m_node_list[flat_index];
 
-    flat_node.bbox  = bvh_node->bbox;
-    flat_node.depth = bvh_node->depth;
-    if (bvh_node->isLeaf())
+    flat_node.bbox  = bvh_node.bbox;
+    flat_node.depth = bvh_node.depth;
+    if (bvh_node.isLeaf())
     {
-        flat_node.items_start = bvh_node->start;
-        flat_node.num_items   = uint16_t(bvh_node->end - bvh_node->start);
+        flat_node.items_start = bvh_node.start;
+        flat_node.num_items   = uint16_t(bvh_node.end - bvh_node.start);
     }
     else
     {
         flat_node.num_items  = 0;
-        flat_node.split_axis = bvh_node->split_axis;
+        flat_node.split_axis = bvh_node.split_axis;
 
         // Flatten children:
-        if (bvh_node->A)
-            _flatten(bvh_node->A, offset);
-        if (bvh_node->B)
-            flat_node.B_offset = _flatten(bvh_node->B, offset);
+        if (bvh_node.A)
+            _flatten(arena, bvh_node.A, offset);
+        if (bvh_node.B)
+            flat_node.B_offset = _flatten(arena, bvh_node.B, offset);
     }
 
 #ifdef DEBUG_BVH_BUILD
-    std::cout << "    " << node_index << flat_node.bbox << ", depth=" << (int)flat_node.depth;
-    if (bvh_node->isLeaf())
+    std::cout << "    " << flat_index << flat_node.bbox << ", depth=" << (int)flat_node.depth;
+    if (bvh_node.isLeaf())
     {
         std::cout << ", leaf: items_start=" << flat_node.items_start;
         std::cout << ", numItems=" << flat_node.num_items;
@@ -531,29 +1084,175 @@ Bvh<T>::_flatten(const BuilderNode* bvh_node,
     std::cout << std::endl;
 #endif
 
-    return node_index;
+    return flat_index;
 }
 
 
 //--------------------------------------------------------------------------
 
 
+/*! Collapse the binary node list into 4-wide nodes for SIMD traversal.
+    Call after build(). The binary list is kept as the leaf store and
+    as the fallback when wide traversal is disabled.
+*/
+template <class T>
+inline void
+Bvh<T>::buildWideNodes()
+{
+    m_wide_node_list = BvhNode4List(); // releases allocation
+    if (m_node_list.size() == 0)
+        return;
+
+    // Each BvhNode4 replaces at least one binary interior node:
+    m_wide_node_list.reserve(m_node_list.size()/2 + 1);
+
+    if (m_node_list[0].isLeaf())
+    {
+        // Degenerate single-leaf tree, the root gets a single leaf child:
+        BvhNode4 node;
+        memset(&node, 0, sizeof(BvhNode4));
+        for (int axis=0; axis < 3; ++axis)
+        {
+            node.bbox_min[axis][0] = m_node_list[0].bbox.min[axis];
+            node.bbox_max[axis][0] = m_node_list[0].bbox.max[axis];
+        }
+        node.child[0]     = 0;
+        node.is_leaf[0]   = 1;
+        node.num_children = 1;
+        m_wide_node_list.push_back(node);
+        return;
+    }
+
+    _collapse(0/*node_index*/);
+}
+
+
+/*! Recursively collapse binary interior node 'node_index' and its
+    descendants into BvhNode4s, returning the index of the new BvhNode4.
+*/
+template <class T>
+inline uint32_t
+Bvh<T>::_collapse(uint32_t node_index)
+{
+    const uint32_t wide_index = (uint32_t)m_wide_node_list.size();
+    m_wide_node_list.push_back(BvhNode4());
+
+    // Start with the two children then keep opening up the largest
+    // interior child until there's four:
+    uint32_t children[4];
+    uint32_t nChildren = 2;
+    children[0] = node_index + 1;
+    children[1] = m_node_list[node_index].B_offset;
+    while (nChildren < 4)
+    {
+        int   largest      = -1;
+        float largest_area = -1.0f;
+        for (uint32_t i=0; i < nChildren; ++i)
+        {
+            const BvhNode& child = m_node_list[children[i]];
+            if (child.isLeaf())
+                continue;
+            const float area = halfArea(child.bbox);
+            if (area > largest_area)
+            {
+                largest      = (int)i;
+                largest_area = area;
+            }
+        }
+        if (largest < 0)
+            break; // all leaves
+
+        // Replace it with its two children, keeping A-B order:
+        const uint32_t open_index = children[largest];
+        for (uint32_t i=nChildren; i > (uint32_t)largest+1; --i)
+            children[i] = children[i-1];
+        children[largest  ] = open_index + 1;
+        children[largest+1] = m_node_list[open_index].B_offset;
+        ++nChildren;
+    }
+
+    // Recurse first since that may reallocate m_wide_node_list:
+    uint32_t wide_children[4];
+    for (uint32_t i=0; i < nChildren; ++i)
+        wide_children[i] = (m_node_list[children[i]].isLeaf()) ? children[i] : _collapse(children[i]);
+
+    BvhNode4& node = m_wide_node_list[wide_index];
+    memset(&node, 0, sizeof(BvhNode4));
+    for (uint32_t i=0; i < nChildren; ++i)
+    {
+        const BvhNode& child = m_node_list[children[i]];
+        for (int axis=0; axis < 3; ++axis)
+        {
+            node.bbox_min[axis][i] = child.bbox.min[axis];
+            node.bbox_max[axis][i] = child.bbox.max[axis];
+        }
+        node.child[i]   = wide_children[i];
+        node.is_leaf[i] = (child.isLeaf()) ? 1 : 0;
+    }
+    node.num_children = nChildren;
+
+    return wide_index;
+}
+
+
 /*! */
 template <class T>
 inline bool
 Bvh<T>::getIntersectedLeafs(Fsr::RayContext&             Rtx,
-                            std::vector<const BvhNode*>& node_list) const
+                            std::vector<const BvhNode*>& node_list,
+                            bool                         use_wide_nodes,
+                            uint64_t*                    nodes_visited) const
 {
     node_list.clear();
     if (this->isEmpty())
         return false;
 
+    uint64_t nNodes = 0; // for nodes_visited
+    if (use_wide_nodes && hasWideNodes())
+    {
+        // The wide nodes only test children, so test the root bbox first:
+        ++nNodes;
+        if (!Fsr::intersectAABB(m_node_list[0].bbox, m_bbox_origin, Rtx))
+        {
+            if (nodes_visited)
+                *nodes_visited += nNodes;
+            return false;
+        }
+
+        BvhRay4 ray;
+        ray.set(Rtx, m_bbox_origin);
+
+        float    tnear[4];
+        uint32_t next_to_visit_index = 0;
+        uint32_t nodes_to_visit_stack[512];
+        nodes_to_visit_stack[next_to_visit_index++] = 0;
+        while (next_to_visit_index > 0)
+        {
+            const BvhNode4& node = m_wide_node_list[nodes_to_visit_stack[--next_to_visit_index]];
+            const uint32_t hit_mask = intersectBvhNode4(node, ray, tnear);
+            nNodes += node.num_children;
+            for (uint32_t i=0; i < node.num_children; ++i)
+            {
+                if ((hit_mask & (1u << i)) == 0)
+                    continue;
+                if (node.isLeaf(i))
+                    node_list.push_back(&m_node_list[node.child[i]]);
+                else
+                    nodes_to_visit_stack[next_to_visit_index++] = node.child[i];
+            }
+        }
+        if (nodes_visited)
+            *nodes_visited += nNodes;
+        return (node_list.size() > 0);
+    }
+
     uint32_t current_node_index  = 0;
     uint32_t next_to_visit_index = 0;
     uint32_t nodes_to_visit_stack[256];
     while (1)
     {
         const BvhNode& node = m_node_list[current_node_index];
+        ++nNodes;
         if (Fsr::intersectAABB(node.bbox, m_bbox_origin, Rtx))
         {
             if (node.isLeaf())
@@ -588,6 +1287,8 @@ Bvh<T>::getIntersectedLeafs(Fsr::RayContext&             Rtx,
         }
 
     }
+    if (nodes_visited)
+        *nodes_visited += nNodes;
     return (node_list.size() > 0);
 }
 
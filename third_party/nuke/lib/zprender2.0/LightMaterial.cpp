@@ -134,7 +134,8 @@ LightMaterial::getActiveTextureBindings(std::vector<InputBinding*>& texture_bind
 /*! Evaluate the light's contribution to a surface intersection.
     Returns false if light does not contribute to surface illumination.
 
-    Calls illuminate() on the assigned output light shader.
+    Calls illuminate() on the assigned output light shader, timing it
+    if the render stats are enabled.
 */
 bool
 LightMaterial::illuminate(RayShaderContext& stx,
@@ -142,12 +143,14 @@ LightMaterial::illuminate(RayShaderContext& stx,
                           float&            direct_pdfW_out,
                           Fsr::Pixel&       light_color_out)
 {
-    if (m_light_shader)
-        return m_light_shader->illuminate(stx,
-                                          light_ray,
-                                          direct_pdfW_out,
-                                          light_color_out);
-    return false;
+    if (!m_light_shader)
+        return false;
+
+    ShaderTimer timer(stx.thread_ctx->stats, m_light_shader);
+    return m_light_shader->illuminate(stx,
+                                      light_ray,
+                                      direct_pdfW_out,
+                                      light_color_out);
 }
 
 
@@ -424,10 +427,10 @@ LightMaterial::getSurfaceIllumination(const RayShaderContext& stx,
     //
     Fsr::RayContext Rlight;
     float direct_pdfW;
-    if (!m_light_shader->illuminate(stx,
-                                    Rlight,
-                                    direct_pdfW,
-                                    light_color))
+    if (!illuminate(stx,
+                    Rlight,
+                    direct_pdfW,
+                    light_color))
     {
         direct_pdfW_out = 0.0f;
         light_color_out.rgb().setToZero();
@@ -282,8 +282,23 @@ LightMaterialOp::get_L_vector(DD::Image::LightContext&  ltx,
         Fsr::RayContext&  Rlight      = rltx->ttx->Rlight;
         float&            direct_pdfW = rltx->ttx->direct_pdfW;
         Fsr::Pixel&       illum_color = rltx->ttx->illum_color;
-        if (rltx->light_material->getLightShader()->illuminate(stx, Rlight, direct_pdfW, illum_color))
+
+        // Legacy shaders loop over every light themselves so with many lights
+        // each one is randomly skipped, weighted by its importance at surfP:
+        const float select_weight = stx.rtx->light_sampler.selectLight(rltx->ltindex,
+                                                                       stx.PW,
+                                                                       (uint32_t)std::max(0, stx.rtx->k_light_samples),
+                                                                       LightSampler::getSeed(stx));
+        if (select_weight <= 0.0f)
+        {
+            // Skipped, zero the weight so get_shadowing() & get_color() do nothing:
+            direct_pdfW = 0.0f;
+            lightNOut = lobeN;
+            lightDistOut = /*DD::Image::*/INFINITY; // no illum
+        }
+        else if (rltx->light_material->illuminate(stx, Rlight, direct_pdfW, illum_color))
         {
+            direct_pdfW *= select_weight;
             lightNOut = -Rlight.dir().asDDImage();
             lightDistOut = float(Rlight.maxdist);
         }
@@ -341,17 +356,22 @@ LightMaterialOp::get_shadowing(const DD::Image::LightContext&  ltx,
 
         // Get shadowing factor for light (0=shadowed, 1=no shadow):
         float shadowFactor = 1.0f; // full illumination
-        RayShaderContext Rshadow_stx(stx,
-                                     Rlight,
-                                     Fsr::RayContext::shadowPath()/*ray_type*/,
-                                     RenderContext::SIDES_BOTH/*sides_mode*/);
-
-        // TODO: implement soft shadow loop here!
-        Traceable::SurfaceIntersection Ishadow(std::numeric_limits<double>::infinity());
-        if (stx.rtx->objects_bvh.getFirstIntersection(Rshadow_stx, Ishadow) > Fsr::RAY_INTERSECT_NONE &&
-             Ishadow.t < Rlight.maxdist)
+
+        // Don't bother tracing for lights that won't contribute (or were skipped by the LightSampler):
+        if (rltx->ttx->direct_pdfW > 0.0f)
         {
-            shadowFactor = 0.0f; // fully-shadowed
+            RayShaderContext Rshadow_stx(stx,
+                                         Rlight,
+                                         Fsr::RayContext::shadowPath()/*ray_type*/,
+                                         RenderContext::SIDES_BOTH/*sides_mode*/);
+
+            // TODO: implement soft shadow loop here!
+            Traceable::SurfaceIntersection Ishadow(std::numeric_limits<double>::infinity());
+            if (stx.rtx->objects_bvh.getFirstIntersection(Rshadow_stx, Ishadow) > Fsr::RAY_INTERSECT_NONE &&
+                 Ishadow.t < Rlight.maxdist)
+            {
+                shadowFactor = 0.0f; // fully-shadowed
+            }
         }
 
         // Copy the shadowing factor to the output shadowmask channel
@@ -0,0 +1,460 @@
+//
+// Copyright 2020 DreamWorks Animation
+//
+// Licensed under the Apache License, Version 2.0 (the "Apache License")
+// with the following modification; you may not use this file except in
+// compliance with the Apache License and the following modification to it:
+// Section 6. Trademarks. is deleted and replaced with:
+//
+// 6. Trademarks. This License does not grant permission to use the trade
+//    names, trademarks, service marks, or product names of the Licensor
+//    and its affiliates, except as required to comply with Section 4(c) of
+//    the License and to reproduce the content of the NOTICE file.
+//
+// You may obtain a copy of the Apache License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the Apache License with the above modification is
+// distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied. See the Apache License for the specific
+// language governing permissions and limitations under the Apache License.
+//
+
+/// @file zprender/LightSampler.cpp
+///
+/// @author Jonathan Egstad
+
+
+#include "LightSampler.h"
+#include "LightMaterial.h"
+#include "LightShader.h"
+#include "RenderContext.h"
+
+#include <DDImage/LightOp.h>
+
+#include <cmath>   // for isfinite
+#include <cstring> // for memcpy
+
+
+namespace zpr {
+
+
+//! Keeps the importance finite when a shading point is on top of a light.
+static const float MIN_LIGHT_DIST_SQUARED = 1.0e-6f;
+
+
+/*! Hash 'seed' & 'n' into a float in the range [0..1).
+*/
+static inline float
+hashToFloat(uint32_t seed,
+            uint32_t n)
+{
+    uint32_t h = seed ^ (n*0x9e3779b9u);
+    h ^= (h >> 16); h *= 0x7feb352du;
+    h ^= (h >> 15); h *= 0x846ca68bu;
+    h ^= (h >> 16);
+    return float(h >> 8)*(1.0f / 16777216.0f);
+}
+
+//! Mix the bits of a float into a hash.
+static inline uint32_t
+hashFloat(uint32_t h,
+          float    f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(uint32_t));
+    h ^= bits + 0x9e3779b9u + (h << 6) + (h >> 2);
+    return h;
+}
+
+
+//-----------------------------------------------------------------------------
+
+
+/*!
+*/
+LightSampler::LightSampler()
+{
+    //
+}
+
+
+/*!
+*/
+void
+LightSampler::clear()
+{
+    m_bvh.clear();
+    m_node_info.clear();
+    m_tree_lights.clear();
+    m_unsampled_lights.clear();
+    m_tree_index_for_light.clear();
+}
+
+
+/*! Build the light tree from the RenderContext's light MaterialContexts.
+    Call once per render after the light materials have been validated.
+*/
+void
+LightSampler::build(const RenderContext& rtx)
+{
+    clear();
+
+    const uint32_t nLights = (uint32_t)rtx.light_material_ctxs.size();
+    if (nLights == 0 || rtx.shutter_scenerefs.size() == 0)
+        return;
+
+    const zpr::Scene* scene0 = rtx.shutter_scenerefs[0].scene;
+#if DEBUG
+    assert(scene0);
+#endif
+
+    m_tree_index_for_light.resize(nLights, -1);
+    m_tree_lights.reserve(nLights);
+
+    std::vector<BvhObjRef<uint32_t> > ref_list;
+    ref_list.reserve(nLights);
+
+    for (uint32_t ltindex=0; ltindex < nLights; ++ltindex)
+    {
+        const MaterialContext& material_ctx = rtx.light_material_ctxs[ltindex];
+        if (!material_ctx.enabled || !material_ctx.raymaterial)
+            continue; // no assigned or active LightMaterial, skip
+
+        LightMaterial* lt_material = static_cast<LightMaterial*>(material_ctx.raymaterial);
+        LightShader*   lt_shader   = lt_material->getLightShader();
+        if (!lt_shader || !lt_shader->isEnabled())
+            continue; // can't illuminate anything
+
+        // Directional lights have no position to build the tree with:
+        const DD::Image::LightOp* light = (ltindex < scene0->lights.size() && scene0->lights[ltindex]) ?
+                                            scene0->lights[ltindex]->light() : NULL;
+        if (!light || light->lightType() == DD::Image::LightOp::eDirectionalLight ||
+            lt_shader->numMotionXforms() == 0)
+        {
+            m_unsampled_lights.push_back(lt_material);
+            continue;
+        }
+
+        const Fsr::Vec3f rgb = lt_shader->m_color.rgb();
+        const float power = rgb.x*0.2126f + rgb.y*0.7152f + rgb.z*0.0722f;
+        if (power <= 0.0f)
+            continue; // won't contribute
+
+        TreeLight tree_light;
+        tree_light.light_material = lt_material;
+        tree_light.power          = power;
+        tree_light.bounded        = false;
+        tree_light.leaf_node      = 0;
+
+        // Use the LightVolume bounds to limit the light's influence, if it's finite:
+        if (lt_shader->canGenerateLightVolume())
+        {
+            const Fsr::Box3d vol_bbox = lt_shader->getLightVolumeMotionBbox();
+            if (!vol_bbox.isEmpty() &&
+                std::isfinite(vol_bbox.min.x) && std::isfinite(vol_bbox.min.y) && std::isfinite(vol_bbox.min.z) &&
+                std::isfinite(vol_bbox.max.x) && std::isfinite(vol_bbox.max.y) && std::isfinite(vol_bbox.max.z))
+            {
+                tree_light.influence_bbox = Fsr::Box3f(vol_bbox);
+                tree_light.bounded        = true;
+            }
+        }
+
+        // Position bbox covers all the motion samples:
+        Fsr::Box3f pos_bbox;
+        pos_bbox.set(Fsr::Vec3f(lt_shader->getMotionXform(0).getTranslation()));
+        for (uint32_t j=1; j < lt_shader->numMotionXforms(); ++j)
+            pos_bbox.expand(Fsr::Vec3f(lt_shader->getMotionXform(j).getTranslation()), false/*test_empty*/);
+
+        m_tree_index_for_light[ltindex] = (int32_t)m_tree_lights.size();
+        ref_list.push_back(BvhObjRef<uint32_t>((uint32_t)m_tree_lights.size(), pos_bbox));
+        m_tree_lights.push_back(tree_light);
+    }
+
+    if (ref_list.size() == 0)
+        return;
+
+    // Light positions are zero-area so SAH can't rank the splits, use midpoint:
+    m_bvh.setName("LightSampler");
+    m_bvh.build(ref_list, 1/*max_objects_per_leaf*/, BVH_BUILD_MIDPOINT);
+
+    // Children are always stored after their parent so accumulate the
+    // node info in reverse:
+    const uint32_t nNodes = m_bvh.numNodes();
+    m_node_info.resize(nNodes);
+    for (int32_t i=int32_t(nNodes)-1; i >= 0; --i)
+    {
+        const BvhNode& node = m_bvh.getNode(i);
+        NodeInfo& info = m_node_info[i];
+        if (node.isLeaf())
+        {
+#if DEBUG
+            assert(node.numItems() == 1);
+#endif
+            TreeLight& tree_light = m_tree_lights[m_bvh.getItem(node.itemStart())];
+            tree_light.leaf_node = (uint32_t)i;
+            info.power          = tree_light.power;
+            info.influence_bbox = tree_light.influence_bbox;
+            info.bounded        = tree_light.bounded;
+        }
+        else
+        {
+            const NodeInfo& A = m_node_info[i+1];
+            const NodeInfo& B = m_node_info[node.B_offset];
+            info.power   = A.power + B.power;
+            info.bounded = (A.bounded && B.bounded);
+            if (info.bounded)
+            {
+                info.influence_bbox = A.influence_bbox;
+                info.influence_bbox.expand(B.influence_bbox, false/*test_empty*/);
+            }
+        }
+    }
+    //std::cout << "LightSampler::build(): " << m_tree_lights.size() << " tree lights, ";
+    //std::cout << m_unsampled_lights.size() << " unsampled lights, depth=" << m_bvh.maxNodeDepth() << std::endl;
+}
+
+
+//-----------------------------------------------------------------------------
+
+
+/*! Hash the subpixel location and shading point into a seed for light selection.
+*/
+/*static*/
+uint32_t
+LightSampler::getSeed(const RayShaderContext& stx)
+{
+    uint32_t h = 0x2545f491u;
+    h = hashFloat(h, float(stx.sx));
+    h = hashFloat(h, float(stx.sy));
+    h = hashFloat(h, float(stx.PW.x));
+    h = hashFloat(h, float(stx.PW.y));
+    h = hashFloat(h, float(stx.PW.z));
+    return h;
+}
+
+
+/*! Estimate how much light a Bvh node can deliver to P, 0 if none.
+
+    This is the node power over the squared distance to its center,
+    with the distance clamped to the node's radius so nodes surrounding
+    P aren't overly favored.
+*/
+float
+LightSampler::nodeImportance(uint32_t          node_index,
+                             const Fsr::Vec3f& P,
+                             const Fsr::Vec3f* N) const
+{
+    const NodeInfo& info = m_node_info[node_index];
+    if (info.power <= 0.0f)
+        return 0.0f;
+
+    // Outside the influence of every light in the node:
+    if (info.bounded && !info.influence_bbox.pointIsInside(P))
+        return 0.0f;
+
+    const Fsr::Box3f& bbox = m_bvh.getNode(node_index).bbox;
+    if (N)
+    {
+        // Skip if all the bbox corners are below the surface horizon:
+        bool above = false;
+        for (int i=0; i < 8 && !above; ++i)
+        {
+            const Fsr::Vec3f corner((i & 1) ? bbox.max.x : bbox.min.x,
+                                    (i & 2) ? bbox.max.y : bbox.min.y,
+                                    (i & 4) ? bbox.max.z : bbox.min.z);
+            above = (N->dot(corner - P) > 0.0f);
+        }
+        if (!above)
+            return 0.0f;
+    }
+
+    const float r2 = (bbox.max - bbox.min).lengthSquared()*0.25f;
+    const float d2 = std::max(P.distanceSquared(bbox.getCenter()), std::max(r2, MIN_LIGHT_DIST_SQUARED));
+
+    return info.power / d2;
+}
+
+
+/*! Descend the tree picking a light with random number 'u'.
+    Returns the m_tree_lights index or -1 if no light can reach P.
+*/
+int32_t
+LightSampler::sampleTree(const Fsr::Vec3f& P,
+                         const Fsr::Vec3f* N,
+                         float             u,
+                         float&            pdf) const
+{
+    pdf = 0.0f;
+    if (m_node_info.size() == 0 || nodeImportance(0, P, N) <= 0.0f)
+        return -1;
+
+    float    node_pdf   = 1.0f;
+    uint32_t node_index = 0;
+    while (1)
+    {
+        const BvhNode& node = m_bvh.getNode(node_index);
+        if (node.isLeaf())
+            break;
+
+        const float wA    = nodeImportance(node_index+1,  P, N);
+        const float wB    = nodeImportance(node.B_offset, P, N);
+        const float total = (wA + wB);
+        if (total <= 0.0f)
+            return -1;
+
+        // Pick a side and rescale 'u' for the next level down:
+        const float pA = (wA / total);
+        if (u < pA)
+        {
+            u = (u / pA);
+            node_pdf *= pA;
+            node_index = node_index+1;
+        }
+        else
+        {
+            u = (u - pA) / (1.0f - pA);
+            node_pdf *= (1.0f - pA);
+            node_index = node.B_offset;
+        }
+        u = std::min(u, 1.0f - std::numeric_limits<float>::epsilon());
+    }
+
+    pdf = node_pdf;
+    return (int32_t)m_bvh.getItem(m_bvh.getNode(node_index).itemStart());
+}
+
+
+/*! Return the probability that sampleTree() picks the light at
+    m_tree_lights index 'tree_index'.
+*/
+float
+LightSampler::treePdf(uint32_t          tree_index,
+                      const Fsr::Vec3f& P,
+                      const Fsr::Vec3f* N) const
+{
+    if (m_node_info.size() == 0 || nodeImportance(0, P, N) <= 0.0f)
+        return 0.0f;
+
+    // Nodes are depth-first so the leaf is under child A if it
+    // comes before child B:
+    const uint32_t leaf_node = m_tree_lights[tree_index].leaf_node;
+
+    float    pdf        = 1.0f;
+    uint32_t node_index = 0;
+    while (node_index != leaf_node)
+    {
+        const BvhNode& node = m_bvh.getNode(node_index);
+#if DEBUG
+        assert(!node.isLeaf());
+#endif
+        const float wA    = nodeImportance(node_index+1,  P, N);
+        const float wB    = nodeImportance(node.B_offset, P, N);
+        const float total = (wA + wB);
+        if (total <= 0.0f)
+            return 0.0f;
+
+        if (leaf_node < node.B_offset)
+        {
+            pdf *= (wA / total);
+            node_index = node_index+1;
+        }
+        else
+        {
+            pdf *= (wB / total);
+            node_index = node.B_offset;
+        }
+        if (pdf <= 0.0f)
+            return 0.0f;
+    }
+    return pdf;
+}
+
+
+//-----------------------------------------------------------------------------
+
+
+/*! Fill 'samples' with the lights to evaluate at world-space point P.
+*/
+void
+LightSampler::selectLights(const LightMaterialList& all_lights,
+                           const Fsr::Vec3d&        P,
+                           const Fsr::Vec3d*        N,
+                           uint32_t                 num_samples,
+                           uint32_t                 seed,
+                           LightSampleList&         samples) const
+{
+    samples.clear();
+
+    if (!isActive(num_samples))
+    {
+        // Evaluate every light:
+        const size_t nLights = all_lights.size();
+        samples.reserve(nLights);
+        for (size_t i=0; i < nLights; ++i)
+            samples.push_back(LightSample(all_lights[i], 1.0f));
+        return;
+    }
+
+    const size_t nUnsampled = m_unsampled_lights.size();
+    samples.reserve(nUnsampled + num_samples);
+    for (size_t i=0; i < nUnsampled; ++i)
+        samples.push_back(LightSample(m_unsampled_lights[i], 1.0f));
+
+    const Fsr::Vec3f  Pf(P);
+    const Fsr::Vec3f  Nf = (N) ? Fsr::Vec3f(*N) : Fsr::Vec3f(0.0f);
+    const Fsr::Vec3f* Nfp = (N) ? &Nf : NULL;
+    if (nodeImportance(0, Pf, Nfp) <= 0.0f)
+        return; // no tree light can reach P
+
+    // A pick can still fail lower in the tree, but every sample must be
+    // attempted to keep the estimate unbiased:
+    const float inv_num_samples = 1.0f / float(num_samples);
+    for (uint32_t i=0; i < num_samples; ++i)
+    {
+        float pdf;
+        const int32_t tree_index = sampleTree(Pf, Nfp, hashToFloat(seed, i), pdf);
+        if (tree_index >= 0)
+            samples.push_back(LightSample(m_tree_lights[tree_index].light_material, inv_num_samples / pdf));
+    }
+}
+
+
+/*! Stochastically decide if the light at scene index 'ltindex' is evaluated at point P.
+    Returns the weight to scale the light's contribution by, or 0 if it should be skipped.
+*/
+float
+LightSampler::selectLight(int32_t           ltindex,
+                          const Fsr::Vec3d& P,
+                          uint32_t          num_samples,
+                          uint32_t          seed) const
+{
+    if (!isActive(num_samples) || ltindex < 0 || ltindex >= (int32_t)m_tree_index_for_light.size())
+        return 1.0f;
+
+    const int32_t tree_index = m_tree_index_for_light[ltindex];
+    if (tree_index < 0)
+        return 1.0f; // not in tree, always evaluated
+
+    const float pdf = treePdf((uint32_t)tree_index, Fsr::Vec3f(P), NULL/*N*/);
+    if (pdf <= 0.0f)
+        return 0.0f;
+
+    // Probability of being picked at least once in num_samples tries:
+    const float keep = (pdf >= 1.0f) ? 1.0f : float(1.0 - std::pow(1.0 - double(pdf), double(num_samples)));
+    if (keep <= 0.0f || hashToFloat(seed, uint32_t(ltindex) + 0x51ed27u) >= keep)
+        return 0.0f;
+
+    return 1.0f / keep;
+}
+
+
+} // namespace zpr
+
+// end of zprender/LightSampler.cpp
+
+//
+// Copyright 2020 DreamWorks Animation
+//
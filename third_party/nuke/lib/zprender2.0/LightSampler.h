@@ -0,0 +1,185 @@
+//
+// Copyright 2020 DreamWorks Animation
+//
+// Licensed under the Apache License, Version 2.0 (the "Apache License")
+// with the following modification; you may not use this file except in
+// compliance with the Apache License and the following modification to it:
+// Section 6. Trademarks. is deleted and replaced with:
+//
+// 6. Trademarks. This License does not grant permission to use the trade
+//    names, trademarks, service marks, or product names of the Licensor
+//    and its affiliates, except as required to comply with Section 4(c) of
+//    the License and to reproduce the content of the NOTICE file.
+//
+// You may obtain a copy of the Apache License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the Apache License with the above modification is
+// distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied. See the Apache License for the specific
+// language governing permissions and limitations under the Apache License.
+//
+
+/// @file zprender/LightSampler.h
+///
+/// @author Jonathan Egstad
+
+
+#ifndef zprender_LightSampler_h
+#define zprender_LightSampler_h
+
+#include "Bvh.h"
+#include "RayShaderContext.h"
+
+
+namespace zpr {
+
+class RenderContext;
+
+
+/*! A light chosen for a shading point and the weight to scale its
+    contribution by to account for the lights that weren't chosen.
+*/
+struct LightSample
+{
+    LightMaterial* light_material;  //!< Light to evaluate
+    float          weight;          //!< 1/(num_samples*pdf), or 1 if not importance sampled
+
+    //! Default ctor leaves junk in vars.
+    LightSample() {}
+    //!
+    LightSample(LightMaterial* _light_material,
+                float          _weight) : light_material(_light_material), weight(_weight) {}
+};
+typedef std::vector<LightSample> LightSampleList;
+
+
+/*! Picks an importance-weighted subset of the scene lights to evaluate
+    at a shading point so direct lighting cost doesn't grow linearly with
+    the light count.
+
+    A Bvh is built over the light positions once per render. Each node
+    also stores the summed power of its lights and the union of their
+    influence bounds - the LightVolume motion bbox for LightShaders that
+    can create one. A light is picked by descending the tree choosing each
+    child with a probability proportional to its power over the squared
+    distance to its bounds, and the product of those probabilities is the
+    pdf the light's contribution is divided by.
+
+    Directional lights have no position so they're kept out of the tree
+    and always evaluated.
+*/
+class ZPR_EXPORT LightSampler
+{
+  protected:
+    //! A light in the tree.
+    struct TreeLight
+    {
+        LightMaterial* light_material;  //!< Light to evaluate
+        float          power;           //!< Luminance of the LightShader's color*intensity
+        Fsr::Box3f     influence_bbox;  //!< LightVolume bbox, only if 'bounded' is true
+        bool           bounded;         //!< Does the light have finite influence bounds?
+        uint32_t       leaf_node;       //!< Bvh leaf node containing this light
+    };
+
+    //! Light power and influence bounds of a Bvh node's subtree.
+    struct NodeInfo
+    {
+        float      power;               //!< Summed power of all lights in node
+        Fsr::Box3f influence_bbox;      //!< Union of light influence bboxes, only if 'bounded' is true
+        bool       bounded;             //!< False if any light in the node has unbounded influence
+    };
+
+
+    Bvh<uint32_t>               m_bvh;                  //!< Tree of light positions, items index m_tree_lights
+    std::vector<NodeInfo>       m_node_info;            //!< Per-Bvh node power & influence
+    std::vector<TreeLight>      m_tree_lights;          //!< Importance-sampled lights
+    LightMaterialList           m_unsampled_lights;     //!< Lights always evaluated (no position)
+    std::vector<int32_t>        m_tree_index_for_light; //!< Scene light index -> m_tree_lights index, -1 if not in tree
+
+
+  public:
+    //!
+    LightSampler();
+
+    /*! Build the light tree from the RenderContext's light MaterialContexts.
+        Call once per render after the light materials have been validated.
+    */
+    void build(const RenderContext& rtx);
+
+    //! Release the tree.
+    void clear();
+
+    //! Number of lights in the importance-sampled tree.
+    uint32_t numTreeLights() const { return (uint32_t)m_tree_lights.size(); }
+
+    //! Sampling is only worth doing when there's more tree lights than samples.
+    bool isActive(uint32_t num_samples) const { return (num_samples > 0 && numTreeLights() > num_samples); }
+
+
+    /*! Fill 'samples' with the lights to evaluate at world-space point P.
+
+        If sampling isn't active this is every light in 'all_lights' with a
+        weight of 1. Otherwise it's the unsampled lights plus 'num_samples'
+        importance-sampled picks from the tree.
+
+        If 'N' is not NULL nodes entirely below the surface horizon are skipped.
+        'seed' should come from getSeed() so the choice is stable regardless
+        of which thread renders the sample.
+    */
+    void selectLights(const LightMaterialList& all_lights,
+                      const Fsr::Vec3d&        P,
+                      const Fsr::Vec3d*        N,
+                      uint32_t                 num_samples,
+                      uint32_t                 seed,
+                      LightSampleList&         samples) const;
+
+    /*! For shading that evaluates lights one at a time (legacy LightOp shading)
+        stochastically decide if the light at scene index 'ltindex' is evaluated
+        at point P.
+
+        The light is kept with the probability that it would be picked at least
+        once in 'num_samples' tree samples. Returns the weight to scale the
+        light's contribution by, or 0 if the light should be skipped.
+    */
+    float selectLight(int32_t           ltindex,
+                      const Fsr::Vec3d& P,
+                      uint32_t          num_samples,
+                      uint32_t          seed) const;
+
+
+    //! Hash the subpixel location and shading point into a seed for light selection.
+    static uint32_t getSeed(const RayShaderContext& stx);
+
+
+  protected:
+    //! Estimate how much light a Bvh node can deliver to P, 0 if none.
+    float nodeImportance(uint32_t          node_index,
+                         const Fsr::Vec3f& P,
+                         const Fsr::Vec3f* N) const;
+
+    //! Descend the tree picking a light with random number 'u'. Returns the m_tree_lights index or -1.
+    int32_t sampleTree(const Fsr::Vec3f& P,
+                       const Fsr::Vec3f* N,
+                       float             u,
+                       float&            pdf) const;
+
+    //! Return the probability that sampleTree() picks the light at m_tree_lights index 'tree_index'.
+    float treePdf(uint32_t          tree_index,
+                  const Fsr::Vec3f& P,
+                  const Fsr::Vec3f* N) const;
+
+};
+
+
+} // namespace zpr
+
+#endif
+
+// end of zprender/LightSampler.h
+
+//
+// Copyright 2020 DreamWorks Animation
+//
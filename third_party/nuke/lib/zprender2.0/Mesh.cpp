@@ -35,14 +35,204 @@
 #include <Fuser/ExecuteTargetContexts.h> // for MeshTessellateContext
 #include <Fuser/MeshUtils.h> // for calcPointNormals()
 
-#include <DDImage/Thread.h> // for Lock, sleepFor
+#include <cfloat> // for FLT_EPSILON
+#include <condition_variable>
+#include <mutex>
 
 //#define DEBUG_MESH_BUILD 1
 
 namespace zpr {
 
 
-static DD::Image::Lock my_lock;
+static std::mutex              expand_mutex;
+static std::condition_variable expand_cv;
+
+
+//! Max tris per Bvh leaf when building for wide traversal, matches the TriBatch4 width.
+static const uint32_t MESH_BVH_WIDE_LEAF_TRIS = 4;
+
+//! Marks a wide-traversal stack entry as a binary leaf node index rather than a BvhNode4 index.
+static const uint32_t WIDE_STACK_LEAF_BIT = 0x80000000;
+
+
+/*! Up to 4 subtris in SoA layout for the SIMD batch test.
+    The float test is only a conservative cull, hits are retested
+    with the original points in double-precision.
+*/
+struct TriBatch4
+{
+    float      p0[3][4];    //!< First vert, [axis][tri]
+    float      e1[3][4];    //!< Edge p1-p0, [axis][tri]
+    float      e2[3][4];    //!< Edge p2-p0, [axis][tri]
+    Fsr::Vec3f P[4][3];     //!< Original local-space points, per tri
+    uint32_t   item[4];     //!< Bvh item index, per tri
+    uint32_t   count;       //!< Number of valid tris
+};
+
+
+/*! Fill a TriBatch4 with up to 4 subtris starting at Bvh item 'item',
+    interpolating the points if between motion samples.
+    Returns the number of tris added.
+*/
+static inline uint32_t
+gatherTriBatch4(const Mesh&         mesh,
+                const FaceIndexBvh& bvh,
+                uint32_t            item,
+                uint32_t            end_item,
+                int                 motion_mode,
+                uint32_t            motion_step,
+                float               motion_step_t,
+                TriBatch4&          tris)
+{
+    tris.count = std::min(end_item - item, 4u);
+    for (uint32_t i=0; i < 4; ++i)
+    {
+        if (i < tris.count)
+        {
+            Fsr::Vec3f* P = tris.P[i];
+            mesh.getTriPointsLocal(bvh.getItem(item + i), motion_mode, motion_step, motion_step_t, P[0], P[1], P[2]);
+            tris.item[i] = item + i;
+            for (int axis=0; axis < 3; ++axis)
+            {
+                tris.p0[axis][i] = P[0][axis];
+                tris.e1[axis][i] = P[1][axis] - P[0][axis];
+                tris.e2[axis][i] = P[2][axis] - P[0][axis];
+            }
+        }
+        else
+        {
+            // Degenerate tri, never hit:
+            for (int axis=0; axis < 3; ++axis)
+                tris.p0[axis][i] = tris.e1[axis][i] = tris.e2[axis][i] = 0.0f;
+        }
+    }
+    return tris.count;
+}
+
+
+/*! Moller-Trumbore test of 4 tris against a ray, returning a bitmask of the
+    tris that are hit between ray.tmin and 'tmax'.
+
+    The barycentric and distance tests are padded by a bound on the float
+    rounding error of each tri's terms, scaled by the L1 magnitudes of the
+    ray, tvec and edge vectors over |det|. That keeps edge hits of large,
+    distant or sliver tris from being culled, which a fixed epsilon can't
+    guarantee. The extra false positives are rejected by the double-precision
+    retest.
+*/
+static inline uint32_t
+intersectTriBatch4(const TriBatch4& tris,
+                   const BvhRay4&   ray,
+                   float            tmax)
+{
+    const float t_lo     = ray.tmin*(1.0f - 1.0e-5f) - 1.0e-5f;
+    const float t_hi     = tmax*(1.0f + 1.0e-5f);
+    const uint32_t valid_mask = (1u << tris.count) - 1u;
+
+    // Rounding error per unit magnitude. The L1 norms used below already
+    // over-estimate the dot & cross product error so one ulp is plenty:
+    const float err_scale = FLT_EPSILON;
+    const float dir_len   = fabsf(ray.dir[0]) + fabsf(ray.dir[1]) + fabsf(ray.dir[2]);
+    const float org_len   = fabsf(ray.org[0]) + fabsf(ray.org[1]) + fabsf(ray.org[2]);
+
+#if defined(__SSE__)
+    const __m128 dx = _mm_set1_ps(ray.dir[0]);
+    const __m128 dy = _mm_set1_ps(ray.dir[1]);
+    const __m128 dz = _mm_set1_ps(ray.dir[2]);
+
+    const __m128 e1x = _mm_loadu_ps(tris.e1[0]);
+    const __m128 e1y = _mm_loadu_ps(tris.e1[1]);
+    const __m128 e1z = _mm_loadu_ps(tris.e1[2]);
+    const __m128 e2x = _mm_loadu_ps(tris.e2[0]);
+    const __m128 e2y = _mm_loadu_ps(tris.e2[1]);
+    const __m128 e2z = _mm_loadu_ps(tris.e2[2]);
+
+    // pvec = dir x e2
+    const __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+    const __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+    const __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+
+    const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+    const __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+    // tvec = org - p0
+    const __m128 tx = _mm_sub_ps(_mm_set1_ps(ray.org[0]), _mm_loadu_ps(tris.p0[0]));
+    const __m128 ty = _mm_sub_ps(_mm_set1_ps(ray.org[1]), _mm_loadu_ps(tris.p0[1]));
+    const __m128 tz = _mm_sub_ps(_mm_set1_ps(ray.org[2]), _mm_loadu_ps(tris.p0[2]));
+
+    // qvec = tvec x e1
+    const __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+    const __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+    const __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+
+    const __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv_det);
+    const __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det);
+    const __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+
+    // Error bounds, |tvec| includes the ray origin magnitude as tvec itself
+    // was rounded:
+    const __m128 sign_bit = _mm_set1_ps(-0.0f);
+    const __m128 T  = _mm_add_ps(_mm_set1_ps(org_len),
+                                 _mm_add_ps(_mm_add_ps(_mm_andnot_ps(sign_bit, tx), _mm_andnot_ps(sign_bit, ty)),
+                                            _mm_andnot_ps(sign_bit, tz)));
+    const __m128 E1 = _mm_add_ps(_mm_add_ps(_mm_andnot_ps(sign_bit, e1x), _mm_andnot_ps(sign_bit, e1y)),
+                                 _mm_andnot_ps(sign_bit, e1z));
+    const __m128 E2 = _mm_add_ps(_mm_add_ps(_mm_andnot_ps(sign_bit, e2x), _mm_andnot_ps(sign_bit, e2y)),
+                                 _mm_andnot_ps(sign_bit, e2z));
+    const __m128 err  = _mm_mul_ps(_mm_set1_ps(err_scale), _mm_andnot_ps(sign_bit, inv_det));
+    const __m128 E1E2 = _mm_mul_ps(E1, E2);
+    const __m128 bary_pad = _mm_mul_ps(_mm_mul_ps(err, _mm_set1_ps(dir_len)),
+                                       _mm_add_ps(_mm_mul_ps(T, _mm_add_ps(E1, E2)), E1E2));
+    const __m128 t_pad    = _mm_mul_ps(err, _mm_mul_ps(T, E1E2));
+
+    // NaNs from degenerate tris fail all the compares:
+    __m128 mask = _mm_cmpneq_ps(det, _mm_setzero_ps());
+    mask = _mm_and_ps(mask, _mm_cmpge_ps(_mm_add_ps(u, bary_pad), _mm_setzero_ps()));
+    mask = _mm_and_ps(mask, _mm_cmpge_ps(_mm_add_ps(v, bary_pad), _mm_setzero_ps()));
+    mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_sub_ps(_mm_add_ps(u, v), _mm_add_ps(bary_pad, bary_pad)), _mm_set1_ps(1.0f)));
+    mask = _mm_and_ps(mask, _mm_cmpge_ps(_mm_add_ps(t, t_pad), _mm_set1_ps(t_lo)));
+    mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_sub_ps(t, t_pad), _mm_set1_ps(t_hi)));
+
+    return ((uint32_t)_mm_movemask_ps(mask) & valid_mask);
+#else
+    // Scalar fallback:
+    uint32_t hit_mask = 0;
+    for (uint32_t i=0; i < tris.count; ++i)
+    {
+        const float e1[3] = { tris.e1[0][i], tris.e1[1][i], tris.e1[2][i] };
+        const float e2[3] = { tris.e2[0][i], tris.e2[1][i], tris.e2[2][i] };
+        const float p[3]  = { ray.dir[1]*e2[2] - ray.dir[2]*e2[1],
+                              ray.dir[2]*e2[0] - ray.dir[0]*e2[2],
+                              ray.dir[0]*e2[1] - ray.dir[1]*e2[0] };
+        const float det = e1[0]*p[0] + e1[1]*p[1] + e1[2]*p[2];
+        if (det == 0.0f)
+            continue;
+        const float inv_det = 1.0f / det;
+        const float tv[3] = { ray.org[0] - tris.p0[0][i], ray.org[1] - tris.p0[1][i], ray.org[2] - tris.p0[2][i] };
+
+        const float T  = org_len + fabsf(tv[0]) + fabsf(tv[1]) + fabsf(tv[2]);
+        const float E1 = fabsf(e1[0]) + fabsf(e1[1]) + fabsf(e1[2]);
+        const float E2 = fabsf(e2[0]) + fabsf(e2[1]) + fabsf(e2[2]);
+        const float err      = err_scale*fabsf(inv_det);
+        const float bary_pad = err*dir_len*(T*(E1 + E2) + E1*E2);
+        const float t_pad    = err*T*E1*E2;
+
+        const float u = (tv[0]*p[0] + tv[1]*p[1] + tv[2]*p[2])*inv_det;
+        if (u + bary_pad < 0.0f)
+            continue;
+        const float q[3] = { tv[1]*e1[2] - tv[2]*e1[1],
+                             tv[2]*e1[0] - tv[0]*e1[2],
+                             tv[0]*e1[1] - tv[1]*e1[0] };
+        const float v = (ray.dir[0]*q[0] + ray.dir[1]*q[1] + ray.dir[2]*q[2])*inv_det;
+        if (v + bary_pad < 0.0f || (u + v) - 2.0f*bary_pad > 1.0f)
+            continue;
+        const float t = (e2[0]*q[0] + e2[1]*q[1] + e2[2]*q[2])*inv_det;
+        if (t + t_pad >= t_lo && t - t_pad <= t_hi)
+            hit_mask |= (1u << i);
+    }
+    return (hit_mask & valid_mask);
+#endif
+}
 
 //-----------------------------------------------------------------------------------------------------------
 //-----------------------------------------------------------------------------------------------------------
@@ -429,7 +619,7 @@ Mesh::quadFaceIntersect(uint32_t             face,
     const uint32_t v3 = *vp++;
     if (motion_mode != MOTIONSTEP_MID)
     {
-        const uint32_t motion_sample = motion_step + (motion_mode == MOTIONSTEP_START) ? 0 : 1;
+        const uint32_t motion_sample = motion_step + ((motion_mode == MOTIONSTEP_START) ? 0 : 1);
 #if DEBUG
         assert(motion_sample < (uint32_t)m_motion_meshes.size());
 #endif
@@ -531,7 +721,7 @@ Mesh::triFaceIntersect(uint32_t             face,
     const uint32_t v2 = *vp++;
     if (motion_mode != MOTIONSTEP_MID)
     {
-        const uint32_t motion_sample = motion_step + (motion_mode == MOTIONSTEP_START) ? 0 : 1;
+        const uint32_t motion_sample = motion_step + ((motion_mode == MOTIONSTEP_START) ? 0 : 1);
 #if DEBUG
         assert(motion_sample < (uint32_t)m_motion_meshes.size());
 #endif
@@ -611,7 +801,7 @@ Mesh::polyFaceIntersect(uint32_t             face,
     const uint32_t* vp = &m_vert_indice_list[m_vert_start_per_face[face]];
     if (motion_mode != MOTIONSTEP_MID)
     {
-        const uint32_t motion_sample = motion_step + (motion_mode == MOTIONSTEP_START) ? 0 : 1;
+        const uint32_t motion_sample = motion_step + ((motion_mode == MOTIONSTEP_START) ? 0 : 1);
 #if DEBUG
         assert(motion_sample < (uint32_t)m_motion_meshes.size());
 #endif
@@ -687,6 +877,7 @@ Mesh::polyFaceIntersect(uint32_t             face,
 */
 void
 Mesh::buildBvh(const RenderContext& rtx,
+               uint32_t             max_threads,
                bool                 force)
 {
     if (m_motion_bvhs.size() > 0 && !force)
@@ -707,6 +898,10 @@ Mesh::buildBvh(const RenderContext& rtx,
 #endif
     std::vector<FaceIndexRef> facerefs(m_num_facetris);
 
+    // The wide traversal batch-tests a leaf's tris with SIMD so make the leafs
+    // as large as the batch:
+    const uint32_t max_tris_per_leaf = (rtx.k_bvh_wide_traversal) ? MESH_BVH_WIDE_LEAF_TRIS : 1;
+
     if (!rtx.isMotionBlurEnabled() || nMotionSamples == 1)
     {
         //-----------------------------------------
@@ -790,8 +985,10 @@ Mesh::buildBvh(const RenderContext& rtx,
         m_motion_bvhs.resize(1);
         FaceIndexBvh& bvh = m_motion_bvhs[0];
         bvh.setName("Mesh::FaceIndexBvh");
-        bvh.build(facerefs, 1/*max_objects_per_leaf*/);
+        bvh.build(facerefs, max_tris_per_leaf, BvhBuildMethod(rtx.k_bvh_build_method), max_threads);
         bvh.setGlobalOrigin(m_P_offset);
+        if (rtx.k_bvh_wide_traversal)
+            bvh.buildWideNodes();
 #ifdef DEBUG_MESH_BUILD
         std::cout << "      no mblur bvh" << bvh.bbox() << " depth=" << bvh.maxNodeDepth() << std::endl;
 #endif
@@ -971,8 +1168,10 @@ Mesh::buildBvh(const RenderContext& rtx,
 
             FaceIndexBvh& bvh = m_motion_bvhs[j];
             bvh.setName("Mesh::FaceIndexBvh");
-            bvh.build(facerefs, 1/*max_objects_per_leaf*/);
+            bvh.build(facerefs, max_tris_per_leaf, BvhBuildMethod(rtx.k_bvh_build_method), max_threads);
             bvh.setGlobalOrigin(m_P_offset);
+            if (rtx.k_bvh_wide_traversal)
+                bvh.buildWideNodes();
 #ifdef DEBUG_MESH_BUILD
             std::cout << "      " << j << ": mb bvh" << bvh.bbox() << " depth=" << bvh.maxNodeDepth() << std::endl;
 #endif
@@ -981,65 +1180,50 @@ Mesh::buildBvh(const RenderContext& rtx,
 }
 
 
-/*! Build the Bvhs in a thread-safe loop.
+/*! Build the Bvhs if they don't exist yet.
+    The first thread in builds them while any others sleep on the
+    condition variable until it's done.
 */
 bool
-Mesh::expand(const RenderContext& rtx)
+Mesh::expand(const RenderContext& rtx,
+             uint32_t             max_threads)
 {
     //std::cout << "  Mesh::expand(" << this << ") nMotionSamples=" << m_motion_meshes.size() << std::endl;
     //std::cout << "  rtx.numShutterSamples()=" << rtx.numShutterSamples();
-    //std::cout << ", m_status=" << m_status << std::endl;
-    if (m_status == SURFACE_DICED)
+    //std::cout << ", m_status=" << m_status.load() << std::endl;
+    // Acquire pairs with the release store below so the Bvhs are visible
+    // to threads that skip the lock:
+    if (m_status.load(std::memory_order_acquire) == SURFACE_DICED)
         return true;
 
-    // TODO: switch this loop to a std::condition_variable mutex test!
-
     // Creating the Bvhs must be done thread-safe to avoid another ray thread
     // from intersecting before they exist:
-    uint32_t limit_count = 6000; // 0.01*6000 = 60seconds
-    while (1)
+    std::unique_lock<std::mutex> lock(expand_mutex);
+    if (m_status.load(std::memory_order_relaxed) == SURFACE_NOT_DICED)
     {
-        if (m_status == SURFACE_DICED)
-            return true;
-
-        if (m_status == SURFACE_NOT_DICED)
-        {
-            my_lock.lock();
-            if (m_status == SURFACE_NOT_DICED)
-            {
-                // Ok, this thread takes ownership of Bvh creation:
-                m_status = SURFACE_DICING;
-                my_lock.unlock();
+        // Ok, this thread takes ownership of Bvh creation:
+        m_status.store(SURFACE_DICING, std::memory_order_relaxed);
+        lock.unlock();
 #ifdef DEBUG_MESH_BUILD
-                std::cout << "  Mesh::expand(" << this << ") nMotionSamples=" << m_motion_meshes.size();
-                std::cout << ", rtx.numShutterSamples()=" << rtx.numShutterSamples();
-                std::cout << ", m_status=" << m_status << std::endl;
+        std::cout << "  Mesh::expand(" << this << ") nMotionSamples=" << m_motion_meshes.size();
+        std::cout << ", rtx.numShutterSamples()=" << rtx.numShutterSamples();
+        std::cout << ", m_status=" << m_status.load() << std::endl;
 #endif
 
-                buildBvh(rtx, false/*force*/);
-                // Done, let the intersection test finish below:
-                m_status = SURFACE_DICED;
+        buildBvh(rtx, max_threads, false/*force*/);
 
-                return true;
-            }
-            else
-            {
-                my_lock.unlock();
-            }
-        }
-
-        // TODO: switch this loop to a std::condition_variable mutex test!
-        // Pause briefly then try again:
-        DD::Image::sleepFor(0.01/*seconds*/);
-        if (--limit_count == 0)
-        {
-            std::cerr << "  Mesh::expand() limit count reached!  This is likely the result of a bug." << std::endl;
-            return false;
-        }
+        // Done, wake up any threads waiting on this mesh:
+        lock.lock();
+        m_status.store(SURFACE_DICED, std::memory_order_release);
+        expand_cv.notify_all();
+        return true;
+    }
 
-    } // while loop
+    // Another thread is building the Bvhs, wait for it:
+    while (m_status.load(std::memory_order_relaxed) != SURFACE_DICED)
+        expand_cv.wait(lock);
 
-    //return false; // not necessary
+    return true;
 }
 
 
@@ -1244,126 +1428,125 @@ Mesh::getFirstIntersection(RayShaderContext&    stx,
     if (bvh.isEmpty())
         return Fsr::RAY_INTERSECT_NONE; // don't bother...
 
-    SurfaceIntersection If;
-
     I.t = std::numeric_limits<double>::infinity();
 
-    uint32_t current_node_index  = 0;
-    uint32_t next_to_visit_index = 0;
-    uint32_t nodes_to_visit_stack[256];
-    while (1)
+    RenderStats& stats = stx.thread_ctx->stats;
+    uint64_t nNodes = 0; // Bvh nodes tested, for stats
+
+    if (stx.rtx->k_bvh_wide_traversal && bvh.hasWideNodes())
     {
-        const BvhNode& node = bvh.getNode(current_node_index);
-        //std::cout << "    " << current_node_index << " node" << node.bbox << ", depth=" << node.getDepth();
-        //std::cout << ", itemStart=" << node.itemStart() << ", numItems=" << node.numItems() << std::endl;
-        if (Fsr::intersectAABB(node.bbox, bvh.getGlobalOrigin(), stx.Rtx))
+        // The wide nodes only test their children's bboxes so test the root first:
+        ++stats.bvh_nodes;
+        if (!Fsr::intersectAABB(bvh.bbox(), bvh.getGlobalOrigin(), stx.Rtx))
+            return Fsr::RAY_INTERSECT_NONE;
+
+        BvhRay4 ray4;
+        ray4.set(stx.Rtx, bvh.getGlobalOrigin());
+
+        // Hit children are pushed far-to-near so the nearest is visited first,
+        // and any node entered beyond the closest hit so far is skipped:
+        float    tnear[4];
+        uint32_t next_to_visit_index = 0;
+        uint32_t nodes_to_visit_stack[512];
+        float    nodes_to_visit_tnear[512];
+        nodes_to_visit_stack[next_to_visit_index] = 0;
+        nodes_to_visit_tnear[next_to_visit_index] = ray4.tmin;
+        ++next_to_visit_index;
+        while (next_to_visit_index > 0)
         {
-            if (node.isLeaf())
+            --next_to_visit_index;
+            if (double(nodes_to_visit_tnear[next_to_visit_index]) > I.t)
+                continue;
+
+            const uint32_t entry = nodes_to_visit_stack[next_to_visit_index];
+            if (entry & WIDE_STACK_LEAF_BIT)
             {
-#if DEBUG
-                assert(node.itemStart() < m_num_facetris);
-                assert(node.numItems() == 1);
-#endif
-                // Intersect the subtri:
-                const FaceIndex& findex = bvh.getItem(node.itemStart());
-#if DEBUG
-                assert(findex.face < numFaces());
-#endif
-                const uint32_t* vp;
-                if (m_all_quads)
-                    vp = &m_vert_indice_list[findex.face*4];
-                else if (m_all_tris)
-                    vp = &m_vert_indice_list[findex.face*3];
-                else
-                    vp = &m_vert_indice_list[m_vert_start_per_face[findex.face]];
+                intersectLeafFirst(bvh, bvh.getNode(entry & ~WIDE_STACK_LEAF_BIT),
+                                   motion_mode, motion_step, motion_step_t, &ray4, stx, I);
+                continue;
+            }
 
-                // Get points, maybe interpolated:
-                Fsr::Vec3f p0, p1, p2;
-                if (motion_mode != MOTIONSTEP_MID)
-                {
-                    // At a motion sample, no interpolation:
-                    const uint32_t motion_sample = motion_step + (motion_mode == MOTIONSTEP_START) ? 0 : 1;
+            const BvhNode4& node = bvh.getWideNode(entry);
+            const uint32_t hit_mask = intersectBvhNode4(node, ray4, tnear);
+            nNodes += node.num_children;
+            if (hit_mask == 0)
+                continue;
+
+            // Sort the hit children by descending tnear:
+            uint32_t order[4];
+            uint32_t nHits = 0;
+            for (uint32_t i=0; i < node.num_children; ++i)
+            {
+                if ((hit_mask & (1u << i)) == 0)
+                    continue;
+                uint32_t j = nHits++;
+                for (; j > 0 && tnear[order[j-1]] < tnear[i]; --j)
+                    order[j] = order[j-1];
+                order[j] = i;
+            }
 #if DEBUG
-                    assert(motion_sample < (uint32_t)m_motion_meshes.size());
+            assert((next_to_visit_index + nHits) <= 512);
 #endif
-                    const Fsr::Vec3fList& points = m_motion_meshes[motion_sample].P_list;
-                    p0 = points[vp[0              ]];
-                    p1 = points[vp[findex.subtri+1]];
-                    p2 = points[vp[findex.subtri+2]];
-                }
-                else
+            for (uint32_t j=0; j < nHits; ++j)
+            {
+                const uint32_t i = order[j];
+                nodes_to_visit_stack[next_to_visit_index] = (node.isLeaf(i)) ?
+                                                                (node.getChild(i) | WIDE_STACK_LEAF_BIT) :
+                                                                node.getChild(i);
+                nodes_to_visit_tnear[next_to_visit_index] = tnear[i];
+                ++next_to_visit_index;
+            }
+        }
+    }
+    else
+    {
+        uint32_t current_node_index  = 0;
+        uint32_t next_to_visit_index = 0;
+        uint32_t nodes_to_visit_stack[256];
+        while (1)
+        {
+            const BvhNode& node = bvh.getNode(current_node_index);
+            //std::cout << "    " << current_node_index << " node" << node.bbox << ", depth=" << node.getDepth();
+            //std::cout << ", itemStart=" << node.itemStart() << ", numItems=" << node.numItems() << std::endl;
+            ++nNodes;
+            if (Fsr::intersectAABB(node.bbox, bvh.getGlobalOrigin(), stx.Rtx))
+            {
+                if (node.isLeaf())
                 {
-                    // Between motion samples, interpolate:
-#if DEBUG
-                    assert(motion_step < (uint32_t)m_motion_meshes.size());
-                    assert((motion_step+1) < (uint32_t)m_motion_meshes.size());
-#endif
-                    const Fsr::Vec3fList& points0 =  m_motion_meshes[motion_step  ].P_list;
-                    const Fsr::Vec3fList& points1 =  m_motion_meshes[motion_step+1].P_list;
-
-                    const uint32_t v0 = vp[0              ];
-                    const uint32_t v1 = vp[findex.subtri+1];
-                    const uint32_t v2 = vp[findex.subtri+2];
-                    const float invt = (1.0f - motion_step_t);
-                    p0 = Fsr::lerp(points0[v0], points1[v0], motion_step_t, invt);
-                    p1 = Fsr::lerp(points0[v1], points1[v1], motion_step_t, invt);
-                    p2 = Fsr::lerp(points0[v2], points1[v2], motion_step_t, invt);
-                }
+                    intersectLeafFirst(bvh, node, motion_mode, motion_step, motion_step_t, NULL/*ray4*/, stx, I);
 
-                if (stx.use_differentials)
-                {
-                    if (Fsr::intersectTriangle(m_P_offset, p0, p1, p2, stx.Rtx, stx.Rdif, If.st, If.Rxst, If.Ryst, If.t))
-                    {
-                        if (If.t < I.t)
-                        {
-                            I = If;
-                            setTriIntersection(findex.face, findex.subtri, motion_step, stx, p0, p1, p2, I);
-                        }
-                    }
+                    if (next_to_visit_index == 0)
+                        break;
+                    --next_to_visit_index;
+                    current_node_index = nodes_to_visit_stack[next_to_visit_index];
                 }
                 else
                 {
-                    if (Fsr::intersectTriangle(m_P_offset, p0, p1, p2, stx.Rtx, If.st, If.t))
+                    // Put far Bvh node on nodes_to_visit_stack, advance to near node
+                    if (stx.Rtx.isSlopePositive(node.split_axis))
+                    {
+                        nodes_to_visit_stack[next_to_visit_index++] = node.B_offset;
+                        current_node_index = (current_node_index + 1);
+                    }
+                    else
                     {
-                        if (If.t < I.t)
-                        {
-                            I = If;
-                            I.Rxst = I.Ryst = I.st;
-                            setTriIntersection(findex.face, findex.subtri, motion_step, stx, p0, p1, p2, I);
-                        }
+                        nodes_to_visit_stack[next_to_visit_index++] = (current_node_index + 1);
+                        current_node_index = node.B_offset;
                     }
                 }
 
+            }
+            else
+            {
                 if (next_to_visit_index == 0)
                     break;
                 --next_to_visit_index;
                 current_node_index = nodes_to_visit_stack[next_to_visit_index];
             }
-            else
-            {
-                // Put far Bvh node on nodes_to_visit_stack, advance to near node
-                if (stx.Rtx.isSlopePositive(node.split_axis))
-                {
-                    nodes_to_visit_stack[next_to_visit_index++] = node.B_offset;
-                    current_node_index = (current_node_index + 1);
-                }
-                else
-                {
-                    nodes_to_visit_stack[next_to_visit_index++] = (current_node_index + 1);
-                    current_node_index = node.B_offset;
-                }
-            }
 
         }
-        else
-        {
-            if (next_to_visit_index == 0)
-                break;
-            --next_to_visit_index;
-            current_node_index = nodes_to_visit_stack[next_to_visit_index];
-        }
-
     }
+    stats.bvh_nodes += nNodes;
 
     if (I.t < std::numeric_limits<double>::infinity())
         return Fsr::RAY_INTERSECT_POINT;
@@ -1402,95 +1585,38 @@ Mesh::getIntersections(RayShaderContext&        stx,
     if (bvh.isEmpty())
         return; // don't bother...
 
+    if (stx.rtx->k_bvh_wide_traversal && bvh.hasWideNodes())
+    {
+        // All hits are needed so the traversal order doesn't matter, just
+        // gather the intersected leafs and batch-test their tris:
+        std::vector<const BvhNode*>& bvh_leafs = stx.thread_ctx->bvh_leafs;
+        if (!bvh.getIntersectedLeafs(stx.Rtx, bvh_leafs, true/*use_wide_nodes*/, &stx.thread_ctx->stats.bvh_nodes))
+            return;
+
+        BvhRay4 ray4;
+        ray4.set(stx.Rtx, bvh.getGlobalOrigin());
+
+        const size_t nLeafs = bvh_leafs.size();
+        for (size_t i=0; i < nLeafs; ++i)
+            intersectLeafAll(bvh, *bvh_leafs[i], motion_mode, motion_step, motion_step_t, &ray4, stx, I_list, tmin, tmax);
+        return;
+    }
+
     uint32_t current_node_index  = 0;
     uint32_t next_to_visit_index = 0;
+    uint64_t nNodes = 0; // Bvh nodes tested, for stats
     uint32_t nodes_to_visit_stack[256];
     while (1)
     {
         const BvhNode& node = bvh.getNode(current_node_index);
         //std::cout << "    " << current_node_index << " node" << node.bbox << ", depth=" << node.getDepth();
         //std::cout << ", itemStart=" << node.itemStart() << ", numItems=" << node.numItems() << std::endl;
+        ++nNodes;
         if (Fsr::intersectAABB(node.bbox, bvh.getGlobalOrigin(), stx.Rtx))
         {
             if (node.isLeaf())
             {
-#if DEBUG
-                assert(node.itemStart() < m_num_facetris);
-                assert(node.numItems() == 1);
-#endif
-                // Intersect the subtri:
-                const FaceIndex& findex = bvh.getItem(node.itemStart());
-#if DEBUG
-                assert(findex.face < numFaces());
-#endif
-                const uint32_t* vp;
-                if (m_all_quads)
-                    vp = &m_vert_indice_list[findex.face*4];
-                else if (m_all_tris)
-                    vp = &m_vert_indice_list[findex.face*3];
-                else
-                    vp = &m_vert_indice_list[m_vert_start_per_face[findex.face]];
-
-                // Get points, maybe interpolated:
-                Fsr::Vec3f p0, p1, p2;
-                if (motion_mode != MOTIONSTEP_MID)
-                {
-                    // At a motion sample, no interpolation:
-                    const uint32_t motion_sample = motion_step + (motion_mode == MOTIONSTEP_START) ? 0 : 1;
-#if DEBUG
-                    assert(motion_sample < (uint32_t)m_motion_meshes.size());
-#endif
-                    const Fsr::Vec3fList& points = m_motion_meshes[motion_sample].P_list;
-                    p0 = points[vp[0              ]];
-                    p1 = points[vp[findex.subtri+1]];
-                    p2 = points[vp[findex.subtri+2]];
-                }
-                else
-                {
-                    // Between motion samples, interpolate:
-#if DEBUG
-                    assert(motion_step < (uint32_t)m_motion_meshes.size());
-                    assert((motion_step+1) < (uint32_t)m_motion_meshes.size());
-#endif
-                    const Fsr::Vec3fList& points0 =  m_motion_meshes[motion_step  ].P_list;
-                    const Fsr::Vec3fList& points1 =  m_motion_meshes[motion_step+1].P_list;
-
-                    const uint32_t v0 = vp[0              ];
-                    const uint32_t v1 = vp[findex.subtri+1];
-                    const uint32_t v2 = vp[findex.subtri+2];
-                    const float invt = (1.0f - motion_step_t);
-                    p0 = Fsr::lerp(points0[v0], points1[v0], motion_step_t, invt);
-                    p1 = Fsr::lerp(points0[v1], points1[v1], motion_step_t, invt);
-                    p2 = Fsr::lerp(points0[v2], points1[v2], motion_step_t, invt);
-                }
-
-                if (stx.use_differentials)
-                {
-                    SurfaceIntersection I;
-                    if (Fsr::intersectTriangle(m_P_offset, p0, p1, p2, stx.Rtx, stx.Rdif, I.st, I.Rxst, I.Ryst, I.t))
-                    {
-                        setTriIntersection(findex.face, findex.subtri, motion_step, stx, p0, p1, p2, I);
-                        addIntersectionToList(I, I_list);
-                        if (I.t < tmin)
-                            tmin = I.t;
-                        if (I.t > tmax)
-                            tmax = I.t;
-                    }
-                }
-                else
-                {
-                    SurfaceIntersection I;
-                    if (Fsr::intersectTriangle(m_P_offset, p0, p1, p2, stx.Rtx, I.st, I.t))
-                    {
-                        I.Rxst = I.Ryst = I.st;
-                        setTriIntersection(findex.face, findex.subtri, motion_step, stx, p0, p1, p2, I);
-                        addIntersectionToList(I, I_list);
-                        if (I.t < tmin)
-                            tmin = I.t;
-                        if (I.t > tmax)
-                            tmax = I.t;
-                    }
-                }
+                intersectLeafAll(bvh, node, motion_mode, motion_step, motion_step_t, NULL/*ray4*/, stx, I_list, tmin, tmax);
 
                 if (next_to_visit_index == 0)
                     break;
@@ -1522,6 +1648,171 @@ Mesh::getIntersections(RayShaderContext&        stx,
         }
 
     }
+    stx.thread_ctx->stats.bvh_nodes += nNodes;
+}
+
+
+/*! Scalar double-precision test of a subtri, keeping it in I if it's closer than I.t.
+*/
+bool
+Mesh::intersectTriFirst(const FaceIndex&     findex,
+                        const Fsr::Vec3f&    p0,
+                        const Fsr::Vec3f&    p1,
+                        const Fsr::Vec3f&    p2,
+                        uint32_t             motion_step,
+                        RayShaderContext&    stx,
+                        SurfaceIntersection& I) const
+{
+    SurfaceIntersection If;
+    if (stx.use_differentials)
+    {
+        if (!Fsr::intersectTriangle(m_P_offset, p0, p1, p2, stx.Rtx, stx.Rdif, If.st, If.Rxst, If.Ryst, If.t))
+            return false;
+    }
+    else
+    {
+        if (!Fsr::intersectTriangle(m_P_offset, p0, p1, p2, stx.Rtx, If.st, If.t))
+            return false;
+        If.Rxst = If.Ryst = If.st;
+    }
+
+    if (If.t >= I.t)
+        return false;
+
+    I = If;
+    setTriIntersection(findex.face, findex.subtri, motion_step, stx, p0, p1, p2, I);
+    return true;
+}
+
+
+/*! Scalar double-precision test of a subtri, adding it to I_list if hit.
+*/
+bool
+Mesh::intersectTriAll(const FaceIndex&         findex,
+                      const Fsr::Vec3f&        p0,
+                      const Fsr::Vec3f&        p1,
+                      const Fsr::Vec3f&        p2,
+                      uint32_t                 motion_step,
+                      RayShaderContext&        stx,
+                      SurfaceIntersectionList& I_list,
+                      double&                  tmin,
+                      double&                  tmax) const
+{
+    SurfaceIntersection I;
+    if (stx.use_differentials)
+    {
+        if (!Fsr::intersectTriangle(m_P_offset, p0, p1, p2, stx.Rtx, stx.Rdif, I.st, I.Rxst, I.Ryst, I.t))
+            return false;
+    }
+    else
+    {
+        if (!Fsr::intersectTriangle(m_P_offset, p0, p1, p2, stx.Rtx, I.st, I.t))
+            return false;
+        I.Rxst = I.Ryst = I.st;
+    }
+
+    setTriIntersection(findex.face, findex.subtri, motion_step, stx, p0, p1, p2, I);
+    addIntersectionToList(I, I_list);
+    if (I.t < tmin)
+        tmin = I.t;
+    if (I.t > tmax)
+        tmax = I.t;
+    return true;
+}
+
+
+/*! Intersect all the subtris in a Bvh leaf, keeping the closest in I.
+    If 'ray4' is not NULL the subtris are culled 4 at a time with the
+    SIMD batch test first.
+*/
+void
+Mesh::intersectLeafFirst(const FaceIndexBvh&  bvh,
+                         const BvhNode&       leaf,
+                         int                  motion_mode,
+                         uint32_t             motion_step,
+                         float                motion_step_t,
+                         const BvhRay4*       ray4,
+                         RayShaderContext&    stx,
+                         SurfaceIntersection& I) const
+{
+    uint32_t item = leaf.itemStart();
+    const uint32_t end_item = item + leaf.numItems();
+#if DEBUG
+    assert(end_item <= m_num_facetris);
+#endif
+    stx.thread_ctx->stats.prims_tested += leaf.numItems();
+
+    if (!ray4)
+    {
+        Fsr::Vec3f p0, p1, p2;
+        for (; item < end_item; ++item)
+        {
+            const FaceIndex& findex = bvh.getItem(item);
+            getTriPointsLocal(findex, motion_mode, motion_step, motion_step_t, p0, p1, p2);
+            intersectTriFirst(findex, p0, p1, p2, motion_step, stx, I);
+        }
+        return;
+    }
+
+    TriBatch4 tris;
+    while (item < end_item)
+    {
+        const uint32_t count = gatherTriBatch4(*this, bvh, item, end_item, motion_mode, motion_step, motion_step_t, tris);
+        const float tmax = (I.t < double(ray4->tmax)) ? float(I.t) : ray4->tmax;
+        const uint32_t hit_mask = intersectTriBatch4(tris, *ray4, tmax);
+        for (uint32_t i=0; i < count; ++i)
+            if (hit_mask & (1u << i))
+                intersectTriFirst(bvh.getItem(tris.item[i]), tris.P[i][0], tris.P[i][1], tris.P[i][2], motion_step, stx, I);
+        item += count;
+    }
+}
+
+
+/*! Intersect all the subtris in a Bvh leaf, adding the hits to I_list.
+    If 'ray4' is not NULL the subtris are culled 4 at a time with the
+    SIMD batch test first.
+*/
+void
+Mesh::intersectLeafAll(const FaceIndexBvh&      bvh,
+                       const BvhNode&           leaf,
+                       int                      motion_mode,
+                       uint32_t                 motion_step,
+                       float                    motion_step_t,
+                       const BvhRay4*           ray4,
+                       RayShaderContext&        stx,
+                       SurfaceIntersectionList& I_list,
+                       double&                  tmin,
+                       double&                  tmax) const
+{
+    uint32_t item = leaf.itemStart();
+    const uint32_t end_item = item + leaf.numItems();
+#if DEBUG
+    assert(end_item <= m_num_facetris);
+#endif
+    stx.thread_ctx->stats.prims_tested += leaf.numItems();
+
+    if (!ray4)
+    {
+        Fsr::Vec3f p0, p1, p2;
+        for (; item < end_item; ++item)
+        {
+            const FaceIndex& findex = bvh.getItem(item);
+            getTriPointsLocal(findex, motion_mode, motion_step, motion_step_t, p0, p1, p2);
+            intersectTriAll(findex, p0, p1, p2, motion_step, stx, I_list, tmin, tmax);
+        }
+        return;
+    }
+
+    TriBatch4 tris;
+    while (item < end_item)
+    {
+        const uint32_t count = gatherTriBatch4(*this, bvh, item, end_item, motion_mode, motion_step, motion_step_t, tris);
+        const uint32_t hit_mask = intersectTriBatch4(tris, *ray4, ray4->tmax);
+        for (uint32_t i=0; i < count; ++i)
+            if (hit_mask & (1u << i))
+                intersectTriAll(bvh.getItem(tris.item[i]), tris.P[i][0], tris.P[i][1], tris.P[i][2], motion_step, stx, I_list, tmin, tmax);
+        item += count;
+    }
 }
 
 
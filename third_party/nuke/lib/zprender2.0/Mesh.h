@@ -34,6 +34,8 @@
 #include "Traceable.h"
 #include "Bvh.h"
 
+#include <atomic>
+
 
 namespace Fsr { class ArgSet; }
 
@@ -90,7 +92,7 @@ class ZPR_EXPORT Mesh : public Traceable,
 
 
   protected:
-    uint32_t        m_status;           //!< Surface state flags (unexpanded, etc)
+    std::atomic<uint32_t> m_status;     //!< Surface state flags (unexpanded, etc), read unlocked by expand()
     Fsr::Vec3d      m_P_offset;         //!< Positional offset for position data
     uint32_t        m_num_facetris;     //!< Total number of triangles in mesh, from all faces
     bool            m_all_tris;         //!< Is an all-tri mesh?
@@ -108,11 +110,13 @@ class ZPR_EXPORT Mesh : public Traceable,
     std::vector<FaceIndexBvh>   m_motion_bvhs;  //!< BVH for faces, one per motion-STEP (ie 1 less than motion-samples)
 
 
-  protected:
-    //! Build the BVHs in a thread-safe loop.
-    bool expand(const RenderContext& rtx);
+  public:
+    //! Build the BVHs, any other threads needing them wait until they're done.
+    /*virtual*/ bool expand(const RenderContext& rtx,
+                            uint32_t             max_threads=0);
 
 
+  protected:
     //!
     Fsr::Vec3f getFaceNormal(uint32_t          face,
                              uint32_t          subtri,
@@ -145,6 +149,47 @@ class ZPR_EXPORT Mesh : public Traceable,
                                Fsr::Vec3f&       NRxst,
                                Fsr::Vec3f&       NRyst) const;
 
+    //! Scalar double-precision test of a subtri, keeping it in I if it's closer than I.t.
+    bool intersectTriFirst(const FaceIndex&     findex,
+                           const Fsr::Vec3f&    p0,
+                           const Fsr::Vec3f&    p1,
+                           const Fsr::Vec3f&    p2,
+                           uint32_t             motion_step,
+                           RayShaderContext&    stx,
+                           SurfaceIntersection& I) const;
+    //! Scalar double-precision test of a subtri, adding it to I_list if hit.
+    bool intersectTriAll(const FaceIndex&         findex,
+                         const Fsr::Vec3f&        p0,
+                         const Fsr::Vec3f&        p1,
+                         const Fsr::Vec3f&        p2,
+                         uint32_t                 motion_step,
+                         RayShaderContext&        stx,
+                         SurfaceIntersectionList& I_list,
+                         double&                  tmin,
+                         double&                  tmax) const;
+
+    /*! Intersect all the subtris in a Bvh leaf. If 'ray4' is not NULL the
+        subtris are culled 4 at a time with the SIMD batch test first.
+    */
+    void intersectLeafFirst(const FaceIndexBvh&  bvh,
+                            const BvhNode&       leaf,
+                            int                  motion_mode,
+                            uint32_t             motion_step,
+                            float                motion_step_t,
+                            const BvhRay4*       ray4,
+                            RayShaderContext&    stx,
+                            SurfaceIntersection& I) const;
+    void intersectLeafAll(const FaceIndexBvh&      bvh,
+                          const BvhNode&           leaf,
+                          int                      motion_mode,
+                          uint32_t                 motion_step,
+                          float                    motion_step_t,
+                          const BvhRay4*           ray4,
+                          RayShaderContext&        stx,
+                          SurfaceIntersectionList& I_list,
+                          double&                  tmin,
+                          double&                  tmax) const;
+
     //!
     int setTriIntersection(uint32_t             face,
                            uint32_t             subtri,
@@ -184,8 +229,9 @@ class ZPR_EXPORT Mesh : public Traceable,
     ~Mesh();
 
 
-    //! Build the bvh, returns quickly if it's already been built.
+    //! Build the bvh using at most 'max_threads' (0 = no limit), returns quickly if it's already been built.
     void buildBvh(const RenderContext& rtx,
+                  uint32_t             max_threads,
                   bool                 force=false);
 
 
@@ -259,6 +305,15 @@ class ZPR_EXPORT Mesh : public Traceable,
                         Fsr::Vec3fList& face_normals,
                         uint32_t        motion_sample=0) const;
 
+    //! Get the local-space points of a subtri at a motion step, interpolated if between motion samples.
+    void getTriPointsLocal(const FaceIndex& findex,
+                           int              motion_mode,
+                           uint32_t         motion_step,
+                           float            motion_step_t,
+                           Fsr::Vec3f&      p0,
+                           Fsr::Vec3f&      p1,
+                           Fsr::Vec3f&      p2) const;
+
 
   public:
     /*====================================================*/
@@ -681,6 +736,54 @@ Mesh::getFaceNormals(uint32_t        face,
 }
 
 
+/*! Get the local-space points of a subtri at a motion step. Between
+    motion samples (MOTIONSTEP_MID) the points are interpolated.
+*/
+inline void
+Mesh::getTriPointsLocal(const FaceIndex& findex,
+                        int              motion_mode,
+                        uint32_t         motion_step,
+                        float            motion_step_t,
+                        Fsr::Vec3f&      p0,
+                        Fsr::Vec3f&      p1,
+                        Fsr::Vec3f&      p2) const
+{
+#if DEBUG
+    assert(findex.face < numFaces());
+#endif
+    const uint32_t* vp = m_vert_indice_list.data() + getFaceVertStartIndex(findex.face);
+    const uint32_t v0 = vp[0              ];
+    const uint32_t v1 = vp[findex.subtri+1];
+    const uint32_t v2 = vp[findex.subtri+2];
+
+    if (motion_mode != MOTIONSTEP_MID)
+    {
+        // At a motion sample, no interpolation:
+        const uint32_t motion_sample = motion_step + ((motion_mode == MOTIONSTEP_START) ? 0 : 1);
+#if DEBUG
+        assert(motion_sample < (uint32_t)m_motion_meshes.size());
+#endif
+        const Fsr::Vec3fList& points = m_motion_meshes[motion_sample].P_list;
+        p0 = points[v0];
+        p1 = points[v1];
+        p2 = points[v2];
+    }
+    else
+    {
+        // Between motion samples, interpolate:
+#if DEBUG
+        assert((motion_step+1) < (uint32_t)m_motion_meshes.size());
+#endif
+        const Fsr::Vec3fList& points0 = m_motion_meshes[motion_step  ].P_list;
+        const Fsr::Vec3fList& points1 = m_motion_meshes[motion_step+1].P_list;
+        const float invt = (1.0f - motion_step_t);
+        p0 = Fsr::lerp(points0[v0], points1[v0], motion_step_t, invt);
+        p1 = Fsr::lerp(points0[v1], points1[v1], motion_step_t, invt);
+        p2 = Fsr::lerp(points0[v2], points1[v2], motion_step_t, invt);
+    }
+}
+
+
 /*! Return the bbox for motion sample.
 */
 inline Fsr::Box3d
@@ -32,9 +32,11 @@
 #include "ThreadContext.h"
 
 #include <DDImage/Point.h>  // for Point type enumerations
-#include <DDImage/Thread.h> // for Lock, sleepFor
+#include <condition_variable>
+#include <mutex>
 
-static DD::Image::Lock my_lock;
+static std::mutex              expand_mutex;
+static std::condition_variable expand_cv;
 
 
 namespace zpr {
@@ -269,6 +271,7 @@ CardPoints::CardPoints(const MaterialContext* material_ctx,
 */
 void
 Points::buildBvh(const RenderContext& rtx,
+                 uint32_t             max_threads,
                  bool                 force)
 {
     if (m_motion_bvhs.size() > 0 && !force)
@@ -297,7 +300,9 @@ Points::buildBvh(const RenderContext& rtx,
         }
         PointIndexBvh& bvh = m_motion_bvhs[0];
         bvh.setName("Points:PointIndexBvh");
-        bvh.build(ref_list, rtx.bvh_max_objects);
+        bvh.build(ref_list, rtx.bvh_max_objects, BvhBuildMethod(rtx.k_bvh_build_method), max_threads);
+        if (rtx.k_bvh_wide_traversal)
+            bvh.buildWideNodes();
         //std::cout << "  bvh" << bvh.bbox() << " depth=" << bvh.maxNodeDepth() << std::endl;
     }
     else
@@ -329,58 +334,52 @@ Points::buildBvh(const RenderContext& rtx,
             }
             PointIndexBvh& bvh = m_motion_bvhs[j];
             bvh.setName("Points:PointIndexBvh");
-            bvh.build(ref_list, rtx.bvh_max_objects);
+            bvh.build(ref_list, rtx.bvh_max_objects, BvhBuildMethod(rtx.k_bvh_build_method), max_threads);
+            if (rtx.k_bvh_wide_traversal)
+                bvh.buildWideNodes();
             //std::cout << "  " << j << ": mb bvh" << bvh.bbox() << " depth=" << bvh.maxNodeDepth() << std::endl;
         }
     }
 }
 
 
-/*! Build the Bvhs in a thread-safe loop.
+/*! Build the Bvhs if they don't exist yet.
+    The first thread in builds them while any others sleep on the
+    condition variable until it's done.
 */
 bool
-Points::expand(const RenderContext& rtx)
+Points::expand(const RenderContext& rtx,
+               uint32_t             max_threads)
 {
-    if (m_status == SURFACE_DICED)
+    // Acquire pairs with the release store below so the Bvhs are visible
+    // to threads that skip the lock:
+    if (m_status.load(std::memory_order_acquire) == SURFACE_DICED)
         return true;
 
     // Creating the Bvhs must be done thread-safe to avoid another ray thread
     // from intersecting before they exist:
-    uint32_t limit_count = 6000; // 0.01*6000 = 60seconds
-    while (1)
+    std::unique_lock<std::mutex> lock(expand_mutex);
+    if (m_status.load(std::memory_order_relaxed) == SURFACE_NOT_DICED)
     {
-        if (m_status == SURFACE_DICED)
-           return true;
-        if (m_status == SURFACE_NOT_DICED)
-        {
-           my_lock.lock();
-           if (m_status == SURFACE_NOT_DICED)
-           {
-              // Ok, this thread takes ownership of Bvh creation:
-              m_status = SURFACE_DICING;
-              my_lock.unlock();
-              //std::cout << "Points::getIntersections(" << this << "): limit_count=" << limit_count << std::endl;
-              buildBvh(rtx, false/*force*/);
-              // Done, let the intersection test finish below:
-              m_status = SURFACE_DICED;
-              return true;
-
-           } else {
-              my_lock.unlock();
-           }
-        }
+        // Ok, this thread takes ownership of Bvh creation:
+        m_status.store(SURFACE_DICING, std::memory_order_relaxed);
+        lock.unlock();
+        //std::cout << "Points::expand(" << this << ")" << std::endl;
 
-        // Pause briefly then try again:
-        DD::Image::sleepFor(0.01/*seconds*/);
-        if (--limit_count == 0)
-        {
-           std::cerr << "  Points::getIntersections() limit count reached!  This is likely the result of a bug." << std::endl;
-           return false;
-        }
+        buildBvh(rtx, max_threads, false/*force*/);
+
+        // Done, wake up any threads waiting on these points:
+        lock.lock();
+        m_status.store(SURFACE_DICED, std::memory_order_release);
+        expand_cv.notify_all();
+        return true;
+    }
 
-    } // while loop
+    // Another thread is building the Bvhs, wait for it:
+    while (m_status.load(std::memory_order_relaxed) != SURFACE_DICED)
+        expand_cv.wait(lock);
 
-    //return false;
+    return true;
 }
 
 
@@ -666,7 +665,8 @@ Points::getIntersections(RayShaderContext&        stx,
     const PointIndexBvh& bvh = m_motion_bvhs[motion_step];
 
     std::vector<const BvhNode*>& bvh_leafs = stx.thread_ctx->bvh_leafs;
-    if (!bvh.getIntersectedLeafs(stx.Rtx, bvh_leafs))
+    RenderStats& stats = stx.thread_ctx->stats;
+    if (!bvh.getIntersectedLeafs(stx.Rtx, bvh_leafs, stx.rtx->k_bvh_wide_traversal, &stats.bvh_nodes))
         return; // no intersected leafs!
 
     // Test each leaf node's face list:
@@ -685,6 +685,7 @@ Points::getIntersections(RayShaderContext&        stx,
 
         uint32_t p = node.itemStart();
         const uint32_t lastPoint = p + node.numItems();
+        stats.prims_tested += node.numItems();
         if (stx.mb_enabled)
         {
             //std::cout << "    mb_enabled, test nPoints=" << (lastPoint-p) << std::endl;
@@ -855,7 +856,8 @@ Points::getFirstIntersection(RayShaderContext&    stx,
     const PointIndexBvh& bvh = m_motion_bvhs[motion_step];
 
     std::vector<const BvhNode*>& bvh_leafs = stx.thread_ctx->bvh_leafs;
-    if (!bvh.getIntersectedLeafs(stx.Rtx, bvh_leafs))
+    RenderStats& stats = stx.thread_ctx->stats;
+    if (!bvh.getIntersectedLeafs(stx.Rtx, bvh_leafs, stx.rtx->k_bvh_wide_traversal, &stats.bvh_nodes))
         return Fsr::RAY_INTERSECT_NONE; // no intersected leafs!
 
     SurfaceIntersection If;
@@ -879,6 +881,7 @@ Points::getFirstIntersection(RayShaderContext&    stx,
         // Find the nearest point intersection:
         uint32_t p = node.itemStart();
         const uint32_t lastPoint = p + node.numItems();
+        stats.prims_tested += node.numItems();
         for (; p < lastPoint; ++p)
         {
             const uint32_t pindex = bvh.getItem(p);
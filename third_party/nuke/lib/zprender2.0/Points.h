@@ -34,6 +34,8 @@
 #include "RenderPrimitive.h"
 #include "Bvh.h"
 
+#include <atomic>
+
 #define MIN_RADIUS 0.01f
 
 
@@ -83,7 +85,7 @@ class ZPR_EXPORT Points : public Traceable,
 
 
   protected:
-    uint32_t        m_status;           //!< Surface state flags (unexpanded, etc)
+    std::atomic<uint32_t> m_status;     //!< Surface state flags (unexpanded, etc), read unlocked by expand()
     Fsr::Vec3d      m_P_offset;         //!< Positional offset for position data
 
     // Per-vertex, non-animating attributes:
@@ -94,9 +96,10 @@ class ZPR_EXPORT Points : public Traceable,
     std::vector<PointIndexBvh>  m_motion_bvhs;  //!< BVH for points, one per motion-STEP (ie 1 less than motion-samples)
 
 
-  protected:
-    //! Build the BVHs in a thread-safe loop.
-    bool expand(const RenderContext& rtx);
+  public:
+    //! Build the BVHs, any other threads needing them wait until they're done.
+    /*virtual*/ bool expand(const RenderContext& rtx,
+                            uint32_t             max_threads=0);
 
 
   public:
@@ -136,8 +139,9 @@ class ZPR_EXPORT Points : public Traceable,
                                                     SurfaceIntersection& I) =0;
 
 
-    //! Build the bvh, returns quickly if it's already been built.
+    //! Build the bvh using at most 'max_threads' (0 = no limit), returns quickly if it's already been built.
     void buildBvh(const RenderContext& rtx,
+                  uint32_t             max_threads,
                   bool                 force=false);
 
     //! Return the world-space bbox for a point (no offset to origin.)
@@ -213,6 +213,7 @@ RayMaterial::doShading(RayShaderContext& stx,
 
         //------------------------------------------
         //------------------------------------------
+        ShaderTimer timer(stx.thread_ctx->stats, stx.surface_shader);
         stx.surface_shader->evaluateSurface(stx, out);
         //------------------------------------------
         //------------------------------------------
@@ -223,6 +224,7 @@ RayMaterial::doShading(RayShaderContext& stx,
         updateDDImageShaderContext(stx, stx.thread_ctx->vtx);
         //------------------------------------------
         //------------------------------------------
+        ShaderTimer timer(stx.thread_ctx->stats, stx.material);
         stx.material->fragment_shader(stx.thread_ctx->vtx, out);
         //------------------------------------------
         //------------------------------------------
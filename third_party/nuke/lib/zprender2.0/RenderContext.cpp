@@ -62,6 +62,10 @@
 #include <DDImage/ParticlesSprite.h>
 #include <DDImage/PolyMesh.h>
 
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+
 
 // Uncomment this to get some info from object expansion.
 //#define DEBUG_OBJECT_EXPANSION 1
@@ -70,7 +74,9 @@
 namespace zpr {
 
 
-static DD::Image::Lock expand_lock;
+// Guards ObjectContext expansion status and wakes threads waiting on it:
+static std::mutex              expand_lock;
+static std::condition_variable expand_cv;
 
 //------------------------------------------------------------------------------------
 //------------------------------------------------------------------------------------
@@ -86,6 +92,35 @@ static Bvh<SurfaceContext*> bvh_sftx;
 /*extern*/ Fsr::Box3d empty_box3d;
 
 
+//! Helper threads left for parallel Bvh builds, shared by all builds.
+static std::atomic<int32_t>& bvhBuildSpareThreads()
+{
+    static std::atomic<int32_t> spare(std::max(0, int32_t(DD::Image::Thread::numCPUs) - 1));
+    return spare;
+}
+
+/*extern*/ uint32_t
+reserveBvhBuildThreads(uint32_t wanted)
+{
+    std::atomic<int32_t>& spare = bvhBuildSpareThreads();
+    int32_t avail = spare.load();
+    while (avail > 0 && wanted > 0)
+    {
+        const int32_t n = std::min(avail, int32_t(wanted));
+        if (spare.compare_exchange_weak(avail, avail - n))
+            return uint32_t(n);
+    }
+    return 0;
+}
+
+/*extern*/ void
+releaseBvhBuildThreads(uint32_t count)
+{
+    if (count > 0)
+        bvhBuildSpareThreads() += int32_t(count);
+}
+
+
 //------------------------------------------------------------------------------------
 //------------------------------------------------------------------------------------
 
@@ -447,18 +482,34 @@ RenderContext::findAOVLayer(const char* name) const
 /*!
 */
 ObjectContext::ObjectContext() :
-    status(SURFACE_NOT_DICED)
+    status(SURFACE_NOT_DICED),
+    expand_nsecs(0),
+    bvh_build_nsecs(0)
 {
     gettimeofday(&last_access, 0);
+    for (uint32_t i=0; i < EXPAND_NUM_PHASES; ++i)
+    {
+        expand_next_task[i]  = 0;
+        expand_tasks_done[i] = 0;
+        expand_num_tasks[i]  = 0;
+    }
 }
 
 /*!
 */
 ObjectContext::ObjectContext(zpr::Scene* scene,
                              uint32_t    index) :
-    status(SURFACE_NOT_DICED)
+    status(SURFACE_NOT_DICED),
+    expand_nsecs(0),
+    bvh_build_nsecs(0)
 {
     gettimeofday(&last_access, 0);
+    for (uint32_t i=0; i < EXPAND_NUM_PHASES; ++i)
+    {
+        expand_next_task[i]  = 0;
+        expand_tasks_done[i] = 0;
+        expand_num_tasks[i]  = 0;
+    }
 #if DEBUG
     assert(scene);
 #endif
@@ -586,6 +637,7 @@ SurfaceContext::getScene(uint32_t sample)
 /*static*/ const char* RenderContext::sides_modes[]        = { "both", "front", "back", 0 };
 /*static*/ const char* RenderContext::debug_names[]        = { "off", "low", "medium", "high", 0 };
 /*static*/ const char* RenderContext::diagnostics_modes[]  = { "off", "time", "bounds", "bvh-leafs", "intersections", "volumes", "patches", "render-time", 0 };
+/*static*/ const char* RenderContext::bvh_build_methods[]  = { "midpoint", "binned-sah", 0 };
 
 
 static NullSurfaceHandler null_surface_handler;
@@ -611,6 +663,9 @@ RenderContext::RenderContext(DD::Image::Op* parent) :
     k_pixel_filter              = DD::Image::Filter::Cubic;
     k_pixel_filter_size[0]      = k_pixel_filter_size[1] = 1.0f;
     k_spatial_jitter_threshold  = 1;
+    k_adaptive_sampling         = false;
+    k_adaptive_min_samples      = 16;
+    k_adaptive_threshold        = 0.01f;
     k_output_bbox_mode          = BBOX_SCENE_SIZE;
 
     k_atmosphere_alpha_blending  = true;
@@ -619,6 +674,12 @@ RenderContext::RenderContext(DD::Image::Op* parent) :
     k_alpha_threshold           = 0.001f;
     k_dof_enabled               = false;
     k_dof_max_radius            = 0.1f;
+    k_bvh_wide_traversal        = true;
+    k_bvh_build_method          = BVH_BUILD_BINNED_SAH;
+    k_light_samples             = 0;
+    k_texture_cache_size        = 2048;
+    k_render_stats              = false;
+    k_render_stats_file         = "";
 
     //----------------------------------------------
     // Derived or set by render environment:
@@ -627,6 +688,8 @@ RenderContext::RenderContext(DD::Image::Op* parent) :
     frame0                      = 0.0;
     render_view                 = 1;
     render_view_name            = "main";
+    stats_frame                 = 0.0;
+    stats_view_name             = "main";
     render_projection           = DD::Image::CameraOp::LENS_PERSPECTIVE;
     texture_channels            = DD::Image::Mask_None;
     material_channels           = DD::Image::Mask_None;
@@ -748,6 +811,7 @@ RenderContext::destroyLightBVHs(bool force)
     light_context.clear();
     light_map.clear();
     lights_bvh.clear();
+    light_sampler.clear();
 }
 
 
@@ -757,6 +821,9 @@ void
 RenderContext::destroyTextureSamplers()
 {
     //std::cout << "  RenderContext(" << this << ")::destroyTextureSamplers()" << std::endl;
+    if (k_debug > DEBUG_NONE && texture_sampler_map.size() > 0)
+        TextureCache::instance().printStats("zpRender: ", std::cout);
+
     for (Texture2dSamplerMap::iterator it=texture_sampler_map.begin(); it != texture_sampler_map.end(); ++it)
         delete it->second;
     texture_sampler_map.clear();
@@ -790,6 +857,264 @@ RenderContext::destroyRayMaterials()
 //-------------------------------------------------------------------------
 
 
+/*!
+*/
+void
+RenderContext::clearRenderStats()
+{
+    const size_t nThreads = thread_list.size();
+    for (size_t i=0; i < nThreads; ++i)
+        thread_list[i]->stats.clear();
+    // The samplers survive the primitive rebuilds between frames:
+    for (Texture2dSamplerMap::const_iterator it=texture_sampler_map.begin(); it != texture_sampler_map.end(); ++it)
+        it->second->clearLoadStats();
+    stats_frame     = render_frame;
+    stats_view_name = render_view_name;
+}
+
+
+/*!
+*/
+void
+RenderContext::gatherRenderStats(RenderStats& stats) const
+{
+    stats.clear();
+    const size_t nThreads = thread_list.size();
+    for (size_t i=0; i < nThreads; ++i)
+        stats.merge(thread_list[i]->stats);
+}
+
+
+/*! Name of the object's first motion sample, for stats reporting.
+*/
+static std::string
+getObjectContextName(const ObjectContext* otx)
+{
+    if (otx->motion_objects.size() == 0 || !otx->motion_objects[0].scene)
+        return std::string();
+    return Fsr::getObjectName(otx->motion_objects[0].scene->object(otx->motion_objects[0].index));
+}
+
+
+/*! Replace '#' runs and printf-style '%d' / '%0Nd' in a file path with
+    the frame number, '%%' becomes '%'.
+*/
+static std::string
+expandFramePadding(const char* path,
+                   int         frame)
+{
+    std::string out;
+    char buf[64];
+    for (const char* c=path; *c; ++c)
+    {
+        if (*c == '#')
+        {
+            int pad = 0;
+            while (c[1] == '#')
+                ++c, ++pad;
+            snprintf(buf, sizeof(buf), "%0*d", pad+1, frame);
+            out += buf;
+        }
+        else if (*c == '%')
+        {
+            if (c[1] == '%')
+            {
+                out += '%';
+                ++c;
+                continue;
+            }
+            const char* d = c+1;
+            while (*d >= '0' && *d <= '9')
+                ++d;
+            if (*d != 'd' || (d - c) > 4)
+            {
+                out += *c; // not a frame pattern
+                continue;
+            }
+            const int pad = (d > c+1) ? atoi(c+1) : 0;
+            snprintf(buf, sizeof(buf), "%0*d", pad, frame);
+            out += buf;
+            c = d;
+        }
+        else
+            out += *c;
+    }
+    return out;
+}
+
+
+/*! Called before each rebuild of the render primitives, and at the end of
+    the render before the texture samplers are destroyed so their load
+    counters can be included.
+*/
+void
+RenderContext::reportRenderStats()
+{
+    if (!k_render_stats)
+        return;
+
+    RenderStats stats;
+    gatherRenderStats(stats);
+    if (stats.totalRays() == 0)
+        return; // nothing rendered since the last report
+
+    if (k_render_stats_file && k_render_stats_file[0])
+    {
+        const std::string path = expandFramePadding(k_render_stats_file, int(::floor(stats_frame)));
+        std::ofstream file(path.c_str());
+        if (!file)
+            std::cerr << "zpRender: unable to write render stats file '" << path << "'" << std::endl;
+        else
+            writeRenderStatsJson(stats, file);
+        clearRenderStats();
+        return;
+    }
+
+    // No file, print a summary:
+    std::cout << "zpRender: frame " << stats_frame << " view '" << stats_view_name << "' rays:";
+    for (uint32_t i=0; i < RAY_STAT_NUM_TYPES; ++i)
+        std::cout << " " << RenderStats::rayTypeName(i) << "=" << stats.rays[i];
+    std::cout << " total=" << stats.totalRays();
+    std::cout << ", bvh nodes=" << stats.bvh_nodes;
+    std::cout << ", prims tested=" << stats.prims_tested;
+    std::cout << ", shading=" << double(stats.shade_nsecs)*1.0e-9 << "s";
+    std::cout << std::endl;
+
+    for (RenderStats::ShaderStatsMap::const_iterator it=stats.shaders.begin(); it != stats.shaders.end(); ++it)
+    {
+        const RenderStats::ShaderStats& sstats = it->second;
+        std::cout << "zpRender:   shader '" << sstats.name << "' (" << sstats.kind << ")";
+        std::cout << " calls=" << sstats.calls << " time=" << double(sstats.nsecs)*1.0e-9 << "s" << std::endl;
+    }
+    for (size_t i=0; i < object_context.size(); ++i)
+    {
+        const ObjectContext* otx = object_context[i];
+        RenderStats::ObjectStatsMap::const_iterator it = stats.objects.find(otx);
+        if (it == stats.objects.end())
+            continue; // never reached by a ray
+        std::cout << "zpRender:   object " << i << " '" << getObjectContextName(otx) << "'";
+        std::cout << " rays=" << it->second.rays;
+        std::cout << " bvh nodes=" << it->second.bvh_nodes << " prims tested=" << it->second.prims_tested;
+        std::cout << " expand=" << double(otx->expand_nsecs)*1.0e-9 << "s";
+        std::cout << " bvh build=" << double(otx->bvh_build_nsecs)*1.0e-9 << "s" << std::endl;
+    }
+    for (Texture2dSamplerMap::const_iterator it=texture_sampler_map.begin(); it != texture_sampler_map.end(); ++it)
+    {
+        std::cout << "zpRender:   texture '" << it->first->node_name() << "'";
+        std::cout << " tile loads=" << it->second->tileLoads();
+        std::cout << " read=" << double(it->second->tileReadNsecs())*1.0e-9 << "s" << std::endl;
+    }
+    clearRenderStats();
+}
+
+
+/*! Quote and escape a string for json output.
+*/
+static void
+writeJsonString(const std::string& s,
+                std::ostream&      o)
+{
+    o << '"';
+    for (size_t i=0; i < s.size(); ++i)
+    {
+        const char c = s[i];
+        if (c == '"' || c == '\\')
+            o << '\\' << c;
+        else if (c == '\n')
+            o << "\\n";
+        else if (c == '\t')
+            o << "\\t";
+        else if ((unsigned char)c < 0x20)
+            o << ' ';
+        else
+            o << c;
+    }
+    o << '"';
+}
+
+
+/*!
+*/
+void
+RenderContext::writeRenderStatsJson(const RenderStats& stats,
+                                    std::ostream&      o) const
+{
+    o << "{" << std::endl;
+    o << "  \"frame\": " << stats_frame << "," << std::endl;
+    o << "  \"view\": "; writeJsonString(stats_view_name, o); o << "," << std::endl;
+    o << "  \"threads\": " << thread_list.size() << "," << std::endl;
+
+    o << "  \"rays\": {";
+    for (uint32_t i=0; i < RAY_STAT_NUM_TYPES; ++i)
+        o << "\"" << RenderStats::rayTypeName(i) << "\": " << stats.rays[i] << ", ";
+    o << "\"total\": " << stats.totalRays() << "}," << std::endl;
+    o << "  \"bvh_nodes_visited\": " << stats.bvh_nodes << "," << std::endl;
+    o << "  \"prims_tested\": " << stats.prims_tested << "," << std::endl;
+    o << "  \"shading_secs\": " << double(stats.shade_nsecs)*1.0e-9 << "," << std::endl;
+
+    // Objects in object_context order, including ones never hit:
+    o << "  \"objects\": [";
+    for (size_t i=0; i < object_context.size(); ++i)
+    {
+        const GeoInfoContext* otx = object_context[i];
+        RenderStats::ObjectStats ostats;
+        RenderStats::ObjectStatsMap::const_iterator it = stats.objects.find(otx);
+        if (it != stats.objects.end())
+            ostats = it->second;
+
+        o << ((i > 0) ? "," : "") << std::endl;
+        o << "    {\"index\": " << i << ", \"name\": "; writeJsonString(getObjectContextName(otx), o);
+        o << ", \"prims\": " << otx->prim_list.size();
+        o << ", \"expand_secs\": " << double(otx->expand_nsecs)*1.0e-9;
+        o << ", \"bvh_build_secs\": " << double(otx->bvh_build_nsecs)*1.0e-9;
+        o << ", \"rays\": " << ostats.rays;
+        o << ", \"bvh_nodes_visited\": " << ostats.bvh_nodes;
+        o << ", \"prims_tested\": " << ostats.prims_tested << "}";
+    }
+    o << std::endl << "  ]," << std::endl;
+
+    o << "  \"shaders\": [";
+    bool first = true;
+    for (RenderStats::ShaderStatsMap::const_iterator it=stats.shaders.begin(); it != stats.shaders.end(); ++it)
+    {
+        const RenderStats::ShaderStats& sstats = it->second;
+        o << ((first) ? "" : ",") << std::endl;
+        o << "    {\"name\": "; writeJsonString(sstats.name, o);
+        o << ", \"class\": "; writeJsonString(sstats.kind, o);
+        o << ", \"calls\": " << sstats.calls;
+        o << ", \"secs\": " << double(sstats.nsecs)*1.0e-9 << "}";
+        first = false;
+    }
+    o << std::endl << "  ]," << std::endl;
+
+    o << "  \"textures\": [";
+    first = true;
+    for (Texture2dSamplerMap::const_iterator it=texture_sampler_map.begin(); it != texture_sampler_map.end(); ++it)
+    {
+        o << ((first) ? "" : ",") << std::endl;
+        o << "    {\"name\": "; writeJsonString(it->first->node_name(), o);
+        o << ", \"tile_loads\": " << it->second->tileLoads();
+        o << ", \"read_secs\": " << double(it->second->tileReadNsecs())*1.0e-9 << "}";
+        first = false;
+    }
+    o << std::endl << "  ]," << std::endl;
+
+    const TextureCache::Stats cache_stats = TextureCache::instance().getStats();
+    o << "  \"texture_cache\": {\"hits\": " << cache_stats.hits;
+    o << ", \"misses\": " << cache_stats.misses;
+    o << ", \"evictions\": " << cache_stats.evictions;
+    o << ", \"tiles\": " << cache_stats.tiles;
+    o << ", \"bytes\": " << cache_stats.bytes;
+    o << ", \"peak_bytes\": " << cache_stats.peak_bytes;
+    o << ", \"max_bytes\": " << cache_stats.max_bytes << "}" << std::endl;
+    o << "}" << std::endl;
+}
+
+
+//-------------------------------------------------------------------------
+//-------------------------------------------------------------------------
+
+
 /*! Allocated and return a RayCamera subclass based on requested type.
     Calling method takes ownership.
 
@@ -1455,6 +1780,10 @@ RenderContext::validateShutterScenes(bool for_real)
     lighting_hash.reset();
     hash.reset();
 
+    // Switching Bvh layouts or builders requires the primitives to rebuild their Bvhs:
+    geometry_hash.append(k_bvh_wide_traversal);
+    geometry_hash.append(k_bvh_build_method);
+
     const uint32_t nShutterSamples = numShutterSamples();
 
     // The motion times for lights are all the same and match the shutter's:
@@ -2045,10 +2374,10 @@ RenderContext::doTextureRequests(const DD::Image::ChannelSet& request_channels,
 //-------------------------------------------------------------------------
 
 
-/*! Create RawGeneralTile objects for all textures in the materials list.
+/*! Create Texture2dSamplers for all textures in the materials list.
 
     Per-pixel texture sampling calling the built-in Iop::sample() methods has become
-    extremely slow, so we create RawGeneralTile for all used textures in the
+    extremely slow, so we create Texture2dSamplers for all used textures in the
     MaterialContext and pass them down to the samplers in the shaders.
 */
 void
@@ -2089,7 +2418,7 @@ updateSamplerMap(std::vector<MaterialContext>& material_ctx_list,
 
 
 /*! Per-pixel texture sampling calling the built-in Iop::sample() methods has become
-    extremely slow, so we create RawGeneralTile for all used textures in the scene
+    extremely slow, so we create Texture2dSamplers for all used textures in the scene
     and pass them down to the samples in the shaders.
 */
 void
@@ -2097,6 +2426,8 @@ RenderContext::updateTextureSamplerMap()
 {
     //std::cout << "  RenderContext(" << this << ")::updateTextureSamplerMap()" << std::endl;
 
+    TextureCache::instance().setMemoryLimit(size_t(std::max(1, k_texture_cache_size))*1024*1024);
+
     updateSamplerMap(object_material_ctxs, texture_sampler_map);
     updateSamplerMap(light_material_ctxs,  texture_sampler_map);
 }
@@ -2197,7 +2528,7 @@ RenderContext::buildLightVolumeBvh()
     // Build the primary intersection test BVH, which is simply the bboxes of all the ObjectContexts:
     if (ltvref_list.size() > 0)
     {
-        lights_bvh.build(ltvref_list, 1/*max_objects_per_leaf*/);
+        lights_bvh.build(ltvref_list, 1/*max_objects_per_leaf*/, BvhBuildMethod(k_bvh_build_method));
         objects_bvh.setName("lights_bvh");
         objects_bvh.setGlobalOrigin(Fsr::Vec3d(0,0,0));
     }
@@ -2805,9 +3136,11 @@ ThreadContext::popShaderContext()
 /*! Expand each object into surface context.
 
     This is a thread-safe call as each object has a status that's checked before the
-    object is expanded.  If multiple threads share the same objects in its list they
-    will have to wait until all the common objects are expanded before this method
-    will return.
+    object is expanded.  The first thread to get here claims the object and generates
+    its surfaces, then dices the surfaces and builds the primitive Bvhs as independent
+    tasks. Other threads needing the same object don't sit idle - they claim and run
+    any unfinished tasks and only block (on a condition variable) when there's
+    nothing left for them to do.
 
     Returns false on user-abort.
 */
@@ -2818,77 +3151,173 @@ RenderContext::expandObject(ObjectContext* otx)
     assert(otx);  // shouldn't happen...
 #endif
     //std::cout << "RenderContext::expandObjects()" << std::endl;
-    if (otx->status == SURFACE_DICED)
+    // Acquire pairs with the release store when expansion finishes so the
+    // surfaces & Bvhs are visible to threads that skip the lock:
+    if (otx->status.load(std::memory_order_acquire) == SURFACE_DICED)
         return true; // return fast if already done
 
-    // TODO: switch this loop to a std::condition_variable mutex test!
-
-    // Loop until all surfaces are expanded - this means possibly waiting for another
-    // thread to finish expanding an object:
-    while (1)
+    std::unique_lock<std::mutex> lock(expand_lock);
+    if (otx->status == SURFACE_NOT_DICED)
     {
-        if (otx->status == SURFACE_DICED)
-            return true;
-
-        if (otx->status == SURFACE_NOT_DICED)
+        // Claim the object, that will keep the other threads from trying to build it:
+        otx->status = SURFACE_DICING;
+        otx->clearSurfacesAndRenderPrims();
+        for (uint32_t i=0; i < EXPAND_NUM_PHASES; ++i)
         {
-            expand_lock.lock();
-            // Check again to avoid a race condition:
-            if (otx->status == SURFACE_NOT_DICED)
-            {
-                // Lock the object for us to change the status, and that will
-                // keep the other threads from trying to build it:
-                otx->status = SURFACE_DICING;
-                otx->clearSurfacesAndRenderPrims();
-
-                expand_lock.unlock();
+            otx->expand_next_task[i]  = 0;
+            otx->expand_tasks_done[i] = 0;
+            otx->expand_num_tasks[i]  = 0;
+        }
+        otx->bvh_build_nsecs = 0;
+        lock.unlock();
 #ifdef DEBUG_OBJECT_EXPANSION
-                if (k_debug == RenderContext::DEBUG_LOW)
-                {
-                    std::cout << "-----------------------------------------------------------------------" << std::endl;
-                    std::cout << "RenderContext::expandObjects(" << otx << ")" << std::endl;
-                }
+        if (k_debug == RenderContext::DEBUG_LOW)
+        {
+            std::cout << "-----------------------------------------------------------------------" << std::endl;
+            std::cout << "RenderContext::expandObjects(" << otx << ")" << std::endl;
+        }
 #endif
 
-                if (!generateSurfaceContextsForObject(otx))
-                {
-                    std::cout << "  RenderContext::expandObject() aborted generateSurfaceContextsForObject()" << std::endl;
-                    otx->status = SURFACE_NOT_DICED;
-                    return false; // user-abort
-                }
+        const int64_t expand_start = RenderStats::now();
 
-                if (!generateRenderPrimitivesForObject(otx))
-                {
-                    std::cout << "  RenderContext::expandObject() aborted generateRenderPrimitivesForObject()" << std::endl;
-                    otx->status = SURFACE_NOT_DICED;
-                    return false; // user-abort
-                }
+        bool ok = generateSurfaceContextsForObject(otx);
+        if (!ok)
+            std::cout << "  RenderContext::expandObject() aborted generateSurfaceContextsForObject()" << std::endl;
+        if (ok && !generateRenderPrimitivesForObject(otx))
+        {
+            std::cout << "  RenderContext::expandObject() aborted generateRenderPrimitivesForObject()" << std::endl;
+            ok = false;
+        }
 
-                // Indicate the object's been fully expanded:
-                otx->status = SURFACE_DICED;
+        otx->expand_nsecs = RenderStats::now() - expand_start;
 
-                return true; // all done!
+        // Indicate the object's been fully expanded, or put it back to
+        // unexpanded on user-abort, and wake up any waiting threads:
+        lock.lock();
+        otx->status.store((ok) ? SURFACE_DICED : SURFACE_NOT_DICED, std::memory_order_release);
+        lock.unlock();
+        expand_cv.notify_all();
 
-            }
-            else
+        return ok;
+    }
+
+    // Another thread got to it before us, help it out with any unclaimed
+    // tasks until it's done:
+    while (otx->status == SURFACE_DICING)
+    {
+        uint32_t phase = EXPAND_NUM_PHASES;
+        for (uint32_t i=0; i < EXPAND_NUM_PHASES; ++i)
+        {
+            if (otx->expand_next_task[i] < otx->expand_num_tasks[i])
             {
-                // Another thread got to it before us, but we still have to wait until
-                // it's done.
-                expand_lock.unlock();
+                phase = i;
+                break;
             }
+        }
+
+        if (phase < EXPAND_NUM_PHASES)
+        {
+            lock.unlock();
+            doObjectExpandTasks(otx, phase);
+            lock.lock();
+        }
+        else
+            expand_cv.wait(lock);
+    }
+
+    // If the expanding thread aborted the object's back to unexpanded:
+    return (otx->status == SURFACE_DICED);
+}
+
+
+/*! Called by the thread expanding the object.
+    Publishes the phase's task count so that waiting threads can claim tasks,
+    runs tasks itself, then waits for any still running in other threads.
+*/
+void
+RenderContext::runObjectExpandPhase(ObjectContext* otx,
+                                    uint32_t       phase,
+                                    uint32_t       nTasks)
+{
+    if (nTasks == 0)
+        return;
+
+    std::unique_lock<std::mutex> lock(expand_lock);
+    otx->expand_num_tasks[phase] = nTasks;
+    lock.unlock();
+    expand_cv.notify_all();
+
+    doObjectExpandTasks(otx, phase);
+
+    lock.lock();
+    while (otx->expand_tasks_done[phase] < nTasks)
+        expand_cv.wait(lock);
+}
+
 
-        } // not expanded?
+/*! Claim and run tasks from an open phase until they're all claimed.
+    Whichever thread finishes the last task wakes up the expanding thread.
+*/
+void
+RenderContext::doObjectExpandTasks(ObjectContext* otx,
+                                   uint32_t       phase)
+{
+    const uint32_t nTasks = otx->expand_num_tasks[phase];
+    const uint32_t prim_build_threads = std::max(1u, uint32_t(DD::Image::Thread::numCPUs) / std::max(1u, nTasks));
+    while (1)
+    {
+        const uint32_t task = otx->expand_next_task[phase]++;
+        if (task >= nTasks)
+            break;
 
-        // TODO: switch this to a real std::condition_variable mutex test!
-        // Pause briefly then try again:
-        DD::Image::sleepFor(0.01/*seconds*/);
+        if (phase == EXPAND_DICE_SURFACES)
+        {
+#if DEBUG
+            assert(otx->surface_list[task]);
+#endif
+            SurfaceContext& sftx = *otx->surface_list[task];
+            if (sftx.status == SURFACE_NOT_DICED)
+            {
+#if DEBUG
+                assert(sftx.handler);
+#endif
+#ifdef DEBUG_OBJECT_EXPANSION
+                std::cout << "  dicing surface " << task << " using handler ";
+                std::cout << sftx.handler->Class() << "()::generateRenderPrims()";
+                std::cout << std::endl;
+#endif
+
+                //-------------------------------------------
+                sftx.handler->generateRenderPrims(*this, sftx);
+                //-------------------------------------------
 
-    } // while loop
+                sftx.status = SURFACE_DICED;
+            }
+        }
+        else if (phase == EXPAND_BUILD_PRIMS)
+        {
+#if DEBUG
+            assert(otx->prim_list[task]);
+#endif
+            // The other threads are claiming the remaining prims, so only
+            // give each build a share of the CPUs:
+            otx->prim_list[task]->expand(*this, prim_build_threads);
+        }
 
-    //return true; // unnecesary
+        if (++otx->expand_tasks_done[phase] == nTasks)
+        {
+            // Take the lock so the notify can't slip in before the wait:
+            std::lock_guard<std::mutex> guard(expand_lock);
+            expand_cv.notify_all();
+        }
+    }
 }
 
 
+//-------------------------------------------------------------------------
+//-------------------------------------------------------------------------
+
+
 /*! Return false on user-abort.
 */
 bool
@@ -3293,31 +3722,12 @@ RenderContext::generateRenderPrimitivesForObject(ObjectContext* otx)
         std::cout << otx << ": building rprims for " << nSurfaces << " surfaces:" << std::endl;
 #endif
 
-    // Create RenderPrimitives by calling zpRender surface handlers:
-    for (uint32_t i=0; i < nSurfaces; ++i)
-    {
-#if DEBUG
-        assert(otx->surface_list[i]);
-#endif
-        SurfaceContext& sftx = *otx->surface_list[i];
-        if (sftx.status == SURFACE_NOT_DICED)
-        {
-#if DEBUG
-            assert(sftx.handler);
-#endif
-#ifdef DEBUG_OBJECT_EXPANSION
-            std::cout << "  dicing surface " << i << " using handler ";
-            std::cout << sftx.handler->Class() << "()::generateRenderPrims()";
-            std::cout << std::endl;
-#endif
-
-            //-------------------------------------------
-            sftx.handler->generateRenderPrims(*this, sftx);
-            //-------------------------------------------
-
-            sftx.status = SURFACE_DICED;
-        }
-    }
+    // Create RenderPrimitives by calling zpRender surface handlers, then
+    // build their Bvhs so the first ray in doesn't pay for it:
+    runObjectExpandPhase(otx, EXPAND_DICE_SURFACES, nSurfaces);
+    const int64_t build_start = RenderStats::now();
+    runObjectExpandPhase(otx, EXPAND_BUILD_PRIMS, (uint32_t)otx->prim_list.size());
+    otx->bvh_build_nsecs = RenderStats::now() - build_start;
 
     return true; // no user-abort
 
@@ -3383,6 +3793,9 @@ ObjectContextBvh::getFirstIntersection(RayShaderContext&    stx,
 {
     //std::cout << "ObjectContextBvh::getFirstIntersection(" << this << ")" << bbox();
     //std::cout << " " << stx.x << " " << stx.y << std::endl;
+    RenderStats& stats = stx.thread_ctx->stats;
+    stats.addRay(stx.Rtx.type_mask);
+
     if (this->isEmpty())
         return Fsr::RAY_INTERSECT_NONE;
 
@@ -3396,6 +3809,7 @@ ObjectContextBvh::getFirstIntersection(RayShaderContext&    stx,
         const BvhNode& node = m_node_list[current_node_index];
         //std::cout << "    " << current_node_index << " node" << node.bbox << ", depth=" << node.getDepth();
         //std::cout << ", itemStart=" << node.itemStart() << ", numItems=" << node.numItems() << std::endl;
+        ++stats.bvh_nodes;
         if (Fsr::intersectAABB(node.bbox, m_bbox_origin, stx.Rtx))
         {
             if (node.isLeaf())
@@ -3422,6 +3836,10 @@ ObjectContextBvh::getFirstIntersection(RayShaderContext&    stx,
 
                 //std::cout << "      " << obj << ": leaf item[" << obj << "] otx=" << otx << " nPrims=" << otx->prim_list.size() << std::endl;
 
+                // Snapshot the counters so the prim traversal can be attributed to the object:
+                const uint64_t obj_bvh_nodes    = stats.bvh_nodes;
+                const uint64_t obj_prims_tested = stats.prims_tested;
+
                 const uint32_t nPrims = (uint32_t)otx->prim_list.size();
                 for (uint32_t p=0; p < nPrims; ++p)
                 {
@@ -3442,6 +3860,14 @@ ObjectContextBvh::getFirstIntersection(RayShaderContext&    stx,
                         I = It;
                     }
                 }
+
+                if (stats.enabled)
+                {
+                    RenderStats::ObjectStats& ostats = stats.objects[otx];
+                    ++ostats.rays;
+                    ostats.bvh_nodes    += stats.bvh_nodes    - obj_bvh_nodes;
+                    ostats.prims_tested += stats.prims_tested - obj_prims_tested;
+                }
                 //if (obj_hit) std::cout << "  ObjectContextBvh::getFirstIntersection(" << stx.x << " " << stx.y << ") obj_hit=" << obj_hit << ", I.t=" << I.t << std::endl;
                 //m_bbox.printInfo("  "); std::cout << " obj_hit=" << obj_hit << std::endl;
 
@@ -3493,6 +3919,9 @@ ObjectContextBvh::getIntersections(RayShaderContext&        stx,
 {
     //std::cout << "ObjectContextBvh::getIntersections(" << this << ")" << bbox();
     //std::cout << " " << stx.x << " " << stx.y << std::endl;
+    RenderStats& stats = stx.thread_ctx->stats;
+    stats.addRay(stx.Rtx.type_mask);
+
     if (this->isEmpty())
         return;
 
@@ -3504,6 +3933,7 @@ ObjectContextBvh::getIntersections(RayShaderContext&        stx,
         const BvhNode& node = m_node_list[current_node_index];
         //std::cout << "    " << current_node_index << " node" << node.bbox << ", depth=" << node.getDepth();
         //std::cout << ", itemStart=" << node.itemStart() << ", numItems=" << node.numItems() << std::endl;
+        ++stats.bvh_nodes;
         if (Fsr::intersectAABB(node.bbox, m_bbox_origin, stx.Rtx))
         {
             if (node.isLeaf())
@@ -3527,6 +3957,10 @@ ObjectContextBvh::getIntersections(RayShaderContext&        stx,
 
                 //std::cout << "      " << obj << ": leaf item[" << obj << "] otx=" << otx << " nPrims=" << otx->prim_list.size() << std::endl;
 
+                // Snapshot the counters so the prim traversal can be attributed to the object:
+                const uint64_t obj_bvh_nodes    = stats.bvh_nodes;
+                const uint64_t obj_prims_tested = stats.prims_tested;
+
                 const uint32_t nPrims = (uint32_t)otx->prim_list.size();
                 for (uint32_t p=0; p < nPrims; ++p)
                 {
@@ -3542,6 +3976,14 @@ ObjectContextBvh::getIntersections(RayShaderContext&        stx,
                     rprim->isTraceable()->getIntersections(stx, I_list, tmin, tmax);
                 }
 
+                if (stats.enabled)
+                {
+                    RenderStats::ObjectStats& ostats = stats.objects[otx];
+                    ++ostats.rays;
+                    ostats.bvh_nodes    += stats.bvh_nodes    - obj_bvh_nodes;
+                    ostats.prims_tested += stats.prims_tested - obj_prims_tested;
+                }
+
                 if (next_to_visit_index == 0)
                     break;
                 --next_to_visit_index;
@@ -31,9 +31,11 @@
 #define zprender_Context_h
 
 #include "Bvh.h"
+#include "LightSampler.h"
 #include "RayCamera.h"
 #include "RayShaderContext.h"
 #include "RenderPrimitive.h"
+#include "RenderStats.h"
 #include "Texture2dSampler.h"
 
 #include <Fuser/Box3.h>
@@ -45,7 +47,9 @@
 #include <DDImage/Filter.h>
 #include <DDImage/LightContext.h>
 
+#include <atomic>
 #include <map>
+#include <mutex>
 #include <deque>
 
 #include <sys/time.h>
@@ -318,6 +322,17 @@ enum
 };
 
 
+/*! ObjectContext expansion is split into phases of independent tasks
+    that any thread waiting on the object can help with.
+*/
+enum
+{
+    EXPAND_DICE_SURFACES =  0,  //!< Generate the RenderPrimitives for each SurfaceContext
+    EXPAND_BUILD_PRIMS   =  1,  //!< Build the Bvhs of each RenderPrimitive
+    EXPAND_NUM_PHASES    =  2
+};
+
+
 //-------------------------------------------------------------------------
 //-------------------------------------------------------------------------
 
@@ -502,7 +517,7 @@ class ZPR_EXPORT ObjectContext
                      uint32_t    _index) : scene(_scene), index(_index) {}
     };
 
-    int32_t             status;         //!< Object state indicator (unexpanded, etc)
+    std::atomic<int32_t> status;        //!< Object state indicator (unexpanded, etc), read unlocked by expandObject()
     Fsr::Box3d          bbox;           //!< Entire bbox including all motion samples
     DD::Image::Hash     hash;           //!< All the geo hashes together
     struct timeval      last_access;    //!< The last time the object was probed
@@ -514,6 +529,16 @@ class ZPR_EXPORT ObjectContext
     // Non-animating:
     std::vector<SurfaceContext*>  surface_list; //!< List of surfaces generated by this object
     std::vector<RenderPrimitive*> prim_list;    //!< List of primitives generated from surfaces
+    std::mutex                    prim_lock;    //!< Guards prim_list while surfaces are diced in parallel
+
+    // Expansion task state, see RenderContext::expandObject():
+    std::atomic<uint32_t> expand_next_task[EXPAND_NUM_PHASES];  //!< Next unclaimed task index
+    std::atomic<uint32_t> expand_tasks_done[EXPAND_NUM_PHASES]; //!< Number of finished tasks
+    uint32_t              expand_num_tasks[EXPAND_NUM_PHASES];  //!< Task count, 0 until the phase is opened
+
+    // Expansion timing for the render stats, in nanoseconds:
+    int64_t               expand_nsecs;     //!< Wall time of the whole expansion
+    int64_t               bvh_build_nsecs;  //!< Wall time of the EXPAND_BUILD_PRIMS phase
 
 
   public:
@@ -557,9 +582,13 @@ class ZPR_EXPORT ObjectContext
     uint32_t numPrims() const { return (uint32_t)prim_list.size(); }
 
 
-    //! Add a primitive p to the list.  Returns the index of the added prim.
+    /*! Add a primitive p to the list.  Returns the index of the added prim.
+        Thread-safe as surfaces can be diced in parallel, so the prim order
+        isn't guaranteed to match the surface order.
+    */
     uint32_t addPrim(RenderPrimitive* prim)
     {
+        std::lock_guard<std::mutex> guard(prim_lock);
         if (prim_list.size() && prim_list.size() >= prim_list.capacity())
             prim_list.reserve(prim_list.capacity() * 2);
         prim_list.push_back(prim);
@@ -917,6 +946,9 @@ class ZPR_EXPORT RenderContext
     };
     static const char* diagnostics_modes[];
 
+    //! Knob names of the BvhBuildMethod enums, in enum order.
+    static const char* bvh_build_methods[];
+
 
   public:
     DD::Image::Op* m_parent;                    //!< Op that owns this context
@@ -944,6 +976,9 @@ class ZPR_EXPORT RenderContext
     int    k_pixel_filter;
     float  k_pixel_filter_size[2];
     int    k_spatial_jitter_threshold;
+    bool   k_adaptive_sampling;                 //!< Stop sampling a pixel once its variance is below threshold
+    int    k_adaptive_min_samples;              //!< Samples always taken before checking convergence
+    float  k_adaptive_threshold;                //!< Max standard error of a converged pixel channel
     int    k_output_bbox_mode;                  //!< How to handle the output scene bbox
     //
     bool   k_atmosphere_alpha_blending;         //!<
@@ -952,6 +987,16 @@ class ZPR_EXPORT RenderContext
     //
     bool   k_dof_enabled;
     float  k_dof_max_radius;
+    //
+    bool   k_bvh_wide_traversal;                //!< Build & traverse 4-wide SIMD Bvh nodes, otherwise scalar binary nodes
+    int    k_bvh_build_method;                  //!< BvhBuildMethod used for the object, light & primitive Bvhs
+    //
+    int    k_light_samples;                     //!< Importance-sampled lights per shading point, 0 = evaluate all lights
+    //
+    int    k_texture_cache_size;                //!< Global TextureCache memory budget in MB
+    //
+    bool        k_render_stats;                 //!< Collect per-object & per-shader stats, reported once per frame
+    const char* k_render_stats_file;            //!< Json stats report path with optional frame padding, a summary is printed if empty
 
     //-------------------------------------------------------
     // Values derived or configured by Renderer Op:
@@ -964,6 +1009,9 @@ class ZPR_EXPORT RenderContext
     //
     int                      render_view;       //!< Current view (from outputContext())
     std::string              render_view_name;  //!< Current view name
+    //
+    double                   stats_frame;       //!< Frame the thread stats are being collected for
+    std::string              stats_view_name;   //!< View the thread stats are being collected for
     std::vector<int>         render_views;      //!< Views to render (stripped of crap views)
     //
     std::vector<RayCamera*>  ray_cameras;       //!< List of RayCameras from current view, one per shutter sample
@@ -1087,6 +1135,8 @@ class ZPR_EXPORT RenderContext
     LightMaterialList  master_light_materials;      //!< Active ray-tracing light materials
     LightMaterialLists per_object_light_materials;  //!< Per-object list of light materials
 
+    LightSampler       light_sampler;               //!< Picks a subset of lights to shade with, built once per render
+
 
 
     //-------------------------------------------------------
@@ -1117,6 +1167,28 @@ class ZPR_EXPORT RenderContext
     void destroyRayMaterials();
 
 
+    //========================================================
+    // Render stats:
+
+    //! Zero the stats of all the thread contexts & texture samplers and start collecting for the current frame & view.
+    void clearRenderStats();
+
+    //! Merge the stats of all the thread contexts into 'stats'.
+    void gatherRenderStats(RenderStats& stats) const;
+
+    /*! Merge the thread stats and write them to k_render_stats_file as json,
+        or print a summary if there's no file. Clears the thread stats after.
+        Frame padding in the file path ('####' or '%04d') is replaced with
+        the frame the stats were collected for.
+        Does nothing if k_render_stats is off or nothing was rendered.
+    */
+    void reportRenderStats();
+
+    //! Write the merged stats as a json object.
+    void writeRenderStatsJson(const RenderStats& stats,
+                              std::ostream&      o) const;
+
+
     //========================================================
     // Shutter samples:
 
@@ -1200,6 +1272,15 @@ class ZPR_EXPORT RenderContext
     //! Create RenderPrimitives from an ObjectContext's surfaces. Returns false on user-abort.
     bool generateRenderPrimitivesForObject(ObjectContext* ctx);
 
+    //! Open an expansion phase of nTasks for other threads to help with, then run it to completion.
+    void runObjectExpandPhase(ObjectContext* otx,
+                              uint32_t       phase,
+                              uint32_t       nTasks);
+
+    //! Claim and run tasks from an open expansion phase until none are left.
+    void doObjectExpandTasks(ObjectContext* otx,
+                             uint32_t       phase);
+
 
     //-----------------------------------------------------------------
     // Lighting:
@@ -114,6 +114,7 @@ class Surface;
 class Volume;
 class LightEmitter;
 class MaterialContext;
+class RenderContext;
 class SurfaceContext;
 class GeoInfoContext;
 class LightVolumeContext;
@@ -162,6 +163,12 @@ class ZPR_EXPORT RenderPrimitive
     //! Returns a pointer to the LightEmitter object if this primitive can emit light.
     virtual LightEmitter* isLightEmitter() { return NULL; }
 
+    /*! Build any acceleration structures needed before intersection. Must be thread-safe.
+        'max_threads' limits the threads a build can use, 0 for no limit. Returns false on user-abort.
+    */
+    virtual bool          expand(const RenderContext& rtx,
+                                 uint32_t             max_threads=0) { return true; }
+
 
     //---------------------------------------------
 
@@ -0,0 +1,231 @@
+//
+// Copyright 2020 DreamWorks Animation
+//
+// Licensed under the Apache License, Version 2.0 (the "Apache License")
+// with the following modification; you may not use this file except in
+// compliance with the Apache License and the following modification to it:
+// Section 6. Trademarks. is deleted and replaced with:
+//
+// 6. Trademarks. This License does not grant permission to use the trade
+//    names, trademarks, service marks, or product names of the Licensor
+//    and its affiliates, except as required to comply with Section 4(c) of
+//    the License and to reproduce the content of the NOTICE file.
+//
+// You may obtain a copy of the Apache License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the Apache License with the above modification is
+// distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied. See the Apache License for the specific
+// language governing permissions and limitations under the Apache License.
+//
+
+/// @file zprender/RenderStats.cpp
+///
+/// @author Jonathan Egstad
+
+
+#include "RenderStats.h"
+#include "RayShader.h"
+
+#include <Fuser/RayContext.h>
+
+#include <DDImage/Iop.h>
+
+
+namespace zpr {
+
+
+/*!
+*/
+RenderStats::RenderStats() :
+    enabled(false)
+{
+    clear();
+}
+
+
+/*!
+*/
+void
+RenderStats::clear()
+{
+    for (uint32_t i=0; i < RAY_STAT_NUM_TYPES; ++i)
+        rays[i] = 0;
+    bvh_nodes         = 0;
+    prims_tested      = 0;
+    shade_nsecs       = 0;
+    shade_child_nsecs = 0;
+    objects.clear();
+    shaders.clear();
+}
+
+
+/*!
+*/
+void
+RenderStats::merge(const RenderStats& b)
+{
+    for (uint32_t i=0; i < RAY_STAT_NUM_TYPES; ++i)
+        rays[i] += b.rays[i];
+    bvh_nodes    += b.bvh_nodes;
+    prims_tested += b.prims_tested;
+    shade_nsecs  += b.shade_nsecs;
+
+    for (ObjectStatsMap::const_iterator it=b.objects.begin(); it != b.objects.end(); ++it)
+    {
+        ObjectStats& ostats = objects[it->first];
+        ostats.rays         += it->second.rays;
+        ostats.bvh_nodes    += it->second.bvh_nodes;
+        ostats.prims_tested += it->second.prims_tested;
+    }
+
+    for (ShaderStatsMap::const_iterator it=b.shaders.begin(); it != b.shaders.end(); ++it)
+    {
+        ShaderStats& sstats = shaders[it->first];
+        if (sstats.calls == 0)
+        {
+            sstats.name = it->second.name;
+            sstats.kind = it->second.kind;
+        }
+        sstats.calls += it->second.calls;
+        sstats.nsecs += it->second.nsecs;
+    }
+}
+
+
+/*!
+*/
+uint64_t
+RenderStats::totalRays() const
+{
+    uint64_t n = 0;
+    for (uint32_t i=0; i < RAY_STAT_NUM_TYPES; ++i)
+        n += rays[i];
+    return n;
+}
+
+
+/*! Camera and shadow bits take precedence, then transmission
+    so that diffuse and glossy only count reflected rays.
+*/
+/*static*/
+RayStatType
+RenderStats::rayType(uint32_t type_mask)
+{
+    if (type_mask & Fsr::RayContext::cameraPath())
+        return RAY_STAT_CAMERA;
+    else if (type_mask & Fsr::RayContext::shadowPath())
+        return RAY_STAT_SHADOW;
+    else if (type_mask & Fsr::RayContext::transmissionPath())
+        return RAY_STAT_REFRACTION;
+    else if (type_mask & Fsr::RayContext::diffusePath())
+        return RAY_STAT_DIFFUSE;
+    else if (type_mask & (Fsr::RayContext::glossyPath() | Fsr::RayContext::reflectionPath()))
+        return RAY_STAT_GLOSSY;
+    return RAY_STAT_OTHER;
+}
+
+
+/*!
+*/
+/*static*/
+const char*
+RenderStats::rayTypeName(uint32_t type)
+{
+    static const char* names[RAY_STAT_NUM_TYPES+1] =
+    {
+        "camera", "shadow", "diffuse", "glossy", "refraction", "other", 0
+    };
+    return (type < RAY_STAT_NUM_TYPES) ? names[type] : "unknown";
+}
+
+
+//-----------------------------------------------------------------------------
+
+
+/*!
+*/
+ShaderTimer::ShaderTimer(RenderStats&     stats,
+                         const RayShader* shader) :
+    m_stats(NULL),
+    m_key(shader),
+    m_is_legacy(false)
+{
+    if (stats.enabled && shader)
+        start(stats);
+}
+
+
+/*!
+*/
+ShaderTimer::ShaderTimer(RenderStats&          stats,
+                         const DD::Image::Iop* material) :
+    m_stats(NULL),
+    m_key(material),
+    m_is_legacy(true)
+{
+    if (stats.enabled && material)
+        start(stats);
+}
+
+
+/*! Nested timers accumulate into a fresh shade_child_nsecs, the
+    enclosing timer's value is restored when this one finishes.
+*/
+void
+ShaderTimer::start(RenderStats& stats)
+{
+    m_stats = &stats;
+    m_outer_child_nsecs = stats.shade_child_nsecs;
+    stats.shade_child_nsecs = 0;
+    m_start = RenderStats::now();
+}
+
+
+/*!
+*/
+ShaderTimer::~ShaderTimer()
+{
+    if (!m_stats)
+        return;
+
+    const int64_t elapsed   = RenderStats::now() - m_start;
+    const int64_t self_time = elapsed - m_stats->shade_child_nsecs;
+
+    RenderStats::ShaderStats& sstats = m_stats->shaders[m_key];
+    if (sstats.calls == 0)
+    {
+        // Get the name on the first call only:
+        if (m_is_legacy)
+        {
+            const DD::Image::Iop* material = static_cast<const DD::Image::Iop*>(m_key);
+            sstats.name = const_cast<DD::Image::Iop*>(material)->node_name();
+            sstats.kind = "legacy";
+        }
+        else
+        {
+            const RayShader* shader = static_cast<const RayShader*>(m_key);
+            sstats.name = shader->getName();
+            sstats.kind = shader->zprShaderClass();
+        }
+    }
+    ++sstats.calls;
+    sstats.nsecs += self_time;
+
+    m_stats->shade_nsecs += self_time;
+    // Enclosing timer excludes all of our time:
+    m_stats->shade_child_nsecs = m_outer_child_nsecs + elapsed;
+}
+
+
+} // namespace zpr
+
+
+// end of zprender/RenderStats.cpp
+
+//
+// Copyright 2020 DreamWorks Animation
+//
@@ -0,0 +1,184 @@
+//
+// Copyright 2020 DreamWorks Animation
+//
+// Licensed under the Apache License, Version 2.0 (the "Apache License")
+// with the following modification; you may not use this file except in
+// compliance with the Apache License and the following modification to it:
+// Section 6. Trademarks. is deleted and replaced with:
+//
+// 6. Trademarks. This License does not grant permission to use the trade
+//    names, trademarks, service marks, or product names of the Licensor
+//    and its affiliates, except as required to comply with Section 4(c) of
+//    the License and to reproduce the content of the NOTICE file.
+//
+// You may obtain a copy of the Apache License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the Apache License with the above modification is
+// distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied. See the Apache License for the specific
+// language governing permissions and limitations under the Apache License.
+//
+
+/// @file zprender/RenderStats.h
+///
+/// @author Jonathan Egstad
+
+
+#ifndef zprender_RenderStats_h
+#define zprender_RenderStats_h
+
+#include "api.h"
+
+#include <string>
+#include <unordered_map>
+#include <time.h> // for clock_gettime
+
+
+namespace DD { namespace Image { class Iop; } }
+
+
+namespace zpr {
+
+class RayShader;
+
+
+/*! Ray categories counted by RenderStats.
+*/
+enum RayStatType
+{
+    RAY_STAT_CAMERA     =  0,   //!< Primary rays from the camera
+    RAY_STAT_SHADOW     =  1,   //!< Surface to light visibility rays
+    RAY_STAT_DIFFUSE    =  2,   //!< Indirect diffuse reflection rays
+    RAY_STAT_GLOSSY     =  3,   //!< Glossy and mirror reflection rays
+    RAY_STAT_REFRACTION =  4,   //!< Transmitted rays, diffuse or glossy
+    RAY_STAT_OTHER      =  5,   //!< Anything untyped
+    RAY_STAT_NUM_TYPES  =  6
+};
+
+
+/*! Per-thread render counters. Each ThreadContext owns one so
+    incrementing needs no locking, and the RenderContext merges
+    them all together when the render finishes.
+
+    The plain counters (rays, Bvh nodes, primitive tests) are always
+    updated since they're just an add to thread-local memory. The
+    clock reads and map lookups needed for the per-object and
+    per-shader breakdowns only happen when 'enabled' is true.
+*/
+struct ZPR_EXPORT RenderStats
+{
+    /*! Traversal counters for a single ObjectContext. */
+    struct ObjectStats
+    {
+        uint64_t rays;          //!< Rays that reached the object's Bvh leaf
+        uint64_t bvh_nodes;     //!< Primitive Bvh nodes visited
+        uint64_t prims_tested;  //!< Primitives (tris, points, etc) tested
+
+        ObjectStats() : rays(0), bvh_nodes(0), prims_tested(0) {}
+    };
+
+    /*! Evaluation counters for a single shader. */
+    struct ShaderStats
+    {
+        std::string name;       //!< Shader node name
+        std::string kind;       //!< Shader class, or 'legacy' for Iop materials
+        uint64_t    calls;      //!< Number of evaluations
+        int64_t     nsecs;      //!< Time spent in the shader itself, excluding nested shaders
+
+        ShaderStats() : calls(0), nsecs(0) {}
+    };
+
+    typedef std::unordered_map<const void*, ObjectStats> ObjectStatsMap;
+    typedef std::unordered_map<const void*, ShaderStats> ShaderStatsMap;
+
+
+    bool           enabled;                     //!< Collect the timing & per-object/per-shader stats
+    uint64_t       rays[RAY_STAT_NUM_TYPES];    //!< Rays cast by type
+    uint64_t       bvh_nodes;                   //!< Bvh nodes visited, both object and primitive Bvhs
+    uint64_t       prims_tested;                //!< Primitives tested for intersection
+    int64_t        shade_nsecs;                 //!< Total shader self time
+    int64_t        shade_child_nsecs;           //!< Nested shader time of the currently running ShaderTimer
+    ObjectStatsMap objects;                     //!< Keyed by ObjectContext*
+    ShaderStatsMap shaders;                     //!< Keyed by RayShader* or legacy material Iop*
+
+
+    //!
+    RenderStats();
+
+    //! Zero all counters and clear the maps, leaves 'enabled' alone.
+    void clear();
+
+    //! Add another thread's counters into this one.
+    void merge(const RenderStats& b);
+
+    //! Sum of all ray types.
+    uint64_t totalRays() const;
+
+    //! Increment the count for a Fsr::RayContext::type_mask.
+    void addRay(uint32_t type_mask) { ++rays[rayType(type_mask)]; }
+
+    //! Map a Fsr::RayContext::type_mask to a RayStatType.
+    static RayStatType rayType(uint32_t type_mask);
+
+    //! Json-friendly name of a RayStatType.
+    static const char* rayTypeName(uint32_t type);
+
+    //! Monotonic clock in nanoseconds.
+    static int64_t now()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return int64_t(ts.tv_sec)*1000000000ll + int64_t(ts.tv_nsec);
+    }
+};
+
+
+/*! Scoped timer that adds the self time of a shader evaluation to a
+    RenderStats shader entry. Shaders can evaluate other shaders (a
+    surface calling illuminate() on the lights for example,) so the
+    time spent in nested timers is subtracted from the enclosing one
+    and the per-shader times add up to the total shading time.
+
+    Does nothing if 'stats' is disabled.
+*/
+class ZPR_EXPORT ShaderTimer
+{
+  public:
+    //!
+    ShaderTimer(RenderStats&     stats,
+                const RayShader* shader);
+    //! For legacy Iop-based materials.
+    ShaderTimer(RenderStats&           stats,
+                const DD::Image::Iop*  material);
+    //!
+    ~ShaderTimer();
+
+
+  protected:
+    RenderStats* m_stats;           //!< NULL if disabled
+    const void*  m_key;             //!< Shader map key
+    bool         m_is_legacy;       //!< Key is an Iop* rather than a RayShader*
+    int64_t      m_start;           //!< Clock time at construction
+    int64_t      m_outer_child_nsecs; //!< Enclosing timer's nested time, restored on destruction
+
+    void start(RenderStats& stats);
+
+
+  private:
+    ShaderTimer(const ShaderTimer&);
+    ShaderTimer& operator = (const ShaderTimer&);
+};
+
+
+} // namespace zpr
+
+#endif
+
+// end of zprender/RenderStats.h
+
+//
+// Copyright 2020 DreamWorks Animation
+//
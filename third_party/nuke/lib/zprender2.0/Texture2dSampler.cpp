@@ -28,24 +28,80 @@
 
 
 #include "Texture2dSampler.h"
+#include "RenderStats.h"
 
 #include <DDImage/Iop.h>
+#include <DDImage/Row.h>
 
 
 namespace zpr {
 
 
+/*! Walks texels at one mip level, only going back to the cache
+    when the texel is in a different tile than the last one.
+    Coordinates are clamped to the level's edges.
+*/
+class TexelCursor
+{
+    Texture2dSampler* m_sampler;
+    uint32_t          m_level;
+    int32_t           m_w, m_h;
+    uint32_t          m_tx, m_ty;
+    TextureTileRef    m_tile;
+
+
+  public:
+    TexelCursor(Texture2dSampler* sampler,
+                uint32_t          level) :
+        m_sampler(sampler),
+        m_level(level),
+        m_w(sampler->levelWidth(level)),
+        m_h(sampler->levelHeight(level)),
+        m_tx(0xffffffff),
+        m_ty(0xffffffff)
+    {
+        //
+    }
+
+    //! Returns NULL if Nuke aborted while loading the tile.
+    const float* texel(int32_t x,
+                       int32_t y)
+    {
+        x = std::max(0, std::min(x, m_w-1));
+        y = std::max(0, std::min(y, m_h-1));
+        const uint32_t tx = uint32_t(x) / TextureTile::SIZE;
+        const uint32_t ty = uint32_t(y) / TextureTile::SIZE;
+        if (tx != m_tx || ty != m_ty || !m_tile)
+        {
+            m_tile = m_sampler->getTile(m_level, tx, ty);
+            if (!m_tile)
+                return NULL;
+            m_tx = tx;
+            m_ty = ty;
+        }
+        return m_tile->texel(uint32_t(x) - tx*TextureTile::SIZE,
+                             uint32_t(y) - ty*TextureTile::SIZE);
+    }
+};
+
+
+//-----------------------------------------------------------------------------
+
+
 /*! 
 */
 Texture2dSampler::Texture2dSampler(DD::Image::Iop*              iop,
                                    const DD::Image::ChannelSet& channels) :
     m_iop(iop),
     m_channels(DD::Image::Mask_None),
-    m_tile(NULL),
-    m_status(NOT_LOADED),
-    m_error(false),
-    m_offset(0.0f),
-    m_scale(0.0f)
+    m_chan_slot(DD::Image::Chan_Last+1, -1),
+    m_texture_id(0),
+    m_x(0),
+    m_y(0),
+    m_num_levels(0),
+    m_scale(0.0f),
+    m_tile_loads(0),
+    m_tile_read_nsecs(0)
 {
     //std::cout << "Texture2dSampler::ctor(" << this << ") iop=" << iop << ", channels=" << channels << std::endl;
     if (iop)
@@ -54,109 +110,216 @@ Texture2dSampler::Texture2dSampler(DD::Image::Iop*              iop,
         iop->request(channels, 1/*count*/);
         m_channels = channels;
         m_channels &= iop->channels();
+
+        m_chan_list = m_channels;
+        for (uint32_t i=0; i < m_chan_list.size(); ++i)
+            m_chan_slot[m_chan_list[i]] = int16_t(i);
+
+        // Tiles are shared between samplers and renders by Iop contents:
+        DD::Image::Hash texture_hash;
+        texture_hash.append(iop->hash());
+        foreach(z, m_channels)
+            texture_hash.append(int(z));
+        m_texture_id = texture_hash.value();
+
+        // Tiles are indexed from the data window origin, and uv 0-1
+        // covers the data window:
+        const DD::Image::Box& b = iop->info();
+        m_x = b.x();
+        m_y = b.y();
+        int32_t w = b.w();
+        int32_t h = b.h();
+        m_scale.set(float(w), float(h));
+
+        if (w > 0 && h > 0 && m_chan_list.size() > 0)
+        {
+            // Each level is half the size of the one below, rounded up:
+            while (m_num_levels < MAX_LEVELS)
+            {
+                m_level_w[m_num_levels] = w;
+                m_level_h[m_num_levels] = h;
+                ++m_num_levels;
+                if (w == 1 && h == 1)
+                    break;
+                w = (w + 1) / 2;
+                h = (h + 1) / 2;
+            }
+        }
     }
 }
 
 
-/*! 
+/*! Tiles stay in the cache as long as the budget allows, so an
+    unchanged texture doesn't need to be reloaded by the next render.
 */
 Texture2dSampler::~Texture2dSampler()
 {
     //std::cout << "Texture2dSampler::dtor(" << this << ")" << std::endl;
-    delete m_tile;
 }
 
 
 /*!
 */
-bool
-Texture2dSampler::buildTile()
+TextureTileRef
+Texture2dSampler::getTile(uint32_t level,
+                          uint32_t tx,
+                          uint32_t ty)
+{
+    TextureCache& cache = TextureCache::instance();
+
+    TextureTileRef tile = cache.find(m_texture_id, level, tx, ty);
+    if (tile)
+        return tile;
+
+    if (level == 0)
+    {
+        // Misses are rare & slow enough that timing them is always affordable.
+        // Only the Iop reads are timed as downsampleTile() recurses to level 0:
+        const int64_t read_start = RenderStats::now();
+        tile = readTile(tx, ty);
+        m_tile_read_nsecs += RenderStats::now() - read_start;
+    }
+    else
+        tile = downsampleTile(level, tx, ty);
+    if (!tile)
+        return tile; // aborted, don't cache it
+    ++m_tile_loads;
+
+    return cache.insert(m_texture_id, level, tx, ty, tile);
+}
+
+
+/*! Texels outside the texture in a partial edge tile are left at zero,
+    they're never read since the TexelCursor clamps to the level edges.
+*/
+TextureTileRef
+Texture2dSampler::readTile(uint32_t tx,
+                           uint32_t ty)
 {
-    if (m_tile)
-        return true; // tile's good
-    else if (m_error)
-        return false; // not a valid tile
-
-    // Loop until the tile is loaded, pausing any other threads trying to
-    // sample this same texture:
-    while (1)
+    const uint32_t nChans = m_chan_list.size();
+    const int32_t x0 = int32_t(tx*TextureTile::SIZE);
+    const int32_t y0 = int32_t(ty*TextureTile::SIZE);
+    const int32_t x1 = std::min(x0 + int32_t(TextureTile::SIZE), m_level_w[0]);
+    const int32_t y1 = std::min(y0 + int32_t(TextureTile::SIZE), m_level_h[0]);
+
+    TextureTileRef tile = std::make_shared<TextureTile>(nChans);
+
+    const int32_t X = m_x + x0;
+    const int32_t R = m_x + x1;
+    DD::Image::Row row(X, R);
+    for (int32_t y=y0; y < y1; ++y)
     {
-        if (m_status == LOADED)
-            return true;
+        row.get(*m_iop, m_y + y, X, R, m_channels);
+        if (m_iop->aborted())
+            return TextureTileRef();
 
-        if (m_status == NOT_LOADED)
+        for (uint32_t i=0; i < nChans; ++i)
         {
-            static DD::Image::Lock load_lock;
-            load_lock.lock();
+            const float* IN = row[m_chan_list[i]] + X;
+            float* OUT = tile->texel(0, uint32_t(y - y0)) + i;
+            for (int32_t x=X; x < R; ++x, OUT += nChans)
+                *OUT = *IN++;
+        }
+    }
+
+    return tile;
+}
 
-            // Check again to avoid a race condition:
-            if (m_status == NOT_LOADED)
-            {
-                // Lock the object for us to change the status, and that will
-                // keep the other threads from trying to build it:
-                m_status = LOADING;
-
-                load_lock.unlock(); // let other threads go
-
-                // Build the tile:
-                DD::Image::RawGeneralTile* tile = new DD::Image::RawGeneralTile(*m_iop,
-                                                                                m_channels,
-                                                                                false/*true*//*mthreaded*/,
-                                                                                NULL/*ratchet*/);
-                if (tile->aborted())
-                {
-                    // Nuke aborted during tile fill, bail but don't set error:
-                    delete tile;
-                    m_status = NOT_LOADED;
-                    return false;
-                }
-                else if (!tile->valid())
-                {
-                    // Nuke built the tile but it's not valid, set error:
-                    delete tile;
-                    m_status = ERROR;
-                    return true;
-                }
 
-                m_offset.set(float(tile->x()), float(tile->y()));
-                m_scale.set(float(tile->w()), float(tile->h()));
+/*! Each texel is the average of the 2x2 texels below it, clamping
+    at the edges of odd-sized levels.
+*/
+TextureTileRef
+Texture2dSampler::downsampleTile(uint32_t level,
+                                 uint32_t tx,
+                                 uint32_t ty)
+{
+    const uint32_t nChans = m_chan_list.size();
+    const int32_t x0 = int32_t(tx*TextureTile::SIZE);
+    const int32_t y0 = int32_t(ty*TextureTile::SIZE);
+    const int32_t x1 = std::min(x0 + int32_t(TextureTile::SIZE), m_level_w[level]);
+    const int32_t y1 = std::min(y0 + int32_t(TextureTile::SIZE), m_level_h[level]);
 
-                m_tile = tile;
-                m_status = LOADED;
+    TextureTileRef tile = std::make_shared<TextureTile>(nChans);
 
-                return true; // all done!
+    TexelCursor src(this, level-1);
+    for (int32_t y=y0; y < y1; ++y)
+    {
+        float* OUT = tile->texel(0, uint32_t(y - y0));
+        for (int32_t x=x0; x < x1; ++x, OUT += nChans)
+        {
+            for (uint32_t i=0; i < nChans; ++i)
+                OUT[i] = 0.0f;
 
-            }
-            else
+            for (int32_t sy=0; sy < 2; ++sy)
             {
-                // Another thread got here first but we have to wait until it's done loading:
-                load_lock.unlock();
+                for (int32_t sx=0; sx < 2; ++sx)
+                {
+                    const float* IN = src.texel(x*2 + sx, y*2 + sy);
+                    if (!IN)
+                        return TextureTileRef();
+                    for (uint32_t i=0; i < nChans; ++i)
+                        OUT[i] += IN[i];
+                }
             }
-        }
-
-        // TODO: switch this to a real std::condition_variable mutex test!
-        // Pause briefly then try again:
-        DD::Image::sleepFor(0.01/*seconds*/);
 
-    } // while loop
+            for (uint32_t i=0; i < nChans; ++i)
+                OUT[i] *= 0.25f;
+        }
+    }
 
-    // shouldn't ever get here...
-    return false;
+    return tile;
 }
 
 
-
-/*! Replacement for seemingly buggy Filter::apply() method...
+/*! xy and fRadius are in level 0 texel coords.
 */
-inline float
-applyFilterToArray(const DD::Image::Filter::Coefficients& filter,
-                   const float*                           array)
+bool
+Texture2dSampler::filterLevel(uint32_t                 level,
+                              const Fsr::Vec2f&        xy,
+                              const Fsr::Vec2f&        fRadius,
+                              const DD::Image::Filter* filter,
+                              float                    weight,
+                              Fsr::Pixel&              out)
 {
-    const float* fp = array + filter.first;
-    float weight = *fp++ * filter.array[0];
-    for (int32_t i=1; i < filter.count; ++i)
-        weight += *fp++ * filter.array[i*filter.delta];
-    return weight;
+    const float level_scale = 1.0f / float(1 << level);
+
+    // Fill in the U/V filter coefficient weight tables:
+    DD::Image::Filter::Coefficients cU, cV;
+    filter->get(xy.x*level_scale, fRadius.x*level_scale, cU);
+    filter->get(xy.y*level_scale, fRadius.y*level_scale, cV);
+
+    const float normalize_factor = (cU.normalize*cV.normalize)*weight;
+    const uint32_t nChans = out.getNumChans();
+
+    TexelCursor cursor(this, level);
+    for (int32_t y=0; y < cV.count; ++y)
+    {
+        const float wy = cV.array[y*cV.delta]*normalize_factor;
+        if (wy == 0.0f)
+            continue;
+
+        for (int32_t x=0; x < cU.count; ++x)
+        {
+            const float w = cU.array[x*cU.delta]*wy;
+            if (w == 0.0f)
+                continue;
+
+            const float* texel = cursor.texel(cU.first + x, cV.first + y);
+            if (!texel)
+                return false;
+
+            for (uint32_t i=0; i < nChans; ++i)
+            {
+                const DD::Image::Channel z = out.getIdx(i);
+                const int32_t slot = m_chan_slot[z];
+                if (slot >= 0)
+                    out[z] += texel[slot]*w;
+            }
+        }
+    }
+
+    return true;
 }
 
 
@@ -164,6 +327,9 @@ applyFilterToArray(const DD::Image::Filter::Coefficients& filter,
     inside a parallelogram using the filter kernel to approximate
     the ellipse weighting.
 
+    The filter radius picks the mip level so that the kernel spans
+    1-2 texels, blending the two nearest levels to avoid popping.
+
     TODO: it may be possible to perform line offsets of the cU/cV
     filter to more closely match the ellipse shape using the
     same DD::Image::Filter mechanisms.
@@ -175,14 +341,12 @@ Texture2dSampler::sampleFilterered(const Fsr::Vec2f&        uv,
                                    const DD::Image::Filter* filter,
                                    Fsr::Pixel&              out)
 {
-    if (!filter || !buildTile())
+    if (!filter || !isValid())
         return;
-#if DEBUG
-    assert(m_tile);
-#endif
 
 
-    const Fsr::Vec2f xy(m_offset + uv*m_scale);
+    // Level 0 texel coords relative to the data window origin:
+    const Fsr::Vec2f xy(uv*m_scale);
     const Fsr::Vec2f dx(dUVdx*m_scale);
     const Fsr::Vec2f dy(dUVdy*m_scale);
 
@@ -213,79 +377,29 @@ Texture2dSampler::sampleFilterered(const Fsr::Vec2f&        uv,
         fRadius.set(::fabsf(ea) / radiusY, radiusY);
     }
 
-    // Fill in the U/V filter coefficient weight tables:
-    DD::Image::Filter::Coefficients cU, cV;
-    filter->get(xy.x, fRadius.x, cU);
-    filter->get(xy.y, fRadius.y, cV);
-
-    // Bbox extent of filter:
-    const DD::Image::Box fBox(cU.first,
-                              cV.first,
-                              (cU.first + cU.count),
-                              (cV.first + cV.count));
-
-    // Handle filter being partially clipped at edge of tile:
-    if (fBox.x() <  m_tile->x() || fBox.y() <  m_tile->y() ||
-        fBox.r() >= m_tile->r() || fBox.t() >= m_tile->t())
-    {
-        // This is used to copy texels along the clamped edge of a tile:
-        static float edge_filter[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
-
-        // Filter is clipped on at least one side, check which side:
-        if (fBox.x() >= m_tile->r() || fBox.r() <= m_tile->x())
-        {
-            // X is completely clipped so copy filtered Y from edge:
-            cU.array     = edge_filter;
-            cU.delta     = 1;
-            cU.count     = 1;
-            cU.normalize = 1.0f;
-        }
-
-        // If Y is completely clipped so copy filtered X from edge:
-        if (fBox.y() >= m_tile->t() || fBox.t() <= m_tile->y())
-        {
-            cV.array     = edge_filter;
-            cV.delta     = 1;
-            cV.count     = 1;
-            cV.normalize = 1.0f;
-        }
-
-        // Clamped filter loop:
-        const float normalize_factor = (cU.normalize*cV.normalize);
-        const uint32_t nChans = out.getNumChans();
-        for (uint32_t i=0; i < nChans; ++i)
-        {
-            const DD::Image::Channel z = out.getIdx(i);
-
-            float weight = 0.0f;
-            for (int32_t y=0; y < cV.count; ++y)
-            {
-                const float* fp = (*m_tile)[z][m_tile->clampy(fBox.y()+y)];
-                float xweight = 0.0f;
-                for (int32_t x=0; x < cU.count; ++x)
-                    xweight += fp[m_tile->clampx(fBox.x()+x)]*cU.array[x*cU.delta];
+    const uint32_t nChans = out.getNumChans();
+    for (uint32_t i=0; i < nChans; ++i)
+        out[out.getIdx(i)] = 0.0f;
 
-                weight += xweight*cV.array[y*cV.delta];
-            }
-            out[z] = weight*normalize_factor;
-        }
+    // Pick the mip level(s) from the filter footprint:
+    const float max_radius = std::max(fRadius.x, fRadius.y);
+    if (max_radius <= 1.0f || m_num_levels == 1)
+    {
+        filterLevel(0, xy, fRadius, filter, 1.0f, out);
+        return;
+    }
 
+    const float    lod   = std::min(log2f(max_radius), float(m_num_levels - 1));
+    const uint32_t level = uint32_t(lod);
+    const float    t     = lod - float(level);
+    if (level+1 >= m_num_levels || t < 0.001f)
+    {
+        filterLevel(level, xy, fRadius, filter, 1.0f, out);
     }
     else
     {
-        // Filter is unclipped on tile, iterate over entire ellipse rectangle:
-        const float normalize_factor = (cU.normalize*cV.normalize);
-        const uint32_t nChans = out.getNumChans();
-        for (uint32_t i=0; i < nChans; ++i)
-        {
-            const DD::Image::Channel z = out.getIdx(i);
-
-            float weight = 0.0f;
-            for (int32_t y=0; y < cV.count; ++y)
-                weight += applyFilterToArray(cU, (*m_tile)[z][fBox.y()+y]) * cV.array[y*cV.delta];
-
-            out[z] = weight*normalize_factor;
-        }
+        if (filterLevel(level, xy, fRadius, filter, 1.0f - t, out))
+            filterLevel(level+1, xy, fRadius, filter, t, out);
     }
 
 }
@@ -31,10 +31,11 @@
 #define zprender_Texture2dSampler_h
 
 #include "api.h"
+#include "TextureCache.h"
 
 #include <Fuser/NukePixelInterface.h> // for Fsr::Pixel
 
-#include <DDImage/RawGeneralTile.h>
+#include <DDImage/Iop.h>
 #include <DDImage/TextureFilter.h>
 
 
@@ -44,9 +45,11 @@ namespace zpr {
 /*! A Texture2dSampler is intended for connection to a source
     Iop.
 
-    This class stores a RawGeneralTile cache to speed texture filtering
-    at the cost of memory, but it's only for the life of the render
-    and the caches are released as soon as possible.
+    Texels are paged on demand from the source Iop in fixed-size tiles
+    held in the global TextureCache, so resident memory is bounded by
+    the cache budget rather than the size of every bound texture. Mip
+    levels are built lazily by box-filtering the level below, and the
+    level is picked from the ray differential footprint.
 
     Replaces using the Iop::sample() methods which have become very
     slow and unfortunately this means having to replicate much of
@@ -56,27 +59,43 @@ namespace zpr {
 */
 class ZPR_EXPORT Texture2dSampler
 {
-    enum
-    {
-        NOT_LOADED = 0,   //!<
-        LOADING    = 1,   //!< 
-        LOADED     = 2,   //!< 
-        ERROR      = 3    //!<
-    };
+  public:
+    static const uint32_t MAX_LEVELS = 16;
 
 
   protected:
     DD::Image::Iop*            m_iop;       //!< Source Iop
     DD::Image::ChannelSet      m_channels;  //!< Channels to get from Iop
-    DD::Image::RawGeneralTile* m_tile;      //!< Pointer to tile cache
-    int32_t                    m_status;    //!< Tile load status
-    bool                       m_error;     //!< Error when creating tile
-    Fsr::Vec2f                 m_offset;    //!< Float version of tile offset
-    Fsr::Vec2f                 m_scale;     //!< Float version of tile scale
-
-
-    //!
-    bool buildTile();
+    Fsr::ChannelList           m_chan_list; //!< Channels in tile texel order
+    std::vector<int16_t>       m_chan_slot; //!< Channel -> texel slot, -1 if not in m_channels
+    uint64_t                   m_texture_id; //!< Cache id from Iop hash and channels
+    int32_t                    m_x, m_y;    //!< Texture data window origin
+    int32_t                    m_level_w[MAX_LEVELS]; //!< Texel width of each mip level
+    int32_t                    m_level_h[MAX_LEVELS]; //!< Texel height of each mip level
+    uint32_t                   m_num_levels; //!< Number of mip levels, 0 if texture is invalid
+    Fsr::Vec2f                 m_scale;     //!< Float version of level 0 size
+
+    // Load counters for the render stats:
+    std::atomic<uint64_t>      m_tile_loads;      //!< Tiles read or downsampled on a cache miss
+    std::atomic<int64_t>       m_tile_read_nsecs; //!< Time spent reading level 0 tiles from the Iop
+
+
+    //! Read a level 0 tile from the Iop. Returns an empty ref if aborted.
+    TextureTileRef readTile(uint32_t tx,
+                            uint32_t ty);
+
+    //! Build a mip tile by box-filtering the level below. Returns an empty ref if aborted.
+    TextureTileRef downsampleTile(uint32_t level,
+                                  uint32_t tx,
+                                  uint32_t ty);
+
+    //! Accumulate the filtered texels at a mip level into out. Returns false if aborted.
+    bool filterLevel(uint32_t                 level,
+                     const Fsr::Vec2f&        xy,
+                     const Fsr::Vec2f&        fRadius,
+                     const DD::Image::Filter* filter,
+                     float                    weight,
+                     Fsr::Pixel&              out);
 
 
   public:
@@ -86,8 +105,8 @@ class ZPR_EXPORT Texture2dSampler
     //!
     ~Texture2dSampler();
 
-    //! Tile pointer is non-NULL only if the tile loaded successfully.
-    bool isValid() const { return (m_status == LOADED); }
+    //! Texture has a non-empty data window and channels.
+    bool isValid() const { return (m_num_levels > 0); }
 
     //! Return the Iop the sampler is bound to.
     DD::Image::Iop* iop() const { return m_iop; }
@@ -95,6 +114,27 @@ class ZPR_EXPORT Texture2dSampler
     //! Get the channels this will sample.
     const DD::Image::ChannelSet& channels() const { return m_channels; }
 
+    //! Number of mip levels, level 0 being full resolution.
+    uint32_t numLevels() const { return m_num_levels; }
+
+    //! Texel dimensions of a mip level.
+    int32_t levelWidth(uint32_t level)  const { return m_level_w[level]; }
+    int32_t levelHeight(uint32_t level) const { return m_level_h[level]; }
+
+    /*! Return a tile from the cache, reading or building it on a miss.
+        Returns an empty ref if Nuke aborted while loading.
+    */
+    TextureTileRef getTile(uint32_t level,
+                           uint32_t tx,
+                           uint32_t ty);
+
+    //! Number of tiles this sampler has loaded, at all mip levels.
+    uint64_t tileLoads()     const { return m_tile_loads; }
+    //! Nanoseconds spent reading level 0 tiles from the Iop. Mip tiles are built from these.
+    int64_t  tileReadNsecs() const { return m_tile_read_nsecs; }
+    //! Zero the load counters, samplers are kept across frames so this is done per stats report.
+    void     clearLoadStats() { m_tile_loads.exchange(0); m_tile_read_nsecs.exchange(0); }
+
 
   public:
     //! Replicates the Iop::sample() method.
@@ -104,151 +144,9 @@ class ZPR_EXPORT Texture2dSampler
                           const DD::Image::Filter* filter,
                           Fsr::Pixel&              out);
 
-    //! Sample a single texel with no filtering.
-    void samplePixel(int32_t     tx,
-                     int32_t     ty,
-                     Fsr::Pixel& out);
-
-
-  public:
-    //! TODO: for future mipmap support:
-    void bilinearFilterX(int32_t     tx,
-                         float       dx,
-                         int32_t     ty,
-                         Fsr::Pixel& out);
-    void bilinearFilterY(int32_t     tx,
-                         int32_t     ty,
-                         float       dy,
-                         Fsr::Pixel& out);
-    void bilinearFilterXY(int32_t     tx,
-                          float       dx,
-                          int32_t     ty,
-                          float       dy,
-                          Fsr::Pixel& out);
-    void bilinearTextureFilter(const Fsr::Vec2f& uv,
-                               Fsr::Pixel&       out);
-
 };
 
 
-
-/*---------------------------------------------------------------------*/
-/*---------------------------------------------------------------------*/
-/*                   Inline Function Implementations                   */
-/*---------------------------------------------------------------------*/
-/*---------------------------------------------------------------------*/
-
-inline void
-Texture2dSampler::samplePixel(int32_t     tx,
-                              int32_t     ty,
-                              Fsr::Pixel& out)
-{
-    const uint32_t nChans = out.getNumChans();
-    for (uint32_t i=0; i < nChans; ++i)
-    {
-        const DD::Image::Channel z = out.getIdx(i);
-        out[z] = (*m_tile)[z][ty][tx];
-    }
-}
-
-inline void
-Texture2dSampler::bilinearFilterX(int32_t     tx,
-                                  float       dx,
-                                  int32_t     ty,
-                                  Fsr::Pixel& out)
-{
-    const float idx = 1.0f - dx;
-    const uint32_t nChans = out.getNumChans();
-    for (uint32_t i=0; i < nChans; ++i)
-    {
-        const DD::Image::Channel z = out.getIdx(i);
-        DD::Image::RawGeneralTile::RowPtr p = (*m_tile)[z][ty] + tx;
-        const float x0 = *p++;
-        const float x1 = *p;
-        out[z] = x0*idx + x1*dx;
-    }
-}
-
-inline void
-Texture2dSampler::bilinearFilterY(int32_t     tx,
-                                  int32_t     ty,
-                                  float       dy,
-                                  Fsr::Pixel& out)
-{
-    const float idy = 1.0f - dy;
-    const uint32_t nChans = out.getNumChans();
-    for (uint32_t i=0; i < nChans; ++i)
-    {
-        const DD::Image::Channel z = out.getIdx(i);
-        const float y1 = (*m_tile)[z][ty+1][tx];
-        const float y0 = (*m_tile)[z][ty  ][tx];
-        out[z] = y0*idy + y1*dy;
-    }
-}
-
-inline void
-Texture2dSampler::bilinearFilterXY(int32_t     tx,
-                                   float       dx,
-                                   int32_t     ty,
-                                   float       dy,
-                                   Fsr::Pixel& out)
-{
-    const float idx = 1.0f - dx;
-    const float idy = 1.0f - dy;
-    const uint32_t nChans = out.getNumChans();
-    for (uint32_t i=0; i < nChans; ++i)
-    {
-        const DD::Image::Channel z = out.getIdx(i);
-        DD::Image::RawGeneralTile::RowPtr p1 = (*m_tile)[z][ty+1] + tx;
-        DD::Image::RawGeneralTile::RowPtr p0 = (*m_tile)[z][ty  ] + tx;
-        const float x0y1 = *p1++;
-        const float x1y1 = *p1;
-        const float x0y0 = *p0++;
-        const float x1y0 = *p0;
-        out[z] = (x0y0*idx + x1y0*dx)*idy + (x0y1*idx + x1y1*dx)*dy;
-    }
-}
-
-inline void
-Texture2dSampler::bilinearTextureFilter(const Fsr::Vec2f& uv,
-                                        Fsr::Pixel&       out)
-{
-    const float   cx  = m_offset.x + uv.x*m_scale.x;
-    const float   cy  = m_offset.y + uv.y*m_scale.y;
-    const float   ftx = floorf(cx + 0.01f);
-    const float   fty = floorf(cy + 0.01f);
-    const int32_t tx  = int32_t(ftx);
-    const int32_t ty  = int32_t(fty);
-    if (tx < m_tile->x())
-    {
-        if (ty < m_tile->y())
-            samplePixel(m_tile->x(), m_tile->y(), out); // clamped at left and bottom
-        else if (ty < (m_tile->t()-1))
-            bilinearFilterY(m_tile->x(), ty, (cy - fty), out); // clamped at left, interpolate Y
-        else
-            samplePixel(m_tile->x(), m_tile->t()-1, out); // clamped at left and top
-    }
-    else if (tx < (m_tile->r()-1))
-    {
-        if (ty < m_tile->y())
-            bilinearFilterX(tx, (cx - ftx), m_tile->y(), out); // clamped at bottom, interpolate X
-        else if (ty < (m_tile->t()-1))
-            bilinearFilterXY(tx, (cx - ftx), ty, (cy - fty),out); // interpolate in X & Y
-        else
-            bilinearFilterX(tx, (cx - ftx), m_tile->t()-1, out); // clamped at top, interpolate X
-    }
-    else
-    {
-        if (ty < m_tile->y())
-            samplePixel(m_tile->r()-1, m_tile->y(), out); // clamped at right and bottom
-        else if (ty < (m_tile->t()-1))
-            bilinearFilterY(m_tile->r()-1, ty, (cy - fty), out); // interpolate in Y
-        else
-            samplePixel(m_tile->r()-1, m_tile->t()-1, out); // clamped at right and top
-    }
-}
-
-
 } // namespace zpr
 
 #endif
@@ -0,0 +1,274 @@
+//
+// Copyright 2020 DreamWorks Animation
+//
+// Licensed under the Apache License, Version 2.0 (the "Apache License")
+// with the following modification; you may not use this file except in
+// compliance with the Apache License and the following modification to it:
+// Section 6. Trademarks. is deleted and replaced with:
+//
+// 6. Trademarks. This License does not grant permission to use the trade
+//    names, trademarks, service marks, or product names of the Licensor
+//    and its affiliates, except as required to comply with Section 4(c) of
+//    the License and to reproduce the content of the NOTICE file.
+//
+// You may obtain a copy of the Apache License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the Apache License with the above modification is
+// distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied. See the Apache License for the specific
+// language governing permissions and limitations under the Apache License.
+//
+
+/// @file zprender/TextureCache.cpp
+///
+/// @author Jonathan Egstad
+
+
+#include "TextureCache.h"
+
+
+namespace zpr {
+
+
+/*! Default budget is 2GB which fits a few dozen 4K RGBA float textures.
+*/
+TextureCache::TextureCache() :
+    m_max_bytes(size_t(2048)*1024*1024),
+    m_bytes(0),
+    m_peak_bytes(0),
+    m_hits(0),
+    m_misses(0),
+    m_evictions(0)
+{
+    //
+}
+
+
+/*!
+*/
+/*static*/
+TextureCache&
+TextureCache::instance()
+{
+    static TextureCache cache;
+    return cache;
+}
+
+
+/*!
+*/
+void
+TextureCache::setMemoryLimit(size_t max_bytes)
+{
+    if (max_bytes == m_max_bytes)
+        return;
+    m_max_bytes = max_bytes;
+
+    for (uint32_t i=0; i < NUM_SHARDS; ++i)
+    {
+        Shard& shard = m_shards[i];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        evictLocked(shard);
+    }
+}
+
+
+/*!
+*/
+TextureTileRef
+TextureCache::find(uint64_t texture_id,
+                   uint32_t level,
+                   uint32_t tx,
+                   uint32_t ty)
+{
+    const TileKey key = { texture_id, level, tx, ty };
+    Shard& shard = shardFor(key);
+    std::lock_guard<std::mutex> guard(shard.lock);
+
+    TileMap::iterator it = shard.tiles.find(key);
+    if (it == shard.tiles.end())
+    {
+        ++m_misses;
+        return TextureTileRef();
+    }
+
+    // Move to front of LRU list:
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru);
+    ++m_hits;
+    return it->second.tile;
+}
+
+
+/*!
+*/
+TextureTileRef
+TextureCache::insert(uint64_t              texture_id,
+                     uint32_t              level,
+                     uint32_t              tx,
+                     uint32_t              ty,
+                     const TextureTileRef& tile)
+{
+    if (!tile)
+        return tile;
+
+    const TileKey key = { texture_id, level, tx, ty };
+    Shard& shard = shardFor(key);
+    std::lock_guard<std::mutex> guard(shard.lock);
+
+    TileMap::iterator it = shard.tiles.find(key);
+    if (it != shard.tiles.end())
+        return it->second.tile; // another thread beat us to it
+
+    shard.lru.push_front(key);
+    Entry& entry = shard.tiles[key];
+    entry.tile = tile;
+    entry.lru  = shard.lru.begin();
+
+    const size_t tile_bytes = tile->bytes();
+    shard.bytes += tile_bytes;
+    const size_t total_bytes = (m_bytes += tile_bytes);
+
+    // Update high-water mark:
+    size_t peak = m_peak_bytes;
+    while (total_bytes > peak && !m_peak_bytes.compare_exchange_weak(peak, total_bytes))
+        ;
+
+    evictLocked(shard);
+
+    return tile;
+}
+
+
+/*! Each shard gets an even share of the budget. The most recent tile
+    is never evicted so a tiny budget still makes forward progress.
+*/
+void
+TextureCache::evictLocked(Shard& shard)
+{
+    const size_t shard_max_bytes = m_max_bytes / NUM_SHARDS;
+    while (shard.bytes > shard_max_bytes && shard.lru.size() > 1)
+    {
+        const TileKey& key = shard.lru.back();
+        TileMap::iterator it = shard.tiles.find(key);
+        const size_t tile_bytes = it->second.tile->bytes();
+        shard.bytes -= tile_bytes;
+        m_bytes     -= tile_bytes;
+        shard.tiles.erase(it);
+        shard.lru.pop_back();
+        ++m_evictions;
+    }
+}
+
+
+/*!
+*/
+void
+TextureCache::releaseTexture(uint64_t texture_id)
+{
+    for (uint32_t i=0; i < NUM_SHARDS; ++i)
+    {
+        Shard& shard = m_shards[i];
+        std::lock_guard<std::mutex> guard(shard.lock);
+
+        for (LRUList::iterator lit=shard.lru.begin(); lit != shard.lru.end();)
+        {
+            if (lit->texture_id != texture_id)
+            {
+                ++lit;
+                continue;
+            }
+            TileMap::iterator it = shard.tiles.find(*lit);
+            const size_t tile_bytes = it->second.tile->bytes();
+            shard.bytes -= tile_bytes;
+            m_bytes     -= tile_bytes;
+            shard.tiles.erase(it);
+            lit = shard.lru.erase(lit);
+        }
+    }
+}
+
+
+/*!
+*/
+void
+TextureCache::clear()
+{
+    for (uint32_t i=0; i < NUM_SHARDS; ++i)
+    {
+        Shard& shard = m_shards[i];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        m_bytes -= shard.bytes;
+        shard.tiles.clear();
+        shard.lru.clear();
+        shard.bytes = 0;
+    }
+}
+
+
+/*!
+*/
+TextureCache::Stats
+TextureCache::getStats() const
+{
+    Stats stats;
+    stats.hits       = m_hits;
+    stats.misses     = m_misses;
+    stats.evictions  = m_evictions;
+    stats.bytes      = m_bytes;
+    stats.peak_bytes = m_peak_bytes;
+    stats.max_bytes  = m_max_bytes;
+    for (uint32_t i=0; i < NUM_SHARDS; ++i)
+    {
+        Shard& shard = const_cast<Shard&>(m_shards[i]);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        stats.tiles += shard.tiles.size();
+    }
+    return stats;
+}
+
+
+/*!
+*/
+void
+TextureCache::resetStats()
+{
+    m_hits       = 0;
+    m_misses     = 0;
+    m_evictions  = 0;
+    m_peak_bytes = size_t(m_bytes);
+}
+
+
+/*!
+*/
+void
+TextureCache::printStats(const char*   prefix,
+                         std::ostream& o) const
+{
+    const Stats stats = getStats();
+    const uint64_t lookups = stats.hits + stats.misses;
+    const double hit_rate = (lookups > 0) ? 100.0*double(stats.hits)/double(lookups) : 0.0;
+    const double mb = 1.0 / (1024.0*1024.0);
+    o << prefix << "texture cache:";
+    o << " hits=" << stats.hits << " misses=" << stats.misses;
+    o << " (" << hit_rate << "% hit rate)";
+    o << " evictions=" << stats.evictions;
+    o << " tiles=" << stats.tiles;
+    o << " resident=" << double(stats.bytes)*mb << "MB";
+    o << " peak=" << double(stats.peak_bytes)*mb << "MB";
+    o << " budget=" << double(stats.max_bytes)*mb << "MB";
+    o << std::endl;
+}
+
+
+} // namespace zpr
+
+
+// end of zprender/TextureCache.cpp
+
+//
+// Copyright 2020 DreamWorks Animation
+//
@@ -0,0 +1,227 @@
+//
+// Copyright 2020 DreamWorks Animation
+//
+// Licensed under the Apache License, Version 2.0 (the "Apache License")
+// with the following modification; you may not use this file except in
+// compliance with the Apache License and the following modification to it:
+// Section 6. Trademarks. is deleted and replaced with:
+//
+// 6. Trademarks. This License does not grant permission to use the trade
+//    names, trademarks, service marks, or product names of the Licensor
+//    and its affiliates, except as required to comply with Section 4(c) of
+//    the License and to reproduce the content of the NOTICE file.
+//
+// You may obtain a copy of the Apache License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the Apache License with the above modification is
+// distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied. See the Apache License for the specific
+// language governing permissions and limitations under the Apache License.
+//
+
+/// @file zprender/TextureCache.h
+///
+/// @author Jonathan Egstad
+
+
+#ifndef zprender_TextureCache_h
+#define zprender_TextureCache_h
+
+#include "api.h"
+
+#include <atomic>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+
+namespace zpr {
+
+
+/*! Fixed-size square block of texels from one mip level of a texture.
+    Texels are stored channel-interleaved so a single tile lookup
+    provides all the channels of a texel.
+*/
+struct ZPR_EXPORT TextureTile
+{
+    static const uint32_t SIZE = 64;    //!< Texel width/height of a tile
+
+    std::vector<float> texels;          //!< SIZE*SIZE*num_chans floats
+    uint32_t           num_chans;       //!< Number of interleaved channels per texel
+
+
+    TextureTile(uint32_t nChans) :
+        texels(SIZE*SIZE*nChans, 0.0f),
+        num_chans(nChans)
+    {
+        //
+    }
+
+    //! Pointer to the channels of texel x/y (tile-local coords).
+    const float* texel(uint32_t x, uint32_t y) const { return &texels[(y*SIZE + x)*num_chans]; }
+    float*       texel(uint32_t x, uint32_t y)       { return &texels[(y*SIZE + x)*num_chans]; }
+
+    //! Resident size in bytes.
+    size_t bytes() const { return sizeof(TextureTile) + texels.size()*sizeof(float); }
+};
+
+/*! Tiles are reference counted so that a sampler can safely keep
+    using a tile while another thread evicts it from the cache.
+*/
+typedef std::shared_ptr<TextureTile> TextureTileRef;
+
+
+/*! Process-wide cache of texture tiles shared by all Texture2dSamplers.
+
+    Tiles are identified by a texture id (built from the source Iop's
+    hash and channels, so unchanged textures stay resident between
+    renders), mip level, and tile x/y. Resident memory is bounded by a
+    budget, with the least-recently-used tiles evicted first.
+
+    The cache is split into shards with their own lock and LRU list to
+    keep render threads from contending on a single lock. Tile loading
+    happens outside of any lock, so if two threads miss the same tile
+    they both build it and the first one inserted wins.
+*/
+class ZPR_EXPORT TextureCache
+{
+  public:
+    /*! Counters to help size the memory budget. */
+    struct Stats
+    {
+        uint64_t hits;          //!< Tile lookups found resident
+        uint64_t misses;        //!< Tile lookups that needed a load
+        uint64_t evictions;     //!< Tiles evicted to stay within the budget
+        size_t   tiles;         //!< Currently resident tiles
+        size_t   bytes;         //!< Currently resident bytes
+        size_t   peak_bytes;    //!< High-water mark of resident bytes
+        size_t   max_bytes;     //!< Memory budget
+
+        Stats() : hits(0), misses(0), evictions(0), tiles(0), bytes(0), peak_bytes(0), max_bytes(0) {}
+    };
+
+
+  public:
+    //! Return the global cache instance.
+    static TextureCache& instance();
+
+    //! Set the memory budget in bytes, evicting tiles if it's now exceeded.
+    void   setMemoryLimit(size_t max_bytes);
+    size_t memoryLimit() const { return m_max_bytes; }
+
+    //! Return a tile if it's resident, updating its LRU position. Counts a hit or miss.
+    TextureTileRef find(uint64_t texture_id,
+                        uint32_t level,
+                        uint32_t tx,
+                        uint32_t ty);
+
+    /*! Add a tile built after a find() miss, evicting others if over budget.
+        If another thread inserted the same tile first that one is returned.
+    */
+    TextureTileRef insert(uint64_t              texture_id,
+                          uint32_t              level,
+                          uint32_t              tx,
+                          uint32_t              ty,
+                          const TextureTileRef& tile);
+
+    //! Release all tiles belonging to a texture.
+    void releaseTexture(uint64_t texture_id);
+
+    //! Release all tiles.
+    void clear();
+
+    //! Get the current counters.
+    Stats getStats() const;
+
+    //! Zero the hit/miss/eviction counters and peak size.
+    void resetStats();
+
+    //! Print the counters to a stream.
+    void printStats(const char* prefix, std::ostream&) const;
+
+
+  protected:
+    struct TileKey
+    {
+        uint64_t texture_id;
+        uint32_t level;
+        uint32_t tx, ty;
+
+        bool operator == (const TileKey& b) const
+        {
+            return (texture_id == b.texture_id && level == b.level && tx == b.tx && ty == b.ty);
+        }
+    };
+
+    struct TileKeyHash
+    {
+        size_t operator () (const TileKey& k) const
+        {
+            uint64_t h = k.texture_id ^ (uint64_t(k.level) << 56);
+            h ^= (uint64_t(k.tx) * 0x9e3779b97f4a7c15ull) ^ (uint64_t(k.ty) * 0xc2b2ae3d27d4eb4full);
+            return size_t(h ^ (h >> 29));
+        }
+    };
+
+    typedef std::list<TileKey> LRUList;
+
+    struct Entry
+    {
+        TextureTileRef    tile;
+        LRUList::iterator lru;          //!< Position in shard's LRU list, front is most recent
+    };
+
+    typedef std::unordered_map<TileKey, Entry, TileKeyHash> TileMap;
+
+    struct Shard
+    {
+        std::mutex lock;
+        TileMap    tiles;
+        LRUList    lru;
+        size_t     bytes;
+
+        Shard() : bytes(0) {}
+    };
+
+    enum { NUM_SHARDS = 16 };
+
+    Shard                 m_shards[NUM_SHARDS];
+    std::atomic<size_t>   m_max_bytes;          //!< Budget across all shards
+    std::atomic<size_t>   m_bytes;              //!< Resident bytes across all shards
+    std::atomic<size_t>   m_peak_bytes;
+    std::atomic<uint64_t> m_hits;
+    std::atomic<uint64_t> m_misses;
+    std::atomic<uint64_t> m_evictions;
+
+
+    //!
+    TextureCache();
+
+    //!
+    Shard& shardFor(const TileKey& key) { return m_shards[TileKeyHash()(key) % NUM_SHARDS]; }
+
+    //! Evict LRU tiles from a locked shard until it's within its share of the budget.
+    void evictLocked(Shard& shard);
+
+
+  private:
+    TextureCache(const TextureCache&);
+    TextureCache& operator = (const TextureCache&);
+};
+
+
+} // namespace zpr
+
+#endif
+
+// end of zprender/TextureCache.h
+
+//
+// Copyright 2020 DreamWorks Animation
+//
@@ -30,7 +30,9 @@
 #ifndef zprender_ThreadContext_h
 #define zprender_ThreadContext_h
 
+#include "LightSampler.h"
 #include "RayShaderContext.h"
+#include "RenderStats.h"
 #include "Scene.h"
 #include "Texture2dSampler.h"
 #include "Traceable.h" // for SurfaceIntersectionList
@@ -110,6 +112,10 @@ class ZPR_EXPORT ThreadContext
     // For passing to light shading methods:
     Fsr::RayContext Rlight;         //!< Ray from surface to light, filled in by LightShader::illuminate()
     float           direct_pdfW;    //!< Power distribution function weight, filled in by LightShader::illuminate()
+    LightSampleList light_samples;  //!< Lights selected for the current shading point, filled in by LightSampler
+
+    // Merged into the RenderContext's totals at the end of the render:
+    RenderStats     stats;          //!< Ray, Bvh and shading counters for this thread
 
 
   public:
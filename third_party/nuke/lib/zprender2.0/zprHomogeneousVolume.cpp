@@ -475,7 +475,7 @@ zprHomogeneousVolume::volumeMarch(zpr::RayShaderContext&                stx,
 
             Fsr::RayContext Rlight; // ray from volume point to light, for shadowing, etc.
             float direct_pdfW;
-            if (!lt_material->getLightShader()->illuminate(stx, Rlight, direct_pdfW, lt_color))
+            if (!lt_material->illuminate(stx, Rlight, direct_pdfW, lt_color))
                 continue; // not affecting this point in space
 
             lt_color.rgb() *= direct_pdfW;
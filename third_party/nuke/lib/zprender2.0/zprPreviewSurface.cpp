@@ -341,19 +341,29 @@ zprPreviewSurface::evaluateLights(RayShaderContext& stx,
     Fsr::Pixel& lt_color = stx.thread_ctx->illum_color;
     //lt_color.setChannels(DD::Image::Mask_RGB);
 
-    const uint32_t nLights = (uint32_t)stx.master_light_materials->size();
+    // Get the lights to shade with, either all of them or an importance-sampled
+    // subset weighted to compensate for the lights not chosen:
+    LightSampleList& light_samples = stx.thread_ctx->light_samples;
+    stx.rtx->light_sampler.selectLights(*stx.master_light_materials,
+                                        stx.PW,
+                                        &stx.Nf,
+                                        (uint32_t)std::max(0, stx.rtx->k_light_samples),
+                                        LightSampler::getSeed(stx),
+                                        light_samples);
+
+    const uint32_t nLights = (uint32_t)light_samples.size();
     for (uint32_t i=0; i < nLights; ++i)
     {
-        LightMaterial* lt_material = (*stx.master_light_materials)[i];
+        LightMaterial* lt_material = light_samples[i].light_material;
         if (!lt_material || !lt_material->getLightShader())
             continue;
 
         Fsr::RayContext Rlight; // ray from surface to light, for shadowing, etc.
         float direct_pdfW;
-        if (!lt_material->getLightShader()->illuminate(stx, Rlight, direct_pdfW, lt_color))
+        if (!lt_material->illuminate(stx, Rlight, direct_pdfW, lt_color))
             continue; // not affecting this surface
 
-        lt_color.rgb() *= direct_pdfW;
+        lt_color.rgb() *= direct_pdfW*light_samples[i].weight;
         if (lt_color.rgb().isZero())
             continue;
 
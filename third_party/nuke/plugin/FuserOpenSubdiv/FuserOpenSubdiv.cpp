@@ -33,6 +33,14 @@
 #include <Fuser/ExecuteTargetContexts.h> // for MeshTessellateContext
 
 //#include <DDImage/PrimitiveContext.h>
+#include <DDImage/Thread.h>
+
+#include <algorithm>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 
 
 #if __GNUC__ < 4 || (__GNUC__ == 4 && __GNUC_MINOR__ < 8)
@@ -43,6 +51,8 @@
 
 #  include <opensubdiv/far/topologyDescriptor.h>
 #  include <opensubdiv/far/primvarRefiner.h>
+#  include <opensubdiv/far/stencilTable.h>
+#  include <opensubdiv/far/stencilTableFactory.h>
 
 #  pragma GCC diagnostic pop
 #endif
@@ -111,6 +121,246 @@ class OsdVec4f : public Fsr::Vec4f
 //----------------------------------------------------------------------------------
 
 
+/*! The refined topology of a control mesh, reduced to what's needed to
+    subdivide new point and primvar values without re-running the refiner.
+
+    The stencil tables map the control values straight to the final refinement
+    level. Face-varying values are always vertex-rate with identical indices
+    so a single fvar stencil table applies to every primvar.
+*/
+struct SubdTopology
+{
+    std::unique_ptr<const OpenSubdiv::Far::StencilTable> point_stencils; //!< Control points -> final level points
+    std::unique_ptr<const OpenSubdiv::Far::StencilTable> fvar_stencils;  //!< Control verts -> final level fvars, NULL if no fvars
+
+    int32_t  nSrcPoints, nSrcVerts, nSrcFaces;  //!< Control mesh counts, to sanity check hash hits
+    int32_t  nLevelFaces;                       //!< Final level face count
+    int32_t  nLevelPoints;                      //!< Final level point count
+    int32_t  nLevelFVars;                       //!< Final level fvar value count
+    uint32_t nFaceVerts;                        //!< Verts per refined face - 4 for quads, 3 for tris
+
+    std::vector<int32_t> face_point_indices;    //!< Final level per face-vert point index
+    std::vector<int32_t> face_fvar_indices;     //!< Final level per face-vert fvar value index
+
+    //! Approximate resident size in bytes.
+    size_t bytes() const
+    {
+        size_t b = sizeof(SubdTopology) + (face_point_indices.size() + face_fvar_indices.size())*sizeof(int32_t);
+        const OpenSubdiv::Far::StencilTable* tables[2] = { point_stencils.get(), fvar_stencils.get() };
+        for (int i=0; i < 2; ++i)
+        {
+            if (!tables[i])
+                continue;
+            b += (tables[i]->GetSizes().size()          +
+                  tables[i]->GetOffsets().size()        +
+                  tables[i]->GetControlIndices().size() +
+                  tables[i]->GetWeights().size())*4;
+        }
+        return b;
+    }
+};
+
+typedef std::shared_ptr<const SubdTopology> SubdTopologyRef;
+
+
+/*! Process-wide cache of SubdTopology keyed by a hash of the control mesh
+    topology and subdivision options, so animated meshes only pay for the
+    topology analysis on the first frame.
+
+    Resident memory is bounded by a budget with the least-recently-used
+    entries evicted first. Topologies are built outside the lock, so if two
+    threads miss the same key they both build it and the first one inserted
+    wins.
+*/
+class SubdTopologyCache
+{
+  public:
+    //! Return the global cache instance.
+    static SubdTopologyCache& instance()
+    {
+        static SubdTopologyCache cache;
+        return cache;
+    }
+
+    //! Return a topology if it's resident, updating its LRU position.
+    SubdTopologyRef find(Fsr::HashValue key)
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        EntryMap::iterator it = m_entries.find(key);
+        if (it == m_entries.end())
+        {
+            ++m_misses;
+            return SubdTopologyRef();
+        }
+        m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+        ++m_hits;
+        return it->second.topology;
+    }
+
+    /*! Add a topology built after a find() miss, evicting others until the
+        cache is within max_bytes. If another thread inserted the same key
+        first that one is returned.
+    */
+    SubdTopologyRef insert(Fsr::HashValue         key,
+                           const SubdTopologyRef& topology,
+                           size_t                 max_bytes)
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        EntryMap::iterator it = m_entries.find(key);
+        if (it != m_entries.end())
+            return it->second.topology; // another thread beat us to it
+
+        m_lru.push_front(key);
+        Entry& entry = m_entries[key];
+        entry.topology = topology;
+        entry.bytes    = topology->bytes();
+        entry.lru      = m_lru.begin();
+        m_bytes += entry.bytes;
+
+        // The most recent entry is never evicted so it's always usable:
+        while (m_bytes > max_bytes && m_lru.size() > 1)
+        {
+            EntryMap::iterator eit = m_entries.find(m_lru.back());
+            m_bytes -= eit->second.bytes;
+            m_entries.erase(eit);
+            m_lru.pop_back();
+            ++m_evictions;
+        }
+
+        return topology;
+    }
+
+    //! Print the counters to a stream.
+    void printStats(const char* prefix, std::ostream& o)
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        o << prefix << "topology cache:";
+        o << " hits=" << m_hits << " misses=" << m_misses;
+        o << " evictions=" << m_evictions;
+        o << " entries=" << m_entries.size();
+        o << " resident=" << double(m_bytes)/(1024.0*1024.0) << "MB";
+        o << std::endl;
+    }
+
+
+  protected:
+    struct Entry
+    {
+        SubdTopologyRef                     topology;
+        size_t                              bytes;
+        std::list<Fsr::HashValue>::iterator lru;    //!< Position in LRU list, front is most recent
+    };
+    typedef std::unordered_map<Fsr::HashValue, Entry> EntryMap;
+
+    std::mutex                m_lock;
+    EntryMap                  m_entries;
+    std::list<Fsr::HashValue> m_lru;
+    size_t                    m_bytes;
+    uint64_t                  m_hits;
+    uint64_t                  m_misses;
+    uint64_t                  m_evictions;
+
+
+    SubdTopologyCache() : m_bytes(0), m_hits(0), m_misses(0), m_evictions(0) {}
+};
+
+
+//----------------------------------------------------------------------------------
+
+
+/*! A range of stencils to apply to one primvar buffer.
+    Stencil tables are applied in chunks so large meshes are
+    spread across threads.
+*/
+struct StencilTask
+{
+    const OpenSubdiv::Far::StencilTable* stencils;
+    const void*                          src;
+    void*                                dst;
+    int                                  start, end;
+    void (*apply)(const StencilTask&);
+};
+
+//! Apply a StencilTask's stencils to Osd-wrapped values of type T.
+template<class T>
+static void applyStencilTask(const StencilTask& task)
+{
+    task.stencils->UpdateValues(reinterpret_cast<const T*>(task.src),
+                                reinterpret_cast<T*>(task.dst),
+                                task.start,
+                                task.end);
+}
+
+//! Split a stencil table into tasks for a primvar buffer of type T.
+template<class T>
+static void addStencilTasks(std::vector<StencilTask>&            tasks,
+                            const OpenSubdiv::Far::StencilTable* stencils,
+                            const void*                          src,
+                            void*                                dst)
+{
+    static const int chunk_size = 16384;
+    const int nStencils = stencils->GetNumStencils();
+    for (int start=0; start < nStencils; start += chunk_size)
+    {
+        StencilTask task;
+        task.stencils = stencils;
+        task.src      = src;
+        task.dst      = dst;
+        task.start    = start;
+        task.end      = std::min(start + chunk_size, nStencils);
+        task.apply    = applyStencilTask<T>;
+        tasks.push_back(task);
+    }
+}
+
+struct StencilThreadContext
+{
+    const std::vector<StencilTask>* tasks;
+    std::atomic<size_t>             next;   //!< Next task to claim
+};
+
+/*! DD::Image::Thread spawn callback function to apply stencil tasks.
+    Each thread grabs the next available task, leapfrog-like.
+*/
+static void stencil_thread_cb(unsigned thread_index, unsigned num_threads, void* p)
+{
+    StencilThreadContext* ctx = reinterpret_cast<StencilThreadContext*>(p);
+    const std::vector<StencilTask>& tasks = *ctx->tasks;
+    while (1)
+    {
+        const size_t i = ctx->next++;
+        if (i >= tasks.size())
+            return; // all done, bail
+        tasks[i].apply(tasks[i]);
+    }
+}
+
+//! Apply all the stencil tasks, multi-threaded if there's more than one.
+static void applyStencilTasks(const std::vector<StencilTask>& tasks)
+{
+    StencilThreadContext ctx;
+    ctx.tasks = &tasks;
+    ctx.next  = 0;
+
+    const unsigned num_threads = std::min((unsigned)DD::Image::Thread::numThreads, (unsigned)tasks.size());
+    if (num_threads <= 1)
+    {
+        stencil_thread_cb(0/*thread_index*/, 0/*num_threads*/, &ctx);
+    }
+    else
+    {
+        // Spawn multiple threads (minus one for this thread to directly execute,) then wait for them to finish:
+        DD::Image::Thread::spawn(stencil_thread_cb, num_threads-1, &ctx);
+        stencil_thread_cb(num_threads-1/*thread_index*/, num_threads/*num_threads*/, &ctx);
+        DD::Image::Thread::wait(&ctx);
+    }
+}
+
+
+//----------------------------------------------------------------------------------
+//----------------------------------------------------------------------------------
+
+
 /*! 
 */
 class FuserOpenSubdiv : public Fsr::Node
@@ -205,11 +455,26 @@ class FuserOpenSubdiv : public Fsr::Node
     }
 
 
-    //! Return the appropriate refiner object for the given arguments and topology descriptor.
+    /*! Return the appropriate refiner object for the given arguments and topology descriptor.
+        Caller takes ownership.
+    */
     OpenSubdiv::Far::TopologyRefiner* getRefiner(const Fsr::ArgSet&                         exec_args,
                                                  int32_t                                    nRefinementLevels,
                                                  const OpenSubdiv::Far::TopologyDescriptor& desc);
 
+    /*! Return the refined topology for a control mesh, from the topology cache
+        if possible, otherwise refining it and building the stencil tables.
+        Fvar stencils are only built if with_fvars is true.
+    */
+    SubdTopologyRef getTopology(const Fsr::ArgSet& exec_args,
+                                int32_t            nRefinementLevels,
+                                int32_t            nSrcPoints,
+                                int32_t            nSrcFaces,
+                                const uint32_t*    verts_per_face,
+                                int32_t            nSrcVerts,
+                                const uint32_t*    vert_position_indices,
+                                bool               with_fvars);
+
 
     //!
     void subdivideGenericMesh(const Fsr::ArgSet&          exec_args,
@@ -225,6 +490,40 @@ class FuserOpenSubdiv : public Fsr::Node
 //-------------------------------------------------------------------------
 
 
+/*! Return the subdivision scheme from the args, defaulting to Catmull-Clark.
+*/
+static OpenSubdiv::Sdc::SchemeType
+getSchemeType(const Fsr::ArgSet& exec_args)
+{
+    const std::string scheme = exec_args.getString("subd:scheme", "catmullclark"/*default*/);
+    if      (scheme == "catmullclark") return OpenSubdiv::Sdc::SCHEME_CATMARK;
+    else if (scheme == "loop"        ) return OpenSubdiv::Sdc::SCHEME_LOOP;
+    else if (scheme == "bilinear"    ) return OpenSubdiv::Sdc::SCHEME_BILINEAR;
+
+    // TODO: throw unrecognized-scheme warning
+    return OpenSubdiv::Sdc::SCHEME_CATMARK;
+}
+
+
+/*! Copy refined fvar values out to vertex rate using the final level
+    face-vert fvar indices.
+*/
+template<class T>
+static void
+flattenFVars(const std::vector<T>&       src,
+             const std::vector<int32_t>& face_fvar_indices,
+             std::vector<T>&             dst)
+{
+    const size_t nVerts = face_fvar_indices.size();
+    dst.resize(nVerts);
+    for (size_t v=0; v < nVerts; ++v)
+        dst[v] = src[face_fvar_indices[v]];
+}
+
+
+//-------------------------------------------------------------------------
+
+
 /*! Return the appropriate refiner object for the given arguments.
 */
 OpenSubdiv::Far::TopologyRefiner*
@@ -232,16 +531,7 @@ FuserOpenSubdiv::getRefiner(const Fsr::ArgSet&                         exec_args
                             int32_t                                    nRefinementLevels,
                             const OpenSubdiv::Far::TopologyDescriptor& desc)
 {
-    const std::string scheme = exec_args.getString("subd:scheme", "catmullclark"/*default*/);
-    OpenSubdiv::Sdc::SchemeType type;
-    if      (scheme == "catmullclark") type = OpenSubdiv::Sdc::SCHEME_CATMARK;
-    else if (scheme == "loop"        ) type = OpenSubdiv::Sdc::SCHEME_LOOP;
-    else if (scheme == "bilinear"    ) type = OpenSubdiv::Sdc::SCHEME_BILINEAR;
-    else
-    {
-        // TODO: throw unrecognized-scheme warning
-        type = OpenSubdiv::Sdc::SCHEME_CATMARK;
-    }
+    const OpenSubdiv::Sdc::SchemeType type = getSchemeType(exec_args);
 
     // TODO: these are set to DWA defaults, also check primvars copied in from file meshes:
     OpenSubdiv::Sdc::Options options;
@@ -284,6 +574,146 @@ FuserOpenSubdiv::getRefiner(const Fsr::ArgSet&                         exec_args
 }
 
 
+/*! The cache key is a hash of everything that affects the refined topology -
+    the face counts and point indices, the scheme and the number of levels.
+    Creases and the Sdc options aren't passed in yet so they're constant.
+
+    Cache size is controlled by the 'subd:topology_cache_mb' arg, 0 disables it.
+*/
+SubdTopologyRef
+FuserOpenSubdiv::getTopology(const Fsr::ArgSet& exec_args,
+                             int32_t            nRefinementLevels,
+                             int32_t            nSrcPoints,
+                             int32_t            nSrcFaces,
+                             const uint32_t*    verts_per_face,
+                             int32_t            nSrcVerts,
+                             const uint32_t*    vert_position_indices,
+                             bool               with_fvars)
+{
+    const int32_t cache_mb = exec_args.getInt("subd:topology_cache_mb", 512/*default*/);
+    const size_t  max_bytes = size_t(std::max(0, cache_mb))*1024*1024;
+
+    DD::Image::Hash hash;
+    hash.append((int)getSchemeType(exec_args));
+    hash.append(nRefinementLevels);
+    hash.append(nSrcPoints);
+    hash.append(nSrcFaces);
+    hash.append(nSrcVerts);
+    hash.append(with_fvars);
+    hash.append(verts_per_face,        nSrcFaces*sizeof(uint32_t));
+    hash.append(vert_position_indices, nSrcVerts*sizeof(uint32_t));
+    const Fsr::HashValue key = hash.value();
+
+    SubdTopologyCache& cache = SubdTopologyCache::instance();
+    bool use_cache = (max_bytes > 0);
+    if (use_cache)
+    {
+        SubdTopologyRef topology = cache.find(key);
+        if (topology)
+        {
+            // Double-check the counts in case of a hash collision:
+            if (topology->nSrcPoints == nSrcPoints &&
+                topology->nSrcFaces  == nSrcFaces  &&
+                topology->nSrcVerts  == nSrcVerts  &&
+                (topology->fvar_stencils != NULL) == with_fvars)
+                return topology;
+            use_cache = false; // collision, don't replace the cached one
+        }
+    }
+
+    // Attribs are already expanded to vertex rate so the primvar index arrays
+    // all point at the same identity indice array, which means they all refine
+    // identically and only one fvar channel is needed:
+    std::vector<int32_t> fvarIndices;
+    OpenSubdiv::Far::TopologyDescriptor::FVarChannel primvar_channel;
+    if (with_fvars)
+    {
+        fvarIndices.resize(nSrcVerts);
+        for (int32_t i=0; i < nSrcVerts; ++i)
+            fvarIndices[i] = i;
+        primvar_channel.numValues    = nSrcVerts;
+        primvar_channel.valueIndices = fvarIndices.data();
+    }
+
+    OpenSubdiv::Far::TopologyDescriptor desc;
+    desc.numVertices        = nSrcPoints; // points count, not verts!
+    desc.numFaces           = nSrcFaces;
+    desc.numVertsPerFace    = reinterpret_cast<const int32_t*>(verts_per_face);
+    desc.vertIndicesPerFace = reinterpret_cast<const int32_t*>(vert_position_indices); // at per-vert rate, not per-face!!!!
+    //
+    desc.numFVarChannels    = (with_fvars) ? 1 : 0;
+    desc.fvarChannels       = (with_fvars) ? &primvar_channel : NULL;
+
+    // Create a FarTopologyRefiner from the descriptor, it's only needed
+    // until the stencils and final level indices are extracted:
+    std::unique_ptr<OpenSubdiv::Far::TopologyRefiner> refiner(getRefiner(exec_args, nRefinementLevels, desc));
+
+    std::shared_ptr<SubdTopology> topology(new SubdTopology);
+    topology->nSrcPoints = nSrcPoints;
+    topology->nSrcVerts  = nSrcVerts;
+    topology->nSrcFaces  = nSrcFaces;
+
+    // Stencils go straight from the control values to the final level,
+    // with offsets so they can be applied in ranges:
+    OpenSubdiv::Far::StencilTableFactory::Options stencil_options;
+    stencil_options.generateIntermediateLevels = false;
+    stencil_options.generateOffsets            = true;
+    stencil_options.interpolationMode          = OpenSubdiv::Far::StencilTableFactory::INTERPOLATE_VERTEX;
+    topology->point_stencils.reset(OpenSubdiv::Far::StencilTableFactory::Create(*refiner, stencil_options));
+    if (with_fvars)
+    {
+        stencil_options.interpolationMode = OpenSubdiv::Far::StencilTableFactory::INTERPOLATE_FACE_VARYING;
+        stencil_options.fvarChannel       = 0;
+        topology->fvar_stencils.reset(OpenSubdiv::Far::StencilTableFactory::Create(*refiner, stencil_options));
+    }
+
+    // Extract the final level's face-vert indices:
+    const OpenSubdiv::Far::TopologyLevel& refLastLevel = refiner->GetLevel(nRefinementLevels);
+    topology->nLevelFaces  = refLastLevel.GetNumFaces();
+    topology->nLevelPoints = refLastLevel.GetNumVertices();
+    topology->nLevelFVars  = (with_fvars) ? refLastLevel.GetNumFVarValues(0/*fvarChannelIdx*/) : 0;
+    topology->nFaceVerts   = (refiner->GetSchemeType() == OpenSubdiv::Sdc::SCHEME_LOOP) ? 3 : 4;
+#if DEBUG
+    assert(topology->point_stencils->GetNumStencils() == topology->nLevelPoints);
+    assert(!with_fvars || topology->fvar_stencils->GetNumStencils() == topology->nLevelFVars);
+#endif
+
+    const uint32_t nFaceVerts  = topology->nFaceVerts;
+    const size_t   nLevelVerts = size_t(topology->nLevelFaces)*nFaceVerts;
+    topology->face_point_indices.resize(nLevelVerts);
+    if (with_fvars)
+        topology->face_fvar_indices.resize(nLevelVerts);
+
+    size_t face_vert_start = 0; // global vert count
+    for (int32_t f=0; f < topology->nLevelFaces; ++f)
+    {
+        const OpenSubdiv::Far::ConstIndexArray fPidx = refLastLevel.GetFaceVertices(f);
+#if DEBUG
+        assert(fPidx.size() == nFaceVerts); // all refined faces should be same
+#endif
+        for (uint32_t v=0; v < nFaceVerts; ++v)
+            topology->face_point_indices[face_vert_start+v] = fPidx[v];
+
+        if (with_fvars)
+        {
+            const OpenSubdiv::Far::ConstIndexArray fFVidx = refLastLevel.GetFaceFVarValues(f, 0/*fvarChannelIdx*/);
+            for (uint32_t v=0; v < nFaceVerts; ++v)
+                topology->face_fvar_indices[face_vert_start+v] = fFVidx[v];
+        }
+
+        face_vert_start += nFaceVerts;
+    }
+
+    if (!use_cache)
+        return topology;
+
+    SubdTopologyRef cached = cache.insert(key, topology, max_bytes);
+    if (debug())
+        cache.printStats("FuserOpenSubdiv: ", std::cout);
+    return cached;
+}
+
+
 //!
 void
 FuserOpenSubdiv::subdivideGenericMesh(const Fsr::ArgSet&          exec_args,
@@ -342,84 +772,59 @@ FuserOpenSubdiv::subdivideGenericMesh(const Fsr::ArgSet&          exec_args,
     if (nRefinementLevels <= 0)
         return; // no need to further subdivide
 
-    // Attribs are already expanded to vertex rate so the primvar index arrays
-    // will all point at the same indice array:
-    std::vector<int32_t> fvarIndices(nSrcVerts);
-    for (int32_t i=0; i < nSrcVerts; ++i)
-        fvarIndices[i] = i;
-
-    // Get number of Fvars and set up channel list:
+    // Get number of Fvars:
     const int32_t nFvarChans = (int32_t)(tess_ctx.vert_float_attribs.size() +
                                          tess_ctx.vert_vec2_attribs.size()  +
                                          tess_ctx.vert_vec3_attribs.size()  +
                                          tess_ctx.vert_vec4_attribs.size());
 
-    OpenSubdiv::Far::TopologyDescriptor::FVarChannel primvar_channels[nFvarChans];
-    for (size_t i=0; i < nFvarChans; ++i)
-    {
-        primvar_channels[i].numValues    = nSrcVerts;
-        primvar_channels[i].valueIndices = fvarIndices.data();
-    }
-
-    OpenSubdiv::Far::TopologyDescriptor desc;
-    desc.numVertices        = nSrcPoints; // points count, not verts!
-    desc.numFaces           = nSrcFaces;
-    desc.numVertsPerFace    = reinterpret_cast<const int32_t*>(tess_ctx.verts_per_face->data());
-    desc.vertIndicesPerFace = reinterpret_cast<const int32_t*>(tess_ctx.vert_position_indices->data()); // at per-vert rate, not per-face!!!!
-    //
-    desc.numFVarChannels    = nFvarChans;
-    desc.fvarChannels       = primvar_channels;
-
-    // Create a FarTopologyRefiner from the descriptor:
-    OpenSubdiv::Far::TopologyRefiner* refiner = getRefiner(exec_args, nRefinementLevels, desc);
-
-    OpenSubdiv::Far::PrimvarRefiner primvarRefiner(*refiner);
-    //const size_t nTotalRefinedFaces  = refiner->GetNumFacesTotal();
-    const size_t nTotalRefinedVerts  = (nFvarChans > 0) ?
-                                            refiner->GetNumFVarValuesTotal(0/*fvarChannelIdx*/) : 0;
-    const size_t nTotalRefinedPoints = refiner->GetNumVerticesTotal();
-    //std::cout << "    nTotalRefinedFaces=" << refiner->GetNumFacesTotal();
-    //std::cout << ", nTotalRefinedPoints=" << nTotalRefinedPoints;
-    //std::cout << ", nTotalRefinedVerts=" << nTotalRefinedVerts;
+    // Get the refined topology, hopefully from the cache:
+    const SubdTopologyRef topology = getTopology(exec_args,
+                                                 nRefinementLevels,
+                                                 nSrcPoints,
+                                                 nSrcFaces,
+                                                 tess_ctx.verts_per_face->data(),
+                                                 nSrcVerts,
+                                                 tess_ctx.vert_position_indices->data(),
+                                                 (nFvarChans > 0)/*with_fvars*/);
+    const int32_t nLevelPoints = topology->nLevelPoints;
+    const int32_t nLevelFVars  = topology->nLevelFVars;
+    //std::cout << "    final level " << current_subd_level+nRefinementLevels << ": nLevelFaces=" << topology->nLevelFaces;
+    //std::cout << ", nLevelPoints=" << nLevelPoints;
+    //std::cout << ", nLevelFVars=" << nLevelFVars;
     //std::cout << std::endl;
 
-    // Source pointer lists to swap during refinement loop:
-    // TODO: make a struct to hold these...
-    std::vector<OsdVec3f*> srcPositions(tess_ctx.position_lists.size());
-    std::vector<OsdFloat*> srcFloatAttribs(tess_ctx.vert_float_attribs.size());
-    std::vector<OsdVec2f*> srcVec2Attribs(tess_ctx.vert_vec2_attribs.size());
-    std::vector<OsdVec3f*> srcVec3Attribs(tess_ctx.vert_vec3_attribs.size());
-    std::vector<OsdVec4f*> srcVec4Attribs(tess_ctx.vert_vec4_attribs.size());
-    // Destination buffers to accommodate the new verts/points being added:
+    // Destination buffers to accommodate the final level verts/points:
     std::vector<Fsr::Vec3fList> refined_position_lists(tess_ctx.position_lists.size());       // point rate
-    std::vector<Fsr::FloatList> refined_vert_float_attribs(tess_ctx.vert_float_attribs.size()); // face-vertex rate
-    std::vector<Fsr::Vec2fList> refined_vert_vec2_attribs(tess_ctx.vert_vec2_attribs.size()); // face-vertex rate
-    std::vector<Fsr::Vec3fList> refined_vert_vec3_attribs(tess_ctx.vert_vec3_attribs.size()); // face-vertex rate
-    std::vector<Fsr::Vec4fList> refined_vert_vec4_attribs(tess_ctx.vert_vec4_attribs.size()); // face-vertex rate
+    std::vector<Fsr::FloatList> refined_vert_float_attribs(tess_ctx.vert_float_attribs.size()); // fvar rate
+    std::vector<Fsr::Vec2fList> refined_vert_vec2_attribs(tess_ctx.vert_vec2_attribs.size()); // fvar rate
+    std::vector<Fsr::Vec3fList> refined_vert_vec3_attribs(tess_ctx.vert_vec3_attribs.size()); // fvar rate
+    std::vector<Fsr::Vec4fList> refined_vert_vec4_attribs(tess_ctx.vert_vec4_attribs.size()); // fvar rate
 
-    //------------------------------------------
-    // Initialize positions buffers:
+    // Build the list of stencil tasks to refine everything in one parallel pass:
+    std::vector<StencilTask> tasks;
     for (size_t i=0; i < refined_position_lists.size(); ++i)
     {
 #if DEBUG
         assert(tess_ctx.position_lists[i] != NULL);
         assert(tess_ctx.position_lists[i]->size() == nSrcPoints);
 #endif
-        srcPositions[i] = reinterpret_cast<OsdVec3f*>(tess_ctx.position_lists[i]->data());
-        refined_position_lists[i].resize(nTotalRefinedPoints);
+        refined_position_lists[i].resize(nLevelPoints);
+        addStencilTasks<OsdVec3f>(tasks, topology->point_stencils.get(),
+                                  tess_ctx.position_lists[i]->data(), refined_position_lists[i].data());
     }
     if (nFvarChans > 0)
     {
-        //------------------------------------------
-        // Initialize fvars buffers:
+        const OpenSubdiv::Far::StencilTable* fvar_stencils = topology->fvar_stencils.get();
         for (size_t i=0; i < refined_vert_float_attribs.size(); ++i)
         {
 #if DEBUG
             assert(tess_ctx.vert_float_attribs[i] != NULL);
             assert(tess_ctx.vert_float_attribs[i]->size() == nSrcVerts);
 #endif
-            srcFloatAttribs[i] = reinterpret_cast<OsdFloat*>(tess_ctx.vert_float_attribs[i]->data());
-            refined_vert_float_attribs[i].resize(nTotalRefinedVerts);
+            refined_vert_float_attribs[i].resize(nLevelFVars);
+            addStencilTasks<OsdFloat>(tasks, fvar_stencils,
+                                      tess_ctx.vert_float_attribs[i]->data(), refined_vert_float_attribs[i].data());
         }
         for (size_t i=0; i < refined_vert_vec2_attribs.size(); ++i)
         {
@@ -427,8 +832,9 @@ FuserOpenSubdiv::subdivideGenericMesh(const Fsr::ArgSet&          exec_args,
             assert(tess_ctx.vert_vec2_attribs[i] != NULL);
             assert(tess_ctx.vert_vec2_attribs[i]->size() == nSrcVerts);
 #endif
-            srcVec2Attribs[i] = reinterpret_cast<OsdVec2f*>(tess_ctx.vert_vec2_attribs[i]->data());
-            refined_vert_vec2_attribs[i].resize(nTotalRefinedVerts);
+            refined_vert_vec2_attribs[i].resize(nLevelFVars);
+            addStencilTasks<OsdVec2f>(tasks, fvar_stencils,
+                                      tess_ctx.vert_vec2_attribs[i]->data(), refined_vert_vec2_attribs[i].data());
         }
         for (size_t i=0; i < refined_vert_vec3_attribs.size(); ++i)
         {
@@ -436,8 +842,9 @@ FuserOpenSubdiv::subdivideGenericMesh(const Fsr::ArgSet&          exec_args,
             assert(tess_ctx.vert_vec3_attribs[i] != NULL);
             assert(tess_ctx.vert_vec3_attribs[i]->size() == nSrcVerts);
 #endif
-            srcVec3Attribs[i] = reinterpret_cast<OsdVec3f*>(tess_ctx.vert_vec3_attribs[i]->data());
-            refined_vert_vec3_attribs[i].resize(nTotalRefinedVerts);
+            refined_vert_vec3_attribs[i].resize(nLevelFVars);
+            addStencilTasks<OsdVec3f>(tasks, fvar_stencils,
+                                      tess_ctx.vert_vec3_attribs[i]->data(), refined_vert_vec3_attribs[i].data());
         }
         for (size_t i=0; i < refined_vert_vec4_attribs.size(); ++i)
         {
@@ -445,197 +852,39 @@ FuserOpenSubdiv::subdivideGenericMesh(const Fsr::ArgSet&          exec_args,
             assert(tess_ctx.vert_vec4_attribs[i] != NULL);
             assert(tess_ctx.vert_vec4_attribs[i]->size() == nSrcVerts);
 #endif
-            srcVec4Attribs[i] = reinterpret_cast<OsdVec4f*>(tess_ctx.vert_vec4_attribs[i]->data());
-            refined_vert_vec4_attribs[i].resize(nTotalRefinedVerts);
+            refined_vert_vec4_attribs[i].resize(nLevelFVars);
+            addStencilTasks<OsdVec4f>(tasks, fvar_stencils,
+                                      tess_ctx.vert_vec4_attribs[i]->data(), refined_vert_vec4_attribs[i].data());
         }
     }
-
-    // Refine mesh attributes to desired level:
-    for (int srcLevel=0; srcLevel < nRefinementLevels; ++srcLevel)
-    {
-        const int dstLevel = (srcLevel + 1);
-        //std::cout << "       srcLevel " << srcLevel << " dstLevel " << dstLevel << std::endl;
-
-        //------------------------------------------
-        // Positions:
-        for (size_t i=0; i < refined_position_lists.size(); ++i)
-        {
-            OsdVec3f* dst = (srcLevel == 0) ?
-                                reinterpret_cast<OsdVec3f*>(refined_position_lists[i].data()) :
-                                srcPositions[i];
-            dst += refiner->GetLevel(srcLevel).GetNumVertices();
-            primvarRefiner.Interpolate(dstLevel, srcPositions[i], dst);
-            srcPositions[i] = dst;
-        }
-
-        if (nFvarChans > 0)
-        {
-            //------------------------------------------
-            // FVars:
-            uint32_t fvar_chan = 0;
-            for (size_t i=0; i < refined_vert_float_attribs.size(); ++i, ++fvar_chan)
-            {
-                const size_t nSrcFVars = refiner->GetLevel(srcLevel).GetNumFVarValues(fvar_chan);
-                OsdFloat* src = srcFloatAttribs[i];
-                OsdFloat* dst = ((srcLevel == 0) ?
-                                    reinterpret_cast<OsdFloat*>(refined_vert_float_attribs[i].data()) :
-                                    src) + nSrcFVars;
-                primvarRefiner.InterpolateFaceVarying(dstLevel, src, dst, fvar_chan);
-                srcFloatAttribs[i] = dst;
-            }
-            for (size_t i=0; i < refined_vert_vec2_attribs.size(); ++i, ++fvar_chan)
-            {
-                const size_t nSrcFVars = refiner->GetLevel(srcLevel).GetNumFVarValues(fvar_chan);
-                OsdVec2f* src = srcVec2Attribs[i];
-                OsdVec2f* dst = ((srcLevel == 0) ?
-                                    reinterpret_cast<OsdVec2f*>(refined_vert_vec2_attribs[i].data()) :
-                                    src) + nSrcFVars;
-                primvarRefiner.InterpolateFaceVarying(dstLevel, src, dst, fvar_chan);
-                srcVec2Attribs[i] = dst;
-            }
-            for (size_t i=0; i < refined_vert_vec3_attribs.size(); ++i, ++fvar_chan)
-            {
-                const size_t nSrcFVars = refiner->GetLevel(srcLevel).GetNumFVarValues(fvar_chan);
-                OsdVec3f* src = srcVec3Attribs[i];
-                OsdVec3f* dst = ((srcLevel == 0) ?
-                                    reinterpret_cast<OsdVec3f*>(refined_vert_vec3_attribs[i].data()) :
-                                    src) + nSrcFVars;
-                primvarRefiner.InterpolateFaceVarying(dstLevel, src, dst, fvar_chan);
-                srcVec3Attribs[i] = dst;
-            }
-            for (size_t i=0; i < refined_vert_vec4_attribs.size(); ++i, ++fvar_chan)
-            {
-                const size_t nSrcFVars = refiner->GetLevel(srcLevel).GetNumFVarValues(fvar_chan);
-                OsdVec4f* src = srcVec4Attribs[i];
-                OsdVec4f* dst = ((srcLevel == 0) ?
-                                    reinterpret_cast<OsdVec4f*>(refined_vert_vec4_attribs[i].data()) :
-                                    src) + nSrcFVars;
-                primvarRefiner.InterpolateFaceVarying(dstLevel, src, dst, fvar_chan);
-                srcVec4Attribs[i] = dst;
-            }
-        }
-    }
-
-    // Copy refined point/vert data.
-    // We need to expand out the point/vert indices back to the flattened point-rate/vertex-rate:
-    const OpenSubdiv::Far::TopologyLevel& refLastLevel = refiner->GetLevel(nRefinementLevels);
-
-    const int32_t nLevelFaces  = refLastLevel.GetNumFaces();
-    const int32_t nLevelVerts  = nLevelFaces*4; // always quads
-    const int32_t nLevelPoints = refLastLevel.GetNumVertices();
-    const int32_t nLevelFVars  = (nFvarChans > 0) ?
-                                    refLastLevel.GetNumFVarValues(0/*fvarChannelIdx*/) : 0;
-
-    // Gets the starting point & facevert index in the highest refinement level:
-    const int32_t levelPointsStart = (refiner->GetNumVerticesTotal() - nLevelPoints);
-    const int32_t levelFVarsStart  = (nFvarChans > 0) ?
-                                        (refiner->GetNumFVarValuesTotal(0/*fvarChannelIdx*/) - nLevelFVars) : 0;
-    //std::cout << "    final level " << current_subd_level+nRefinementLevels << ": nLevelFaces=" << nLevelFaces;
-    //std::cout << ", nLevelPoints=" << nLevelPoints;
-    //std::cout << ", nLevelFVars=" << nLevelFVars;
-    //std::cout << ", levelPointsStart=" << levelPointsStart;
-    //std::cout << ", levelFVarsStart=" << levelFVarsStart;
-    //std::cout << std::endl;
+    applyStencilTasks(tasks);
 
     // Point data is copied straight over:
-#if DEBUG
-    assert((levelPointsStart + nLevelPoints) <= nTotalRefinedPoints);
-#endif
     for (size_t i=0; i < tess_ctx.position_lists.size(); ++i)
-    {
-        tess_ctx.position_lists[i]->resize(nLevelPoints);
-        memcpy(tess_ctx.position_lists[i]->data(), refined_position_lists[i].data()+levelPointsStart, sizeof(Fsr::Vec3f)*nLevelPoints);
-    }
+        tess_ctx.position_lists[i]->swap(refined_position_lists[i]);
 
+    // Flatten-copy the primvar values back to the vert-rate buffers:
     if (nFvarChans > 0)
     {
+        const std::vector<int32_t>& face_fvar_indices = topology->face_fvar_indices;
         for (size_t i=0; i < tess_ctx.vert_float_attribs.size(); ++i)
-            tess_ctx.vert_float_attribs[i]->resize(nLevelVerts);
+            flattenFVars(refined_vert_float_attribs[i], face_fvar_indices, *tess_ctx.vert_float_attribs[i]);
         for (size_t i=0; i < tess_ctx.vert_vec2_attribs.size(); ++i)
-            tess_ctx.vert_vec2_attribs[i]->resize(nLevelVerts);
+            flattenFVars(refined_vert_vec2_attribs[i], face_fvar_indices, *tess_ctx.vert_vec2_attribs[i]);
         for (size_t i=0; i < tess_ctx.vert_vec3_attribs.size(); ++i)
-            tess_ctx.vert_vec3_attribs[i]->resize(nLevelVerts);
+            flattenFVars(refined_vert_vec3_attribs[i], face_fvar_indices, *tess_ctx.vert_vec3_attribs[i]);
         for (size_t i=0; i < tess_ctx.vert_vec4_attribs.size(); ++i)
-            tess_ctx.vert_vec4_attribs[i]->resize(nLevelVerts);
-    }
-
-    // 
-
-    tess_ctx.all_quads = false;
-    tess_ctx.all_tris  = false;
-
-    uint32_t nFaceVerts;
-    switch (refiner->GetSchemeType())
-    {
-        default:
-        case OpenSubdiv::Sdc::SCHEME_CATMARK:  nFaceVerts = 4; tess_ctx.all_quads = true; break;
-        case OpenSubdiv::Sdc::SCHEME_LOOP:     nFaceVerts = 3; tess_ctx.all_tris  = true; break;
-        case OpenSubdiv::Sdc::SCHEME_BILINEAR: nFaceVerts = 4; tess_ctx.all_quads = true; break;
+            flattenFVars(refined_vert_vec4_attribs[i], face_fvar_indices, *tess_ctx.vert_vec4_attribs[i]);
     }
 
-    // Face-vert attrib data needs to be de-referenced via face indices:
-    tess_ctx.verts_per_face->resize(nLevelFaces);
-    tess_ctx.vert_position_indices->resize(nLevelVerts);
+    // Refined faces all have the same vert count:
+    const uint32_t nFaceVerts = topology->nFaceVerts;
+    tess_ctx.all_quads = (nFaceVerts == 4);
+    tess_ctx.all_tris  = (nFaceVerts == 3);
 
-    uint32_t face_vert_start = 0; // global vert count
-    for (int32_t f=0; f < nLevelFaces; ++f)
-    {
-        const OpenSubdiv::Far::ConstIndexArray facevert_position_indices = refLastLevel.GetFaceVertices(f);
-
-#if DEBUG
-        assert(facevert_position_indices.size() == nFaceVerts); // all refined faces should be same
-#endif
-        (*tess_ctx.verts_per_face)[f] = nFaceVerts; // refined face vert count
-
-        for (uint32_t v=0; v < nFaceVerts; ++v)
-            (*tess_ctx.vert_position_indices)[face_vert_start+v] = facevert_position_indices[v];
-
-        // Flatten-copy the primvar values back the vert-rate buffers:
-        if (nFvarChans > 0)
-        {
-            //------------------------------------------
-            // FVars:
-            uint32_t fvar_chan = 0;
-            for (size_t i=0; i < tess_ctx.vert_float_attribs.size(); ++i, ++fvar_chan)
-            {
-                const OpenSubdiv::Far::ConstIndexArray face_fvar_indices = refLastLevel.GetFaceFVarValues(f, fvar_chan);
-                //
-                const float* src = refined_vert_float_attribs[i].data()   + levelFVarsStart;
-                float*       dst = tess_ctx.vert_float_attribs[i]->data() + face_vert_start;
-                for (int v=0; v < nFaceVerts; ++v)
-                    *dst++ = src[face_fvar_indices[v]];
-            }
-            for (size_t i=0; i < tess_ctx.vert_vec2_attribs.size(); ++i, ++fvar_chan)
-            {
-                const OpenSubdiv::Far::ConstIndexArray face_fvar_indices = refLastLevel.GetFaceFVarValues(f, fvar_chan);
-                //
-                const Fsr::Vec2f* src = refined_vert_vec2_attribs[i].data()   + levelFVarsStart;
-                Fsr::Vec2f*       dst = tess_ctx.vert_vec2_attribs[i]->data() + face_vert_start;
-                for (int v=0; v < nFaceVerts; ++v)
-                    *dst++ = src[face_fvar_indices[v]];
-            }
-            for (size_t i=0; i < tess_ctx.vert_vec3_attribs.size(); ++i, ++fvar_chan)
-            {
-                const OpenSubdiv::Far::ConstIndexArray face_fvar_indices = refLastLevel.GetFaceFVarValues(f, fvar_chan);
-                //
-                const Fsr::Vec3f* src = refined_vert_vec3_attribs[i].data()   + levelFVarsStart;
-                Fsr::Vec3f*       dst = tess_ctx.vert_vec3_attribs[i]->data() + face_vert_start;
-                for (int v=0; v < nFaceVerts; ++v)
-                    *dst++ = src[face_fvar_indices[v]];
-            }
-            for (size_t i=0; i < tess_ctx.vert_vec4_attribs.size(); ++i, ++fvar_chan)
-            {
-                const OpenSubdiv::Far::ConstIndexArray face_fvar_indices = refLastLevel.GetFaceFVarValues(f, fvar_chan);
-                //
-                const Fsr::Vec4f* src = refined_vert_vec4_attribs[i].data()   + levelFVarsStart;
-                Fsr::Vec4f*       dst = tess_ctx.vert_vec4_attribs[i]->data() + face_vert_start;
-                for (int v=0; v < nFaceVerts; ++v)
-                    *dst++ = src[face_fvar_indices[v]];
-            }
-        }
-
-        face_vert_start += nFaceVerts;
-    }
+    tess_ctx.verts_per_face->assign(topology->nLevelFaces, nFaceVerts);
+    tess_ctx.vert_position_indices->assign(topology->face_point_indices.begin(),
+                                           topology->face_point_indices.end());
 
 }
 
@@ -666,138 +915,66 @@ FuserOpenSubdiv::subdivideVertexBuffer(const Fsr::ArgSet&
     if (nRefinementLevels <= 0)
         return; // no need to further subdivide
 
-    // VertexBuffers are already expanded to vertex rate (point-rate attribs are promoted
-    // to vertex-rate) so the primvar index arrays will all point at the same array:
-    std::vector<int32_t> fvarIndices(nSrcVerts);
-    for (int32_t i=0; i < nSrcVerts; ++i)
-        fvarIndices[i] = i;
-
-    // MUST HAVE AT LEAST ONE FVAR SO WE CAN SIZE THE VERTEX-RATE ARRAYS!
-    // vbuffer.Pidx is guaranteed to be the vertex-rate count, but after
-    // refinement we need to use one of the fvar channels to find the
-    // new vertex count since the point count will no longer match.
-    // Always enable UV fvar even if it's filled with zeros.
-
-    const int32_t nFvarChans = 1 + 1;
-    const int32_t uv_fvar_chan = 0; // TODO: this may be empty, handle this!
-    const int32_t Cf_fvar_chan = 1; // TODO: this may be empty, handle this!
-
-    OpenSubdiv::Far::TopologyDescriptor::FVarChannel primvar_channels[nFvarChans];
+    // All-tris/all-quads mode leaves vertsPerFace empty, but the
+    // topology descriptor needs a count per face:
+    Fsr::Uint32List uniform_verts_per_face;
+    const uint32_t* verts_per_face = vbuffers.vertsPerFace.data();
+    if (vbuffers.allTris || vbuffers.allQuads)
     {
-        // TODO: support more than just UV/Cf primvars? Probably not for ScanlineRender.
-        primvar_channels[uv_fvar_chan].numValues    = nSrcVerts;
-        primvar_channels[uv_fvar_chan].valueIndices = fvarIndices.data();
-        primvar_channels[Cf_fvar_chan].numValues    = nSrcVerts;
-        primvar_channels[Cf_fvar_chan].valueIndices = fvarIndices.data();
+        uniform_verts_per_face.resize(nSrcFaces, (vbuffers.allTris) ? 3 : 4);
+        verts_per_face = uniform_verts_per_face.data();
     }
 
-    OpenSubdiv::Far::TopologyDescriptor desc;
-    desc.numVertices        = nSrcPoints; // points count, not verts!
-    desc.numFaces           = nSrcFaces;
-    desc.numVertsPerFace    = reinterpret_cast<const int32_t*>(vbuffers.vertsPerFace.data());
-    desc.vertIndicesPerFace = reinterpret_cast<const int32_t*>(vbuffers.Pidx.data()); // at per-vert rate, not per-face!!!!
-    //
-    desc.numFVarChannels    = nFvarChans;
-    desc.fvarChannels       = primvar_channels;
-
-    // Create a FarTopologyRefiner from the descriptor:
-    OpenSubdiv::Far::TopologyRefiner* refiner = getRefiner(exec_args, nRefinementLevels, desc);
-
-    //std::cout << "    GetNumFVarValuesTotal=" << refiner->GetNumFVarValuesTotal(uv_fvar_chan);
-    //std::cout << ", GetNumFacesTotal=" << refiner->GetNumFacesTotal();
-    //std::cout << ", GetNumVerticesTotal=" << refiner->GetNumVerticesTotal();
+    // VertexBuffers are already expanded to vertex rate (point-rate attribs are promoted
+    // to vertex-rate) so the UV and Cf primvars share the same fvar stencils.
+    // Always refine UV even if it's filled with zeros.
+    // TODO: support more than just UV/Cf primvars? Probably not for ScanlineRender.
+    const SubdTopologyRef topology = getTopology(exec_args,
+                                                 nRefinementLevels,
+                                                 nSrcPoints,
+                                                 nSrcFaces,
+                                                 verts_per_face,
+                                                 nSrcVerts,
+                                                 vbuffers.Pidx.data(),
+                                                 true/*with_fvars*/);
+    //std::cout << "    topology: nLevelFaces=" << topology->nLevelFaces;
+    //std::cout << ", nLevelPoints=" << topology->nLevelPoints;
+    //std::cout << ", nLevelFVars=" << topology->nLevelFVars;
     //std::cout << std::endl;
 
-    // Create a destination vertex buffer to accommodate the new verts/points to be added:
-    Fsr::PointBasedPrimitive::VertexBuffers refine_vbuffers(refiner->GetNumVerticesTotal(),
-                                                            refiner->GetNumFVarValuesTotal(uv_fvar_chan));
+    // Refine to the final level:
+    // TODO: this doesn't need to be a VertexBuffer object, just a list of vectors tied
+    // to the primvars we want to refine.
+    Fsr::Vec3fList refined_PL(topology->nLevelPoints);
+    Fsr::Vec4fList refined_UV(topology->nLevelFVars);
+    Fsr::Vec4fList refined_Cf(topology->nLevelFVars);
     {
-        // TODO: this doesn't need to be a VertexBuffer object, just a list of vectors tied
-        // to the primvars we want to refine.
-
-        // Copy the current level data:
-        memcpy(refine_vbuffers.PL.data(), vbuffers.PL.data(), sizeof(Fsr::Vec3f)*nSrcPoints);
-        memcpy(refine_vbuffers.UV.data(), vbuffers.UV.data(), sizeof(Fsr::Vec4f)*nSrcVerts );
-        memcpy(refine_vbuffers.Cf.data(), vbuffers.Cf.data(), sizeof(Fsr::Vec4f)*nSrcVerts );
-    }
-
-    // Refine mesh to desired level:
-    OpenSubdiv::Far::PrimvarRefiner primvarRefiner(*refiner);
-    OsdVec3f* srcPoints = reinterpret_cast<OsdVec3f*>(refine_vbuffers.PL.data());
-    OsdVec4f* srcUVs    = reinterpret_cast<OsdVec4f*>(refine_vbuffers.UV.data());
-    OsdVec4f* srcColors = reinterpret_cast<OsdVec4f*>(refine_vbuffers.Cf.data());
-    for (int level=1; level <= nRefinementLevels; ++level)
-    {
-        OsdVec3f* dstPoints = srcPoints + refiner->GetLevel(level-1).GetNumVertices();
-        OsdVec4f* dstUVs    = srcUVs    + refiner->GetLevel(level-1).GetNumFVarValues(uv_fvar_chan);
-        OsdVec4f* dstColors = srcColors + refiner->GetLevel(level-1).GetNumFVarValues(Cf_fvar_chan);
-
-        primvarRefiner.Interpolate(level, srcPoints, dstPoints);
-        primvarRefiner.InterpolateFaceVarying(level, srcUVs,    dstUVs,    uv_fvar_chan);
-        primvarRefiner.InterpolateFaceVarying(level, srcColors, dstColors, Cf_fvar_chan);
-
-        srcPoints = dstPoints;
-        srcUVs    = dstUVs;
-        srcColors = dstColors;
+        std::vector<StencilTask> tasks;
+        addStencilTasks<OsdVec3f>(tasks, topology->point_stencils.get(), vbuffers.PL.data(), refined_PL.data());
+        addStencilTasks<OsdVec4f>(tasks, topology->fvar_stencils.get(),  vbuffers.UV.data(), refined_UV.data());
+        addStencilTasks<OsdVec4f>(tasks, topology->fvar_stencils.get(),  vbuffers.Cf.data(), refined_Cf.data());
+        applyStencilTasks(tasks);
     }
 
     // Copy refined point/vert data back to source vbuffer.
-    // We need to expand out the point/vert indices back to the flattened point-rate/vertex-rate:
-    const OpenSubdiv::Far::TopologyLevel& refLastLevel = refiner->GetLevel(nRefinementLevels);
-
-    const int32_t nLevelFaces  = refLastLevel.GetNumFaces();
-    const int32_t nLevelVerts  = nLevelFaces*4; // always quads
-    const int32_t nLevelPoints = refLastLevel.GetNumVertices();
-    const int32_t nLevelUVs    = refLastLevel.GetNumFVarValues(uv_fvar_chan);
-    const int32_t nLevelColors = refLastLevel.GetNumFVarValues(Cf_fvar_chan);
-    //std::cout << "    refLastLevel: nLevelFaces=" << nLevelFaces;
-    //std::cout << ", nLevelPoints=" << nLevelPoints;
-    //std::cout << ", nLevelUVs=" << nLevelUVs;
-    //std::cout << ", nLevelColors=" << nLevelColors;
-
-    // Gets the starting vert index in the highest refinement level:
-    const int32_t levelPointsStart = (refiner->GetNumVerticesTotal()               - nLevelPoints);
-    const int32_t levelUVsStart    = (refiner->GetNumFVarValuesTotal(uv_fvar_chan) - nLevelUVs   );
-    const int32_t levelColorsStart = (refiner->GetNumFVarValuesTotal(Cf_fvar_chan) - nLevelColors);
-    //std::cout << ",levelPointsStart=" << levelPointsStart;
-    //std::cout << ", levelUVsStart=" << levelUVsStart;
-    //std::cout << ", levelColorsStart=" << levelColorsStart;
-    //std::cout << std::endl;
-
-    vbuffers.resizePoints(nLevelPoints);
+    // We need to expand out the vert indices back to the flattened vertex-rate:
+    const size_t nLevelVerts = topology->face_point_indices.size();
+    vbuffers.resizePoints(topology->nLevelPoints);
     vbuffers.resizeVerts(nLevelVerts);
-    vbuffers.setAllQuadsMode(); // no need to fill vbuffers.vertsPerFace
+    if (topology->nFaceVerts == 3)
+        vbuffers.setAllTrisMode(); // no need to fill vbuffers.vertsPerFace
+    else
+        vbuffers.setAllQuadsMode(); // no need to fill vbuffers.vertsPerFace
 
     // Point data is copied straight over:
-    //std::cout << "   refine_vbuffers: numPoints=" << refine_vbuffers.numPoints();
-    //std::cout << ", numVerts=" << refine_vbuffers.numVerts();
-    //std::cout << std::endl;
-    assert((levelPointsStart + nLevelPoints) <= refine_vbuffers.numPoints());
-    memcpy(vbuffers.PL.data(), refine_vbuffers.PL.data()+levelPointsStart, sizeof(Fsr::Vec3f)*nLevelPoints);
+    vbuffers.PL.swap(refined_PL);
 
-    uint32_t v0 = 0; // global vert count
-    for (int32_t f=0; f < nLevelFaces; ++f)
+    const std::vector<int32_t>& face_fvar_indices = topology->face_fvar_indices;
+    for (size_t v=0; v < nLevelVerts; ++v)
     {
-        const OpenSubdiv::Far::ConstIndexArray fPidx = refLastLevel.GetFaceVertices(f);
-#if DEBUG
-        assert(fPidx.size() == 4); // all refined Catmull faces should be quads
-#endif
-        for (int i=0; i < 4; ++i)
-            vbuffers.Pidx[v0+i] = fPidx[i];
-
-        // Flatten-copy the primvar values back the VertexBuffer vert-rate buffers:
-        {
-            // TODO: these should be in a primvar loop
-            const OpenSubdiv::Far::ConstIndexArray fUVidx = refLastLevel.GetFaceFVarValues(f, uv_fvar_chan);
-            for (int i=0; i < 4; ++i)
-                vbuffers.UV[v0+i] = refine_vbuffers.UV[levelUVsStart + fUVidx[i]];
-
-            const OpenSubdiv::Far::ConstIndexArray fCfidx = refLastLevel.GetFaceFVarValues(f, Cf_fvar_chan);
-            for (int i=0; i < 4; ++i)
-                vbuffers.Cf[v0+i] = refine_vbuffers.Cf[levelColorsStart + fCfidx[i]];
-        }
-
-        v0 += 4;
+        vbuffers.Pidx[v] = topology->face_point_indices[v];
+        vbuffers.UV[v]   = refined_UV[face_fvar_indices[v]];
+        vbuffers.Cf[v]   = refined_Cf[face_fvar_indices[v]];
     }
 
 }
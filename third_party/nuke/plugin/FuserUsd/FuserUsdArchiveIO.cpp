@@ -57,6 +57,9 @@
 #  pragma GCC diagnostic pop
 #endif
 
+#include <algorithm>
+#include <sys/stat.h>
+
 
 namespace Fsr {
 
@@ -482,9 +485,99 @@ findSelectedNodes(Pxr::UsdPrim                      prim,
 
 
 //! Map of shared PopulationMasks keyed by stage hash:
-typedef std::unordered_map<uint64_t, StageCacheReference*> SharedStageCacheReferenceMap;
+typedef std::unordered_map<uint64_t, StageCacheReferenceRef> SharedStageCacheReferenceMap;
 static SharedStageCacheReferenceMap m_shared_stage_references;
 
+// Cache limits, counters and LRU access stamp, guarded by m_lock:
+static size_t   m_stage_max_count   = 64;
+static size_t   m_stage_max_bytes   = size_t(4096)*1024*1024;
+static uint64_t m_stage_access      = 0;
+static uint64_t m_stage_hits        = 0;
+static uint64_t m_stage_misses      = 0;
+static uint64_t m_stage_evictions   = 0;
+
+
+/*! Order eviction candidates oldest access first.
+*/
+static bool
+stageAccessedBefore(const std::pair<uint64_t, StageCacheReferenceRef>& a,
+               const std::pair<uint64_t, StageCacheReferenceRef>& b)
+{
+    return (a.second->m_last_access < b.second->m_last_access);
+}
+
+
+/*! Remove the least-recently-used references until the cache is within its
+    limits, skipping 'keep' and any whose stage is still held by a FuserUsdNode.
+    The stage ids of the removed references are returned in 'evicted_ids' so
+    they can be erased from the UsdUtilsStageCache after m_lock is released.
+    m_lock must be held.
+*/
+/*static*/
+void
+StageCacheReference::evictLocked(const StageCacheReference* keep,
+                                 std::vector<std::string>&  evicted_ids)
+{
+    size_t bytes = 0;
+    for (SharedStageCacheReferenceMap::const_iterator it=m_shared_stage_references.begin();
+         it != m_shared_stage_references.end(); ++it)
+        bytes += it->second->m_resident_bytes;
+
+    size_t count = m_shared_stage_references.size();
+    if ((m_stage_max_count == 0 || count <= m_stage_max_count) &&
+        (m_stage_max_bytes == 0 || bytes <= m_stage_max_bytes))
+        return;
+
+    std::vector<std::pair<uint64_t, StageCacheReferenceRef> > candidates(m_shared_stage_references.begin(),
+                                                                          m_shared_stage_references.end());
+    std::sort(candidates.begin(), candidates.end(), stageAccessedBefore);
+
+    Pxr::UsdStageCache& stage_cache = Pxr::UsdUtilsStageCache::Get();
+    for (size_t i=0; i < candidates.size(); ++i)
+    {
+        if ((m_stage_max_count == 0 || count <= m_stage_max_count) &&
+            (m_stage_max_bytes == 0 || bytes <= m_stage_max_bytes))
+            break;
+
+        const StageCacheReferenceRef& stage_reference = candidates[i].second;
+        if (stage_reference.get() == keep)
+            continue;
+
+        // Skip it if anything besides the map entry and the candidate
+        // copy is holding the reference, ie a reader that's still
+        // acquiring the stage and hasn't filled in m_stage_id yet:
+        if (stage_reference.use_count() > 2)
+            continue;
+
+        if (!stage_reference->m_stage_id.empty())
+        {
+            // Skip it if anything besides the stage cache and this
+            // local ref is holding onto the stage:
+            Pxr::UsdStageRefPtr stage = stage_cache.Find(Pxr::UsdStageCache::Id::FromString(stage_reference->m_stage_id));
+            if (stage && stage->GetCurrentCount() > 2)
+                continue;
+            evicted_ids.push_back(stage_reference->m_stage_id);
+        }
+
+        bytes -= std::min(bytes, stage_reference->m_resident_bytes);
+        --count;
+        m_shared_stage_references.erase(candidates[i].first);
+        ++m_stage_evictions;
+    }
+}
+
+
+/*! Erase stages from the UsdUtilsStageCache. This may destroy the stage
+    which can be slow, so it's done outside of m_lock.
+*/
+static void
+eraseStages(const std::vector<std::string>& stage_ids)
+{
+    Pxr::UsdStageCache& stage_cache = Pxr::UsdUtilsStageCache::Get();
+    for (size_t i=0; i < stage_ids.size(); ++i)
+        stage_cache.Erase(Pxr::UsdStageCache::Id::FromString(stage_ids[i]));
+}
+
 
 /*! Create or update a shared StageCacheReference, keyed by 'hash'.
 
@@ -493,37 +586,50 @@ static SharedStageCacheReferenceMap m_shared_stage_references;
     'stage_id' if cleared to ''.
 */
 /*static*/
-StageCacheReference*
+StageCacheReferenceRef
 StageCacheReference::createStageReference(uint64_t                        hash,
                                           const std::vector<std::string>& paths)
 {
     // If it already exists get the reference:
-    StageCacheReference* stage_reference = findStageReference(hash);
+    StageCacheReferenceRef stage_reference = findStageReference(hash);
 
-    std::lock_guard<std::mutex> guard(m_lock);
-    if (!stage_reference)
+    std::vector<std::string> evicted_ids;
     {
-        stage_reference = new StageCacheReference();
-        m_shared_stage_references[hash] = stage_reference;
-    }
-    assert(stage_reference);
-
-    for (size_t j=0; j < paths.size(); ++j)
-    {
-        if (!paths[j].empty())
-            stage_reference->m_populate_mask.Add(Pxr::SdfPath(paths[j]));
-    }
+        std::lock_guard<std::mutex> guard(m_lock);
+        if (!stage_reference)
+        {
+            stage_reference = StageCacheReferenceRef(new StageCacheReference());
+            m_shared_stage_references[hash] = stage_reference;
+        }
+        assert(stage_reference);
 
-    // Stage ID will get assigned in first unique getStage() call for this hash
-    // and is returned by the UsdStageCache.
-    stage_reference->m_stage_id = ""; 
+        for (size_t j=0; j < paths.size(); ++j)
+        {
+            if (!paths[j].empty())
+                stage_reference->m_populate_mask.Add(Pxr::SdfPath(paths[j]));
+        }
 
-    // A unique session layer needs to exist for each unique stage hash so
-    // that the UsdStageCacheRequest finds the correct cache.
-    // If only file name, root layer and populate mask are used as keys we
-    // don't get unique stages in the cache that can have modifications done
-    // on them:
-    stage_reference->m_session_layer = Pxr::SdfLayer::CreateAnonymous();
+        // The previous stage won't be found again once the session layer is
+        // replaced, so release it rather than leaving it in the stage cache:
+        if (!stage_reference->m_stage_id.empty())
+            evicted_ids.push_back(stage_reference->m_stage_id);
+
+        // Stage ID will get assigned in first unique getStage() call for this hash
+        // and is returned by the UsdStageCache.
+        stage_reference->m_stage_id       = ""; 
+        stage_reference->m_resident_bytes = 0;
+        stage_reference->m_last_access    = ++m_stage_access;
+
+        // A unique session layer needs to exist for each unique stage hash so
+        // that the UsdStageCacheRequest finds the correct cache.
+        // If only file name, root layer and populate mask are used as keys we
+        // don't get unique stages in the cache that can have modifications done
+        // on them:
+        stage_reference->m_session_layer = Pxr::SdfLayer::CreateAnonymous();
+
+        evictLocked(stage_reference.get()/*keep*/, evicted_ids);
+    }
+    eraseStages(evicted_ids);
 
     return stage_reference;
 }
@@ -532,31 +638,90 @@ StageCacheReference::createStageReference(uint64_t                        hash,
 /*! Find a shared StageCacheReference, keyed by 'hash'.
 */
 /*static*/
-StageCacheReference*
+StageCacheReferenceRef
 StageCacheReference::findStageReference(uint64_t hash)
 {
     std::lock_guard<std::mutex> guard(m_lock);
     SharedStageCacheReferenceMap::const_iterator it = m_shared_stage_references.find(hash);
-    return (it != m_shared_stage_references.end()) ? it->second : NULL;
+    if (it == m_shared_stage_references.end())
+    {
+        ++m_stage_misses;
+        return StageCacheReferenceRef();
+    }
+    ++m_stage_hits;
+    it->second->m_last_access = ++m_stage_access;
+    return it->second;
 }
 
 
-#if 0
-/*! Find and remove a shared StageCacheReference keyed by 'hash'.
+/*!
 */
 /*static*/
 void
-StageCacheReference::removeStageReference(uint64_t hash)
+StageCacheReference::setCacheLimits(size_t max_count,
+                                    size_t max_bytes)
 {
-    std::lock_guard<std::mutex> guard(m_lock);
-    SharedStageCacheReferenceMap::const_iterator it = m_shared_stage_references.find(hash);
-    if (it != m_shared_stage_references.end())
+    std::vector<std::string> evicted_ids;
     {
-        delete it->second;
-        m_shared_stage_references.erase(it);
+        std::lock_guard<std::mutex> guard(m_lock);
+        if (max_count == m_stage_max_count && max_bytes == m_stage_max_bytes)
+            return;
+        m_stage_max_count = max_count;
+        m_stage_max_bytes = max_bytes;
+        evictLocked(NULL/*keep*/, evicted_ids);
     }
+    eraseStages(evicted_ids);
+}
+
+
+/*!
+*/
+/*static*/
+void
+StageCacheReference::setCacheLimits(const Fsr::ArgSet& args)
+{
+    if (!args.has(Arg::Scene::file_archive_cache_max_count) ||
+        !args.has(Arg::Scene::file_archive_cache_max_mb))
+        return;
+    setCacheLimits(size_t(std::max(0, args.getInt(Arg::Scene::file_archive_cache_max_count))),
+                   size_t(std::max(0, args.getInt(Arg::Scene::file_archive_cache_max_mb)))*1024*1024);
+}
+
+
+/*!
+*/
+/*static*/
+StageCacheReference::CacheStats
+StageCacheReference::getCacheStats()
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    CacheStats stats;
+    stats.hits      = m_stage_hits;
+    stats.misses    = m_stage_misses;
+    stats.evictions = m_stage_evictions;
+    stats.count     = m_shared_stage_references.size();
+    for (SharedStageCacheReferenceMap::const_iterator it=m_shared_stage_references.begin();
+         it != m_shared_stage_references.end(); ++it)
+        stats.bytes += it->second->m_resident_bytes;
+    return stats;
+}
+
+
+/*!
+*/
+/*static*/
+void
+StageCacheReference::printCacheStats(const char*   prefix,
+                                     std::ostream& o)
+{
+    const CacheStats stats = getCacheStats();
+    o << prefix << "stage cache:";
+    o << " hits=" << stats.hits << " misses=" << stats.misses;
+    o << " evictions=" << stats.evictions;
+    o << " stages=" << stats.count;
+    o << " resident=" << double(stats.bytes)/(1024.0*1024.0) << "MB";
+    o << std::endl;
 }
-#endif
 
 
 //-------------------------------------------------------------------------------
@@ -895,10 +1060,25 @@ StageCacheReference::getStage(const std::string& scene_file,
         }
     }
 
+    // Approximate the stage's resident cost from the size of the layer
+    // files it's composed from:
+    size_t resident_bytes = 0;
+    {
+        const Pxr::SdfLayerHandleVector used_layers = stage->GetUsedLayers(true/*includeClipLayers*/);
+        for (size_t i=0; i < used_layers.size(); ++i)
+        {
+            const std::string& path = used_layers[i]->GetRealPath();
+            struct stat st;
+            if (!path.empty() && stat(path.c_str(), &st) == 0)
+                resident_bytes += size_t(st.st_size);
+        }
+    }
+
     // Update the reference with the new stage ID:
     {
         std::lock_guard<std::mutex> guard(m_lock);
-        m_stage_id = stage_cache.GetId(stage).ToString();
+        m_stage_id       = stage_cache.GetId(stage).ToString();
+        m_resident_bytes = resident_bytes;
     }
 
     if (debug_stage)
@@ -1001,7 +1181,8 @@ FuserUsdArchiveIO::_execute(const Fsr::NodeContext& target_context,
                     std::cout << "       *************  OPEN ARCHIVE (GEO) *************" << std::endl;
 
                 // Create stage with the provided population mask:
-                StageCacheReference* stage_reference =
+                StageCacheReference::setCacheLimits(args());
+                StageCacheReferenceRef stage_reference =
                     StageCacheReference::createStageReference(cache_ctx->archive_context_hash.value(),
                                                               *populate_mask);
                 assert(stage_reference);
@@ -1014,7 +1195,10 @@ FuserUsdArchiveIO::_execute(const Fsr::NodeContext& target_context,
                 *cache_id = stage_reference->stageId();
 
                 if (debug_archive)
+                {
                     std::cout << "         new cache_id=" << *cache_id << std::endl;
+                    StageCacheReference::printCacheStats("         ", std::cout);
+                }
 
             }
             else if (archive_command == Arg::Scene::file_archive_invalidate)
@@ -49,6 +49,9 @@
 #  pragma GCC diagnostic pop
 #endif
 
+#include <iostream>
+#include <memory>
+
 
 namespace Fsr {
 
@@ -71,7 +74,16 @@ Pxr::UsdPrim findFirstMatchingPrim(const Pxr::UsdStageRefPtr& stage,
 //-------------------------------------------------------------------------------
 
 
-/*!
+class StageCacheReference;
+typedef std::shared_ptr<StageCacheReference> StageCacheReferenceRef;
+
+
+/*! Shared reference to a stage in the UsdUtilsStageCache, keyed by stage hash.
+
+    The references are kept in a session-wide cache bounded by a count and an
+    approximate memory limit. When exceeded the least-recently-used references
+    whose stage is not held by any FuserUsdNode are deleted and their stages
+    erased from the UsdUtilsStageCache.
 */
 class StageCacheReference
 {
@@ -80,11 +92,27 @@ class StageCacheReference
     Pxr::UsdStagePopulationMask m_populate_mask;    //!< Populate mask to use for stage open and retrieval
     std::string                 m_stage_id;         //!< Stage cache identifier string returned from Pxr::UsdStageCache
     Pxr::SdfLayerRefPtr         m_session_layer;    //!< This layer must be unique per stage hash so caches are also unique
+    size_t                      m_resident_bytes;   //!< Approximate stage size, from the sizes of its used layer files
+    uint64_t                    m_last_access;      //!< Access stamp for LRU eviction
+
+
+  public:
+    /*! Stage reference cache counters. */
+    struct CacheStats
+    {
+        uint64_t hits;          //!< findStageReference() calls that found a reference
+        uint64_t misses;        //!< findStageReference() calls that didn't
+        uint64_t evictions;     //!< References deleted (and stages erased) to stay within the limits
+        size_t   count;         //!< Currently cached references
+        size_t   bytes;         //!< Approximate resident bytes of the cached stages
+
+        CacheStats() : hits(0), misses(0), evictions(0), count(0), bytes(0) {}
+    };
 
 
   public:
     //!
-    StageCacheReference() {}
+    StageCacheReference() : m_resident_bytes(0), m_last_access(0) {}
 
     //! Copy ctor
     StageCacheReference(const StageCacheReference& b) { *this = b; }
@@ -92,10 +120,12 @@ class StageCacheReference
     //! Copy operator
     const StageCacheReference& operator = (const StageCacheReference& b)
     {
-        m_root_layer    = b.m_root_layer;
-        m_populate_mask = b.m_populate_mask;
-        m_stage_id      = b.m_stage_id;
-        m_session_layer = b.m_session_layer;
+        m_root_layer     = b.m_root_layer;
+        m_populate_mask  = b.m_populate_mask;
+        m_stage_id       = b.m_stage_id;
+        m_session_layer  = b.m_session_layer;
+        m_resident_bytes = b.m_resident_bytes;
+        m_last_access    = b.m_last_access;
         return *this;
     }
 
@@ -113,13 +143,37 @@ class StageCacheReference
 
 
   public:
-    //! Create a shared StageCacheReference keyed by 'hash'. parent_path and stage_id are optional.
-    static StageCacheReference* createStageReference(uint64_t                        hash,
-                                                     const std::vector<std::string>& paths);
+    /*! Create a shared StageCacheReference keyed by 'hash'. parent_path and stage_id are optional.
+        Evicts unused references if the cache is over its limits, except for this one.
+    */
+    static StageCacheReferenceRef createStageReference(uint64_t                        hash,
+                                                       const std::vector<std::string>& paths);
 
     //! Find a shared StageCacheReference keyed by 'hash'.
-    static StageCacheReference* findStageReference(uint64_t hash);
+    static StageCacheReferenceRef findStageReference(uint64_t hash);
+
+
+    //! Set the cache limits, evicting references if they're now exceeded. 0 means no limit.
+    static void setCacheLimits(size_t max_count,
+                               size_t max_bytes);
+
+    //! Set the cache limits from Arg::Scene::file_archive_cache_* args, if they exist.
+    static void setCacheLimits(const Fsr::ArgSet& args);
 
+    //! Get the current cache counters.
+    static CacheStats getCacheStats();
+
+    //! Print the cache counters to a stream.
+    static void printCacheStats(const char*   prefix,
+                                std::ostream& o);
+
+
+  protected:
+    /*! Delete LRU references until within the limits. Cache lock must be held.
+        Skips 'keep', references held outside the cache, and stages still in use.
+    */
+    static void evictLocked(const StageCacheReference* keep,
+                            std::vector<std::string>&  evicted_ids);
 
 };
 
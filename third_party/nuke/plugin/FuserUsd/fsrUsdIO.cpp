@@ -321,8 +321,12 @@ Fsr::Node* buildUsdNode(const char*        builder_class,
         return new FuserUsdArchiveIO(args); // node should be immediately executed and discarded
 
 
+    // Update the stage cache limits before any new stage gets added:
+    StageCacheReference::setCacheLimits(args);
+
     // Get the shared stage reference from the static list keyed to archive_context_hash.
-    StageCacheReference* stage_reference = NULL;
+    // Holding the ref keeps it from being evicted while the stage is acquired:
+    StageCacheReferenceRef stage_reference;
 
     // If stage hash is non-default check for an existing stage cache:
     if (archive_context_hash != Fsr::defaultHashValue)
@@ -354,6 +354,9 @@ zpRender::zpRender(::Node* node) :
     rtx.k_pixel_filter_size[0]   = rtx.k_pixel_filter_size[1] = 1.5f;
     rtx.k_shading_interpolation  = RenderContext::SHADING_SMOOTH;
     rtx.k_spatial_jitter_threshold = 2; // start jittering at 2 or greater pixel samples
+    rtx.k_adaptive_sampling      = false;
+    rtx.k_adaptive_min_samples   = 16;
+    rtx.k_adaptive_threshold     = 0.01f;
     rtx.k_output_bbox_mode       = RenderContext::BBOX_SCENE_SIZE;
     rtx.k_sides_mode             = RenderContext::SIDES_BOTH;
 
@@ -419,10 +422,18 @@ zpRender::zpRender(::Node* node) :
     rtx.k_alpha_threshold            = 0.0001f;
     rtx.k_dof_enabled                = false;
     rtx.k_dof_max_radius             = 0.1f;
+    rtx.k_bvh_wide_traversal         = true;
+    rtx.k_bvh_build_method           = zpr::BVH_BUILD_BINNED_SAH;
+    rtx.k_light_samples              = 0;
+    rtx.k_texture_cache_size         = 2048;
+    rtx.k_render_stats               = false;
+    rtx.k_render_stats_file          = "";
 
     k_shutter_mode               = SHUTTER_STOCHASTIC;
 
     k_coverage_chan              = channel("mask.coverage");
+    k_samples_chan               = Chan_Black;
+    k_cost_chan[0] = k_cost_chan[1] = k_cost_chan[2] = Chan_Black;
     k_cutout_channel             = Chan_Mask;
 
     k_render_mask_channel        = Chan_Black;
@@ -1252,6 +1263,11 @@ zpRender::knobs(DD::Image::Knob_Callback f)
         Tooltip(f, "Turn on lights.  This also is a prerequisite for atmospherics.");
     Bool_knob(f, &k_use_indirect_lighting, "bounce_lighting_enabled", "bounce lighting");
         Tooltip(f, "Enable indirect lighting.");
+    Int_knob(f, &rtx.k_light_samples, IRange(0, 64), "light_samples", "light samples");
+        Tooltip(f, "Number of lights to importance-sample at each shading point.  0 evaluates every light.\n"
+                   "With many lights in the scene this picks a subset weighted by each light's power, distance "
+                   "and influence bounds so the shading cost no longer grows with the light count.  More samples "
+                   "trade render time for less lighting noise.  Only used when there are more lights than samples.");
     Newline(f);
 
     Bool_knob(f, &k_use_atmospheric_lighting, "atmospherics_enabled", "atmospherics");
@@ -1319,6 +1335,22 @@ zpRender::knobs(DD::Image::Knob_Callback f)
         Tooltip(f, "When to enable the spatial (X/Y) jittering of the sampling screen location.\n"
                    "If this is 2 then any pixel sample value >= 2 will have spatial jitter.\n"
                    "The amount is scaled by the pixel filter size.");
+    Newline(f);
+    Bool_knob(f, &rtx.k_adaptive_sampling, "adaptive_sampling", "adaptive sampling");
+        SetFlags(f, Knob::STARTLINE);
+        Tooltip(f, "Stop sampling a pixel early once its color and AOV values have converged.\n"
+                   "The full-quality pixel sample count is the maximum number of samples, and "
+                   "'min samples' are always taken before the first convergence check.\n"
+                   "Deep output and diagnostic modes always take all samples.");
+    Int_knob(f, &rtx.k_adaptive_min_samples, IRange(2, 64), "adaptive_min_samples", "min samples");
+        SetFlags(f, Knob::NO_MULTIVIEW | Knob::NO_ANIMATION);
+        ClearFlags(f, Knob::SLIDER | Knob::STARTLINE);
+        Tooltip(f, "Number of samples always taken before checking pixel convergence.");
+    Float_knob(f, &rtx.k_adaptive_threshold, IRange(0.0, 0.1), "adaptive_threshold", "threshold");
+        SetFlags(f, Knob::NO_MULTIVIEW | Knob::NO_ANIMATION);
+        ClearFlags(f, Knob::STARTLINE);
+        Tooltip(f, "A pixel stops sampling when the standard error of every channel is below this "
+                   "value.  The error is absolute for values below 1 and relative to the value above 1.");
 
     Newline(f);
     Enumeration_knob(f, &rtx.k_pixel_filter, Filter::NAMES, "pixel_filter", "pixel filter");
@@ -1338,6 +1370,15 @@ zpRender::knobs(DD::Image::Knob_Callback f)
                    "eliminate antialiasing or motionblur effects.  Use the 'unpremult' switches "
                    "on the 'outputs' tab to have this done for each output.");
     Newline(f);
+    Channel_knob(f, &k_samples_chan, 1, "samples_channel", "pixel samples used");
+        Tooltip(f, "Output the number of samples taken for each pixel to this channel.  This is "
+                   "mostly useful for checking the adaptive sampling settings.");
+    Newline(f);
+    Channel_knob(f, k_cost_chan, 3, "cost_channels", "pixel cost");
+        Tooltip(f, "Output the cost of rendering each pixel to these channels - the number of rays "
+                   "cast, the number of Bvh nodes visited, and the time taken in microseconds.  "
+                   "Only written for flat output.");
+    Newline(f);
     Channel_knob(f, &k_cutout_channel, 1/*channels*/, "cutout_channel", "cutout channel");
         Tooltip(f, "Shaders use this channel to pass cutout info back to renderer.  This needs to match the "
                    "shader settings so that front-to-back rendering order is handled "
@@ -1350,6 +1391,12 @@ zpRender::knobs(DD::Image::Knob_Callback f)
     texture_filter_.knobs(f, "texture_filter", "full-quality:");
         ClearFlags(f, Knob::STARTLINE);
         Tooltip(f, texture_filter_tooltip);
+    Int_knob(f, &rtx.k_texture_cache_size, IRange(64, 16384), "texture_cache_size", "texture cache MB");
+        SetFlags(f, Knob::NO_MULTIVIEW | Knob::NO_ANIMATION);
+        ClearFlags(f, Knob::SLIDER);
+        Tooltip(f, "Memory budget in megabytes for texture tiles and mip levels.  This is shared by "
+                   "all renderers in the session and the least-recently-used tiles are released when "
+                   "it's exceeded.  Turn on debug to print the cache hit/miss/eviction counts.");
 
     //-------------------------------------------------------------------------------
     Divider(f);
@@ -1446,6 +1493,23 @@ zpRender::knobs(DD::Image::Knob_Callback f)
 #endif
 
     //-------------------------------------------------------------------------------
+    Divider(f);
+    Bool_knob(f, &rtx.k_bvh_wide_traversal, "bvh_wide_traversal", "4-wide bvh traversal");
+        SetFlags(f, Knob::NO_MULTIVIEW | Knob::NO_ANIMATION);
+        Tooltip(f, "Collapse the primitive BVHs into 4-wide nodes and test a ray against "
+                   "all four child bboxes at once with SIMD instructions.  Mesh leaves also "
+                   "hold up to 4 triangles which are tested together.\n"
+                   "Turn this off to use the scalar binary BVH traversal instead, which is "
+                   "mostly useful for comparing render times.");
+    Enumeration_knob(f, &rtx.k_bvh_build_method, RenderContext::bvh_build_methods, "bvh_build_method", "bvh builder");
+        SetFlags(f, Knob::NO_MULTIVIEW | Knob::NO_ANIMATION);
+        Tooltip(f, "How the object, light and primitive BVHs are split:\n"
+                   "<b>midpoint</b>: legacy builder, splits at the mean of the bbox centers "
+                   "along the longest axis.\n"
+                   "<b>binned-sah</b>: binned surface-area-heuristic builder, slower to build "
+                   "but usually faster to trace.\n"
+                   "Switch between them with render stats enabled to compare BVH build times "
+                   "and ray traversal counts & times.");
     //Divider(f);
     //Int_knob(f, &k_bvh_max_objects_per_leaf, "bvh_max_objects_per_leaf", "bvh max objects");
     //    SetFlags(f, Knob::NO_MULTIVIEW | Knob::NO_ANIMATION);
@@ -1606,6 +1670,16 @@ zpRender::knobs(DD::Image::Knob_Callback f)
     Int_knob(f, &rtx.k_diagnostics_sample, "sample");
         ClearFlags(f, Knob::SLIDER | Knob::STARTLINE);
         SetFlags(f, Knob::NO_MULTIVIEW | Knob::NO_ANIMATION);
+    Bool_knob(f, &rtx.k_render_stats, "render_stats", "render stats");
+        SetFlags(f, Knob::STARTLINE | Knob::NO_MULTIVIEW | Knob::NO_ANIMATION);
+        Tooltip(f, "Collect ray, Bvh and shading statistics per object and per shader, along with "
+                   "object expansion and texture load times.  They're written to the stats file "
+                   "at the end of each frame, or printed to the terminal if there's no file.");
+    File_knob(f, &rtx.k_render_stats_file, "render_stats_file", "");
+        ClearFlags(f, Knob::STARTLINE);
+        SetFlags(f, Knob::NO_MULTIVIEW | Knob::NO_ANIMATION);
+        Tooltip(f, "Json file to write the render stats to.  Frame padding like '####' or "
+                   "'%04d' is replaced with the frame number so a sequence writes one file per frame.");
 
     //-------------------------------------------------------------------------------
     //-------------------------------------------------------------------------------
@@ -1968,6 +2042,9 @@ zpRender::_validate(bool for_real)
     rtx.k_shutter.append(new_hash);
     new_hash.append(rtx.k_shutter_bias);
     new_hash.append(rtx.k_spatial_jitter_threshold);
+    new_hash.append(rtx.k_adaptive_sampling);
+    new_hash.append(rtx.k_adaptive_min_samples);
+    new_hash.append(rtx.k_adaptive_threshold);
     new_hash.append(rtx.num_shutter_steps);
 
     int scene_proj_mode = DD::Image::CameraOp::LENS_PERSPECTIVE; // default
@@ -2367,6 +2444,11 @@ zpRender::_validate(bool for_real)
        rtx.render_channels += DD::Image::Mask_RGBA;
     rtx.render_channels += DD::Image::Mask_Z;  // always output Z
     rtx.render_channels += k_coverage_chan;
+    if (k_samples_chan != DD::Image::Chan_Black)
+        rtx.render_channels += k_samples_chan;
+    for (uint32_t i=0; i < 3; ++i)
+        if (k_cost_chan[i] != DD::Image::Chan_Black)
+            rtx.render_channels += k_cost_chan[i];
 
 
     if (for_real)
@@ -2796,6 +2878,9 @@ zpRender::_close()
     //rtx.destroyObjectBVHs(true/*force*/);
     //rtx.destroyLightBVHs(true/*force*/);
 
+    // Before the samplers are destroyed so their load counts are included:
+    rtx.reportRenderStats();
+
     rtx.destroyTextureSamplers();
 }
 
@@ -2864,8 +2949,13 @@ zpRender::generate_render_primitives()
 
     assert(rtx.input_scenes.size() > 0 && rtx.input_scenes[0] != 0); // shouldn't happen...
 
+    // Every frame change rebuilds the primitives, so report the previous
+    // frame's stats before its thread contexts are deleted:
+    rtx.reportRenderStats();
+
     // Delete any existing info:
     rtx.destroyAllocations(false/*force*/);
+    rtx.clearRenderStats();
 
     // Initialize the thread map & list:
     rtx.thread_list.reserve(DD::Image::Thread::numThreads);
@@ -3476,7 +3566,7 @@ zpRender::generate_render_primitives()
         // Build the primary intersection test BVH, which is simply the bboxes of all the ObjectContexts:
         if (objref_list.size() > 0)
         {
-            rtx.objects_bvh.build(objref_list, 1/*max_objects_per_leaf*/);
+            rtx.objects_bvh.build(objref_list, 1/*max_objects_per_leaf*/, zpr::BvhBuildMethod(rtx.k_bvh_build_method));
             rtx.objects_bvh.setName("object_bvh");
             rtx.objects_bvh.setGlobalOrigin(Fsr::Vec3d(0,0,0));
             //std::cout << "    object_bvh" << rtx.objects_bvh.bbox() << ", depth=" << rtx.objects_bvh.maxNodeDepth() << std::endl;
@@ -3499,6 +3589,10 @@ zpRender::generate_render_primitives()
 
         rtx.buildLightVolumeBvh();
 
+        // Importance-sampling tree for picking a subset of the lights:
+        if (rtx.direct_lighting_enabled)
+            rtx.light_sampler.build(rtx);
+
         rtx.lights_bvh_initialized = true;
 
 #else
@@ -3612,7 +3706,7 @@ zpRender::generate_render_primitives()
         // Build the primary intersection test BVH, which is simply the bboxes of all the ObjectContexts:
         if (ltvref_list.size() > 0)
         {
-            rtx.lights_bvh.build(ltvref_list, 1/*max_objects_per_leaf*/);
+            rtx.lights_bvh.build(ltvref_list, 1/*max_objects_per_leaf*/, zpr::BvhBuildMethod(rtx.k_bvh_build_method));
             rtx.objects_bvh.setName("lights_bvh");
             rtx.objects_bvh.setGlobalOrigin(Fsr::Vec3d(0,0,0));
             //std::cout << "    lights_bvh" << rtx.lights_bvh.bbox() << ", depth=" << rtx.lights_bvh.maxNodeDepth() << std::endl;
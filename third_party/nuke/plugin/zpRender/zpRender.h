@@ -149,6 +149,8 @@ class zpRender : public DD::Image::Render,
     int         k_pixel_sample_mode;            //!< Pixel sample mode for render
     //
     DD::Image::Channel k_coverage_chan;         //!< Channel to write coverage info into
+    DD::Image::Channel k_samples_chan;          //!< Channel to write the per-pixel sample count into
+    DD::Image::Channel k_cost_chan[3];          //!< Channels to write per-pixel rays, Bvh nodes and microseconds into
     DD::Image::Channel k_cutout_channel;        //!< Channel to use for cutout logic
     DD::Image::Channel k_render_mask_channel;   //!< Channel to use for render mask
     //
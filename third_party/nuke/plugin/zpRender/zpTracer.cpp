@@ -92,6 +92,51 @@ inline void mask8x8ToFloats(const SpMask8& spmask,
 //----------------------------------------------------------------------------
 
 
+//! Used to find a sample visiting stride that's coprime to the sample count.
+static inline uint32_t
+greatestCommonDivisor(uint32_t a,
+                      uint32_t b)
+{
+    while (b != 0)
+    {
+        const uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+
+/*! Returns true if the standard error of the mean of each channel is within
+    the threshold. The threshold is absolute for values below 1 and relative
+    above, so bright pixels aren't oversampled. A non-finite value never converges.
+*/
+static inline bool
+pixelConverged(const Fsr::Pixel&       sum,
+               const Fsr::Pixel&       sum_squared,
+               const Fsr::ChannelList& channels,
+               uint32_t                nSamples,
+               float                   threshold2)
+{
+    const float inv_n = 1.0f / float(nSamples);
+    const float bessel = float(nSamples) / float(nSamples - 1);
+    const uint32_t nChans = channels.size();
+    for (uint32_t i=0; i < nChans; ++i)
+    {
+        const DD::Image::Channel z = channels[i];
+        const float mean = sum[z]*inv_n;
+        const float variance = std::max(0.0f, (sum_squared[z]*inv_n - mean*mean)*bessel);
+        const float scale = std::max(1.0f, fabsf(mean));
+        if (!(variance*inv_n <= threshold2*scale*scale))
+            return false;
+    }
+    return true;
+}
+
+
+//----------------------------------------------------------------------------
+
+
 /*! TODO: change this to returning camera type string vs. an enumeration!
 */
 RenderContext::CameraProjectionType
@@ -288,6 +333,7 @@ zpRender::tracerEngine(int y, int t, int x, int r,
         thread_ctx = rtx.thread_list[thread_it->second];
     }
     assert(thread_ctx);
+    thread_ctx->stats.enabled = rtx.k_render_stats;
 
 
     //-----------------------------------------------------------------
@@ -424,6 +470,12 @@ zpRender::tracerEngine(int y, int t, int x, int r,
     Fsr::Pixel Rcolor(rtx.render_channels);   // Final combined color
     Fsr::Pixel Raccum(rtx.render_channels);   // Accumulated ray color
 
+    // Per-pixel cost is the change in the thread's stats counters:
+    const bool write_cost = (k_cost_chan[0] != DD::Image::Chan_Black ||
+                             k_cost_chan[1] != DD::Image::Chan_Black ||
+                             k_cost_chan[2] != DD::Image::Chan_Black);
+    const zpr::RenderStats& thread_stats = thread_ctx->stats;
+
 
     DD::Image::TextureFilter* shading_texture_filter = NULL;
     if (!rtx.k_preview_mode)
@@ -480,6 +532,54 @@ zpRender::tracerEngine(int y, int t, int x, int r,
     }
 
 
+    //-----------------------------------------------------------------
+    // Adaptive sampling:
+    //
+    // After the minimum sample count the per-pixel variance of the color
+    // and AOV channels is checked every few samples, and the pixel stops
+    // sampling once the standard error of every channel is within the
+    // threshold. The sample set size is the maximum count.
+    //
+    // Deep output always takes all the samples as each subpixel mask bin
+    // must be visited to produce correct deep coverage. The diagnostic
+    // modes also rely on the fixed sample indices.
+    //
+    const bool adaptive_sampling = (rtx.k_adaptive_sampling &&
+                                    flat_output_mode &&
+                                    rtx.k_show_diagnostics == RenderContext::DIAG_OFF &&
+                                    nSamples > 2);
+    const uint32_t adaptive_min_samples = std::min(uint32_t(std::max(2, rtx.k_adaptive_min_samples)), nSamples);
+    const uint32_t adaptive_check_interval = 4;
+    const float    adaptive_threshold2 = rtx.k_adaptive_threshold*rtx.k_adaptive_threshold;
+
+    // Channels to check for convergence, skipping ones that don't
+    // accumulate like colors:
+    DD::Image::ChannelSet adaptive_channels(rtx.render_channels);
+    adaptive_channels -= DD::Image::Mask_Z;
+    adaptive_channels -= DD::Image::Mask_Deep;
+    adaptive_channels -= k_coverage_chan;
+    adaptive_channels -= k_samples_chan;
+    adaptive_channels -= k_cost_chan[0];
+    adaptive_channels -= k_cost_chan[1];
+    adaptive_channels -= k_cost_chan[2];
+    adaptive_channels -= k_cutout_channel;
+    const Fsr::ChannelList adaptive_chan_list(adaptive_channels);
+    const uint32_t nAdaptiveChans = adaptive_chan_list.size();
+
+    Fsr::Pixel Raccum2(adaptive_channels); // Accumulated squared ray color
+
+    // The multi-uniform sample pattern is in scanline order, so visit the
+    // samples with a stride coprime to the count so that any leading
+    // subset is spread over the whole pixel:
+    uint32_t adaptive_stride = 1;
+    if (adaptive_sampling)
+    {
+        adaptive_stride = std::max(1u, uint32_t(float(nSamples)*0.618034f));
+        while (adaptive_stride > 1 && greatestCommonDivisor(adaptive_stride, nSamples) != 1)
+            --adaptive_stride;
+    }
+
+
     // Camera ray clipping plane overrides:
     const double camera_near_plane_override = fabs(std::min(k_ray_near_plane, k_ray_far_plane));
     const double camera_far_plane_override  = fabs(std::max(k_ray_near_plane, k_ray_far_plane));
@@ -693,10 +793,23 @@ zpRender::tracerEngine(int y, int t, int x, int r,
             // Clear output value accumulators:
             //
             Raccum.clearAllChannels();
+            if (adaptive_sampling)
+                Raccum2.clearAllChannels();
     
             float coverage = 0.0f;
+            uint32_t nPixelSamples = nSamples; // reduced if adaptive sampling stops early
             float accum_Z = std::numeric_limits<float>::infinity();
 
+            uint64_t cost_rays  = 0;
+            uint64_t cost_nodes = 0;
+            int64_t  cost_start = 0;
+            if (write_cost)
+            {
+                cost_rays  = thread_stats.totalRays();
+                cost_nodes = thread_stats.bvh_nodes;
+                cost_start = zpr::RenderStats::now();
+            }
+
             deep_accum_list.clear();
             deep_intersection_map.clear();
 
@@ -725,8 +838,11 @@ zpRender::tracerEngine(int y, int t, int x, int r,
             // Sampling loop! This is where the magic happens...
             //
 
-            for (uint32_t sample_index=0; sample_index < nSamples; ++sample_index)
+            for (uint32_t sample_count=0; sample_count < nSamples; ++sample_count)
             {
+                const uint32_t sample_index = (adaptive_sampling) ?
+                                                (sample_count*adaptive_stride) % nSamples :
+                                                    sample_count;
                 //std::cout << xx << "," << y << ": sample " << sample_index << std::endl;
 
                 //-----------------------------------------------------------------
@@ -1480,6 +1596,29 @@ zpRender::tracerEngine(int y, int t, int x, int r,
 
                 } // lens/uv proj?
 
+
+                //-----------------------------------------------------------------
+                // Accumulate squared values and stop sampling if the pixel
+                // has converged:
+                //
+                if (adaptive_sampling)
+                {
+                    for (uint32_t i=0; i < nAdaptiveChans; ++i)
+                    {
+                        const DD::Image::Channel z = adaptive_chan_list[i];
+                        Raccum2[z] += Rcolor[z]*Rcolor[z];
+                    }
+
+                    const uint32_t nTaken = sample_count + 1;
+                    if (nTaken >= adaptive_min_samples && nTaken < nSamples &&
+                        ((nTaken - adaptive_min_samples) % adaptive_check_interval) == 0 &&
+                        pixelConverged(Raccum, Raccum2, adaptive_chan_list, nTaken, adaptive_threshold2))
+                    {
+                        nPixelSamples = nTaken;
+                        break; // done!
+                    }
+                }
+
             } // samples loop
 
 
@@ -1492,11 +1631,25 @@ zpRender::tracerEngine(int y, int t, int x, int r,
                 //======================================================================================
                 // FLAT:
                 //
-                const float final_weight = (nSamples > 1) ? 1.0f/float(nSamples) : 1.0f;
+                // Samples are unweighted so normalize by the count actually taken.
+                // If the pf_weights are re-enabled this needs to be the sum of
+                // the weights used as they only average 1 over the full set:
+                const float final_weight = (nPixelSamples > 1) ? 1.0f/float(nPixelSamples) : 1.0f;
                 coverage *= final_weight;
                 // Final color:
                 Raccum *= final_weight;
                 Raccum[k_coverage_chan] = coverage;
+                if (k_samples_chan != DD::Image::Chan_Black)
+                    Raccum[k_samples_chan] = float(nPixelSamples);
+                if (write_cost)
+                {
+                    if (k_cost_chan[0] != DD::Image::Chan_Black)
+                        Raccum[k_cost_chan[0]] = float(thread_stats.totalRays() - cost_rays);
+                    if (k_cost_chan[1] != DD::Image::Chan_Black)
+                        Raccum[k_cost_chan[1]] = float(thread_stats.bvh_nodes - cost_nodes);
+                    if (k_cost_chan[2] != DD::Image::Chan_Black)
+                        Raccum[k_cost_chan[2]] = float(double(zpr::RenderStats::now() - cost_start)*1.0e-3);
+                }
 
                 const uint32_t nAOVs = (uint32_t)rtx.aov_outputs.size();
                 if (nAOVs > 0 && coverage > 0.0f)